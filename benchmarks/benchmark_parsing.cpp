@@ -0,0 +1,143 @@
+#include "mesytec_buffer_reader.h"
+#include "mesytec_mfm_frame.h"
+#include "mesytec_data_generator.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+/**
+  Micro-benchmarks of the parsing & encoding code of the library, using synthetic data
+  produced by mesytec::data_generator for the modules of a crate map.
+
+  Usage: benchmark_parsing [crate_map.dat] [number_of_events]
+*/
+
+namespace
+{
+   struct benchmark_timer
+   {
+      std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+      double seconds() const
+      {
+         return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+      }
+   };
+
+   template<typename Function>
+   void run_benchmark(const std::string& name, size_t events, size_t words, Function F, int repeat=3)
+   {
+      // run benchmark several times & report the fastest
+      double best = 1.e30;
+      uint64_t check = 0;
+      for(int i=0; i<repeat; ++i)
+      {
+         benchmark_timer timer;
+         check += F();
+         best = std::min(best, timer.seconds());
+      }
+      printf("%-40s %12.3g events/s %12.3g words/s %10.1f ns/event  [check=%llu]\n",
+             name.c_str(), events/best, words/best, best*1.e9/events, (unsigned long long)check);
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   std::string crate_map = BENCHMARK_CRATE_MAP;
+   size_t number_of_events = 200000;
+   if(argc>1) crate_map = argv[1];
+   if(argc>2) number_of_events = std::stoul(argv[2]);
+
+   mesytec::buffer_reader reader;
+   reader.read_crate_map(crate_map);
+   auto& setup = reader.get_setup();
+
+   // generate data
+   mesytec::data_generator generator(setup);
+   std::vector<uint32_t> words_v1, words_v0;
+   std::vector<size_t> offsets_v1{0}, offsets_v0{0};
+   for(size_t i=0; i<number_of_events; ++i)
+   {
+      generator.next_event(words_v1);
+      offsets_v1.push_back(words_v1.size());
+   }
+   mesytec::data_generator generator_v0(setup);
+   for(size_t i=0; i<number_of_events; ++i)
+   {
+      generator_v0.next_event_v0(words_v0);
+      offsets_v0.push_back(words_v0.size());
+   }
+   printf("Generated %lu events: %.1f words/event (rev.1), %.1f words/event (rev.0)\n\n",
+          number_of_events, (double)words_v1.size()/number_of_events, (double)words_v0.size()/number_of_events);
+
+   auto count_hits = [](uint64_t& n){
+      return [&n](mesytec::event& ev, mesytec::experimental_setup&){
+         for(auto& m : ev.get_module_data()) n += m.get_channel_data().size();
+      };
+   };
+
+   run_benchmark("buffer_reader::read_event_in_buffer v1", number_of_events, words_v1.size(), [&](){
+      uint64_t n=0;
+      for(size_t i=0; i<number_of_events; ++i)
+         reader.read_event_in_buffer((const uint8_t*)&words_v1[offsets_v1[i]], (offsets_v1[i+1]-offsets_v1[i])*4, count_hits(n), 1);
+      return n;
+   });
+   run_benchmark("buffer_reader::read_event_in_buffer v0", number_of_events, words_v0.size(), [&](){
+      uint64_t n=0;
+      for(size_t i=0; i<number_of_events; ++i)
+         reader.read_event_in_buffer((const uint8_t*)&words_v0[offsets_v0[i]], (offsets_v0[i+1]-offsets_v0[i])*4, count_hits(n), 0);
+      return n;
+   });
+
+   run_benchmark("module decoding (set_data_word)", number_of_events, words_v1.size(), [&](){
+      uint64_t n=0;
+      mesytec::module* mod=nullptr;
+      for(auto w : words_v1)
+      {
+         if(mesytec::is_module_header(w)) { mod = &setup.get_module(mesytec::module_id(w)); continue; }
+         if(!mod->is_mesytec_module()) continue;
+         mod->set_data_word(w);
+         n += mod->get_data_type() + mod->get_bus_number() + mod->get_channel_number() + mod->get_channel_data();
+      }
+      return n;
+   });
+   run_benchmark("module decoding (stateless)", number_of_events, words_v1.size(), [&](){
+      uint64_t n=0;
+      const mesytec::module* mod=nullptr;
+      for(auto w : words_v1)
+      {
+         if(mesytec::is_module_header(w)) { mod = &setup.get_module(mesytec::module_id(w)); continue; }
+         if(!mod->is_mesytec_module()) continue;
+         n += mod->get_data_type(w) + mod->get_bus_number(w) + mod->get_channel_number(w) + mod->get_channel_data(w);
+      }
+      return n;
+   });
+
+   std::vector<uint8_t> header_ids;
+   for(auto w : words_v1) if(mesytec::is_module_header(w)) header_ids.push_back(mesytec::module_id(w));
+   run_benchmark("fast_lookup_map lookup (get_module)", 10*header_ids.size(), 10*header_ids.size(), [&](){
+      uint64_t n=0;
+      for(int r=0; r<10; ++r)
+         for(auto id : header_ids) n += setup.get_module(id).firmware;
+      return n;
+   });
+
+   // keep parsed events for encoding benchmarks
+   std::vector<mesytec::event> events;
+   events.reserve(number_of_events);
+   for(size_t i=0; i<number_of_events; ++i)
+      reader.read_event_in_buffer((const uint8_t*)&words_v1[offsets_v1[i]], (offsets_v1[i+1]-offsets_v1[i])*4,
+                                  [&](mesytec::event& ev, mesytec::experimental_setup&){ events.push_back(std::move(ev)); });
+
+   run_benchmark("event::get_output_buffer", number_of_events, words_v1.size(), [&](){
+      uint64_t n=0;
+      for(auto& ev : events) n += ev.get_output_buffer().size();
+      return n;
+   });
+
+   std::vector<uint8_t> frame(0x400000);
+   run_benchmark("MFM frame encoding", number_of_events, words_v1.size(), [&](){
+      uint64_t n=0;
+      for(auto& ev : events) n += mesytec::write_mfm_frame(ev, frame.data());
+      return n;
+   });
+}
@@ -0,0 +1,251 @@
+#include "mesytec_buffer_reader_mvlc_parser.h"
+#include "mesytec_data_generator.h"
+#include "mesytec_latency_histogram.h"
+#include "../execs/mesytec_mfm_converter.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+  End-to-end benchmark of the mvme -> mesytec_receiver_mfm_transmitter -> MFM consumer chain, run
+  in a single process with ZMQ "inproc://" transport:
+
+    + the main thread plays mvme: it publishes MVLC readout buffers produced by mesytec::data_generator
+      at a controlled event rate
+    + the transmitter thread runs the same code as mesytec_receiver_mfm_transmitter (mvlc_parser_buffer_reader
+      and mesytec_mfm_converter)
+    + the consumer thread subscribes to the MFM frames and measures the latency of each event (time from
+      publication of the mvme buffer to reception of the MFM frame) using the event number of the frame
+
+  For each requested rate the achieved throughput, the number of events lost (ZMQ PUB sockets silently
+  drop messages when the high water mark is reached) and the latency distribution are printed, so that
+  the saturation point of the chain can be found.
+
+  Usage: benchmark_pipeline [crate_map.dat] [rate1,rate2,... (events/s, 0=as fast as possible)]
+                            [seconds_per_rate] [events_per_buffer]
+*/
+
+namespace
+{
+   // pre-generated events are published cyclically. event numbers (which are used to find the time
+   // each event was published) wrap around after this many events.
+   const uint32_t event_pool_size = 1 << 17;
+
+   struct pipeline_benchmark
+   {
+      zmq::context_t context{1};
+      std::vector<std::atomic<uint64_t>> publish_time = std::vector<std::atomic<uint64_t>>(event_pool_size);
+      std::atomic<bool> stop{false};
+      std::atomic<bool> transmitter_ready{false};
+      std::atomic<uint64_t> events_received{0};
+      std::atomic<uint64_t> parse_errors{0};
+      mesytec::latency_histogram latency;
+      pipeline_latencies stage_latencies;
+   };
+
+   mesytec::mvlc::CrateConfig make_crate_config(const mesytec::experimental_setup& setup)
+   {
+      // readout stack corresponding to the buffers produced by data_generator::next_mvlc_buffer:
+      // one block read per module
+      mesytec::mvlc::CrateConfig config;
+      config.connectionType = mesytec::mvlc::ConnectionType::USB;
+      mesytec::mvlc::StackCommandBuilder stack("event0");
+      setup.for_each_module([&](mesytec::module& mod)
+      {
+         if(mod.is_mvlc_scaler()) return;
+         stack.beginGroup(mod.name);
+         stack.addVMEBlockRead(0, mesytec::mvlc::vme_amods::MBLT64, 0xffff);
+      });
+      config.stacks.push_back(stack);
+      return config;
+   }
+
+   zmq::socket_t* make_subscriber(zmq::context_t& context, const std::string& endpoint)
+   {
+      auto sub = new zmq::socket_t(context, ZMQ_SUB);
+      int timeout=100;//milliseconds
+#ifdef ZMQ_SETSOCKOPT_DEPRECATED
+      sub->set(zmq::sockopt::rcvtimeo,timeout);
+      sub->set(zmq::sockopt::subscribe,"");
+#else
+      sub->setsockopt(ZMQ_RCVTIMEO, &timeout, sizeof(int));
+      sub->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+#endif
+      sub->connect(endpoint.c_str());
+      return sub;
+   }
+
+   bool receive(zmq::socket_t* sock, zmq::message_t& msg)
+   {
+#ifdef ZMQ_USE_RECV_WITH_REFERENCE
+      return (bool)sock->recv(msg);
+#else
+      return sock->recv(&msg);
+#endif
+   }
+
+   void run_transmitter(pipeline_benchmark& bench, const std::string& crate_map)
+   {
+      mesytec::mvlc_parser_buffer_reader MESYbuf;
+      MESYbuf.read_crate_map(crate_map);
+      MESYbuf.set_mvlc_crateconfig(make_crate_config(MESYbuf.get_setup()));
+      MESYbuf.initialise_readout();
+
+      mesytec_mfm_converter CONVERTER(bench.context, "inproc://mfm");
+      CONVERTER.latencies = &bench.stage_latencies;
+      std::unique_ptr<zmq::socket_t> sub{make_subscriber(bench.context, "inproc://mvme")};
+      bench.transmitter_ready = true;
+
+      zmq::message_t buffer;
+      while(!bench.stop)
+      {
+         if(!receive(sub.get(), buffer)) continue;
+         bench.stage_latencies.buffer_received_time = bench.stage_latencies.last_stage_end_time = mesytec::latency_timestamp();
+         try
+         {
+            MESYbuf.read_buffer_collate_events((const uint8_t*)buffer.data(), buffer.size(), std::ref(CONVERTER));
+            bench.stage_latencies.buffer.record(mesytec::latency_timestamp() - bench.stage_latencies.buffer_received_time);
+         }
+         catch (std::exception& e)
+         {
+            ++bench.parse_errors;
+         }
+      }
+      sub->close();
+      CONVERTER.shutdown();
+   }
+
+   void run_consumer(pipeline_benchmark& bench)
+   {
+      std::unique_ptr<zmq::socket_t> sub{make_subscriber(bench.context, "inproc://mfm")};
+      zmq::message_t frame;
+      while(!bench.stop)
+      {
+         if(!receive(sub.get(), frame)) continue;
+         auto now = mesytec::latency_timestamp();
+         uint32_t evnum;
+         memcpy(&evnum, (const uint8_t*)frame.data() + 14, 4);
+         bench.latency.record(now - bench.publish_time[evnum % event_pool_size].load(std::memory_order_acquire));
+         bench.events_received.fetch_add(1, std::memory_order_release);
+      }
+      sub->close();
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   std::string crate_map = BENCHMARK_CRATE_MAP;
+   std::vector<double> rates{10000, 20000, 50000, 100000, 200000, 500000, 0};
+   double seconds_per_rate = 2.;
+   unsigned events_per_buffer = 1000;
+   if(argc>1) crate_map = argv[1];
+   if(argc>2)
+   {
+      rates.clear();
+      std::istringstream ss(argv[2]);
+      std::string r;
+      while(std::getline(ss,r,',')) rates.push_back(std::stod(r));
+   }
+   if(argc>3) seconds_per_rate = std::stod(argv[3]);
+   if(argc>4) events_per_buffer = std::stoul(argv[4]);
+
+   // pre-generate one cycle of buffers: event numbers 1 ... event_pool_size
+   mesytec::experimental_setup setup;
+   setup.read_crate_map(crate_map);
+   mesytec::data_generator generator(setup);
+   std::vector<std::vector<uint32_t>> buffers;
+   std::vector<uint32_t> first_event;
+   while(generator.get_event_number() + events_per_buffer <= event_pool_size)
+   {
+      first_event.push_back(generator.get_event_number()+1);
+      buffers.emplace_back();
+      generator.next_mvlc_buffer(buffers.back(), events_per_buffer);
+   }
+   if(buffers.empty())
+   {
+      printf("events_per_buffer must be less than %u\n", event_pool_size);
+      return 1;
+   }
+
+   pipeline_benchmark bench;
+   zmq::socket_t mvme(bench.context, ZMQ_PUB);
+   mvme.bind("inproc://mvme");
+   std::thread transmitter(run_transmitter, std::ref(bench), crate_map);
+   while(!bench.transmitter_ready) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   std::thread consumer(run_consumer, std::ref(bench));
+   // let subscriptions propagate before publishing
+   std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+   printf("%lu buffers of %u events, %.1f kB/buffer\n\n", buffers.size(), events_per_buffer,
+          4.e-3*buffers[0].size());
+   printf("%12s %12s %12s %10s %10s %10s %10s %10s\n", "target ev/s", "sent ev/s", "recv ev/s", "lost",
+          "p50 [us]", "p99 [us]", "p99.9 [us]", "max [us]");
+
+   double saturation = 0;
+   size_t next_buffer = 0;
+   for(auto rate : rates)
+   {
+      bench.latency.reset();
+      uint64_t received_at_start = bench.events_received;
+      uint64_t sent = 0;
+      auto t0 = std::chrono::steady_clock::now();
+      double elapsed = 0;
+      while(elapsed < seconds_per_rate)
+      {
+         if(rate > 0)
+         {
+            // publish buffer when it is due (sleep if more than 100us early, then spin)
+            auto due = t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(sent/rate));
+            auto early = due - std::chrono::steady_clock::now();
+            if(early > std::chrono::microseconds(100)) std::this_thread::sleep_for(early - std::chrono::microseconds(100));
+            while(std::chrono::steady_clock::now() < due) {}
+         }
+         auto& buf = buffers[next_buffer];
+         auto now = mesytec::latency_timestamp();
+         for(uint32_t e=0; e<events_per_buffer; ++e)
+            bench.publish_time[(first_event[next_buffer]+e) % event_pool_size].store(now, std::memory_order_release);
+         zmq::message_t msg(buf.size()*4);
+         memcpy(msg.data(), buf.data(), buf.size()*4);
+#ifdef ZMQ_USE_SEND_FLAGS
+         mvme.send(msg,zmq::send_flags::none);
+#else
+         mvme.send(msg);
+#endif
+         sent += events_per_buffer;
+         next_buffer = (next_buffer+1) % buffers.size();
+         elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+      }
+      // wait for pipeline to drain
+      uint64_t received;
+      do
+      {
+         received = bench.events_received;
+         std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      }
+      while(bench.events_received != received);
+      received -= received_at_start;
+
+      uint64_t lost = sent > received ? sent - received : 0;
+      double recv_rate = received / elapsed;
+      printf("%12s %12.0f %12.0f %10llu %10.1f %10.1f %10.1f %10.1f\n",
+             rate > 0 ? std::to_string((long)rate).c_str() : "max", sent/elapsed, recv_rate, (unsigned long long)lost,
+             bench.latency.percentile(50)/1.e3, bench.latency.percentile(99)/1.e3,
+             bench.latency.percentile(99.9)/1.e3, bench.latency.get_max()/1.e3);
+      if(!lost && recv_rate > saturation) saturation = recv_rate;
+   }
+   printf("\nhighest rate without loss: %.0f events/s\n", saturation);
+   if(bench.parse_errors) printf("parse errors: %llu\n", (unsigned long long)bench.parse_errors.load());
+   printf("\n");
+   bench.stage_latencies.print();
+
+   bench.stop = true;
+   transmitter.join();
+   consumer.join();
+   mvme.close();
+}
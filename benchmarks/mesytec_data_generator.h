@@ -0,0 +1,227 @@
+#ifndef MESYTEC_DATA_GENERATOR_H
+#define MESYTEC_DATA_GENERATOR_H
+
+#include "mesytec_experimental_setup.h"
+#include <vector>
+#include <stdexcept>
+
+namespace mesytec
+{
+   /**
+      @struct generator_config
+      @brief parameters of synthetic data produced by data_generator
+    */
+   struct generator_config
+   {
+      /// probability for each MDPP channel to fire in an event
+      double mdpp_occupancy{0.25};
+      /// probability for each VMMR subaddress to fire in an event
+      double vmmr_occupancy{0.02};
+      /// probability for a fired MDPP channel to also produce a TDC word
+      double mdpp_tdc_probability{0.8};
+      /// probability for each VMMR bus with data to produce a TDC word
+      double vmmr_tdc_probability{0.5};
+      /// MVLC scaler data is produced every scaler_period events (0: never)
+      unsigned scaler_period{1000};
+      /// TGV timestamp increment between events (mean, in TGV ticks)
+      unsigned mean_timestamp_step{1000};
+      /// seed of the random number generator
+      uint64_t seed{0x5eed};
+   };
+
+   /**
+      @class data_generator
+      @brief deterministic generator of synthetic Mesytec data for the modules of an experimental_setup
+
+      Data words are built according to the bit layout in mesytec::data_flags, with random (but reproducible
+      for a given seed) hit patterns, and can be produced in the three forms handled by this library:
+
+        + next_event() : data blob of an MFM frame with revision 1, i.e. header and data words of modules which fired
+        + next_event_v0() : data blob of an MFM frame with revision 0, i.e. header, data & EOE for all modules
+        + next_mvlc_buffer() : raw MVLC readout buffer (USB framing) as published by mvme, with one StackFrame
+          per event containing one BlockRead frame per module (header, data words & EOE). TGV modules produce
+          a status word and 3 timestamp words. MVLC scaler modules are not included (in mvme they are
+          read out together in one periodic readout block, not in the readout of each event).
+
+      Events are numbered by the event counter written in EOE words, starting from 1.
+    */
+   class data_generator
+   {
+      const experimental_setup& setup;
+      generator_config config;
+      uint64_t rng_state;
+      uint32_t event_number{0};
+      uint64_t timestamp{0};
+      std::vector<uint32_t> module_words;
+
+      uint64_t next_random()
+      {
+         // xorshift64*
+         rng_state ^= rng_state >> 12;
+         rng_state ^= rng_state << 25;
+         rng_state ^= rng_state >> 27;
+         return rng_state * 0x2545F4914F6CDD1DULL;
+      }
+      double uniform() { return (next_random() >> 11) * (1.0/9007199254740992.0); }
+      uint32_t uniform_int(uint32_t n) { return next_random() % n; }
+      uint32_t peak_value(uint32_t range)
+      {
+         // crude peak + background distribution
+         if(uniform()<0.3) return uniform_int(range);
+         double x = 0.;
+         for(int i=0;i<4;++i) x+=uniform();
+         return (uint32_t)(x/4.*range) % range;
+      }
+
+      bool is_scaler_event() const { return config.scaler_period && (event_number % config.scaler_period)==0; }
+
+      void generate_module(const module& mod, bool with_eoe, bool header_if_empty);
+
+   public:
+      data_generator(const experimental_setup& _setup, const generator_config& _config = generator_config{})
+         : setup{_setup}, config{_config}, rng_state{_config.seed ? _config.seed : 1}
+      {}
+
+      /**
+         @return event counter of last generated event
+       */
+      uint32_t get_event_number() const { return event_number; }
+      /**
+         @return 48-bit TGV timestamp of last generated event
+       */
+      uint64_t get_timestamp() const { return timestamp; }
+
+      /**
+         Generate data blob of MFM frame (revision 1) for next event.
+         @param words data is appended to this vector
+       */
+      void next_event(std::vector<uint32_t>& words)
+      {
+         ++event_number;
+         timestamp += 1 + uniform_int(2*config.mean_timestamp_step);
+         setup.for_each_module([&](module& mod)
+         {
+            if(mod.is_tgv_module()) return;
+            generate_module(mod, false, false);
+            words.insert(words.end(), module_words.begin(), module_words.end());
+         });
+      }
+      /**
+         Generate data blob of MFM frame (revision 0) for next event.
+         @param words data is appended to this vector
+       */
+      void next_event_v0(std::vector<uint32_t>& words)
+      {
+         ++event_number;
+         timestamp += 1 + uniform_int(2*config.mean_timestamp_step);
+         setup.for_each_module([&](module& mod)
+         {
+            if(!mod.is_mdpp_module()) return; // revision 0 only handled MDPP data
+            generate_module(mod, true, true);
+            words.insert(words.end(), module_words.begin(), module_words.end());
+         });
+      }
+      /**
+         Generate raw MVLC readout buffer (USB framing) containing several events.
+         @param words data is appended to this vector
+         @param number_of_events number of events in buffer
+         @param stack readout stack number of the events
+       */
+      void next_mvlc_buffer(std::vector<uint32_t>& words, unsigned number_of_events, uint8_t stack=1)
+      {
+         for(unsigned i=0; i<number_of_events; ++i)
+         {
+            ++event_number;
+            timestamp += 1 + uniform_int(2*config.mean_timestamp_step);
+            auto stack_header_pos = words.size();
+            words.push_back(0);
+            setup.for_each_module([&](module& mod)
+            {
+               if(mod.is_mvlc_scaler()) return;
+               generate_module(mod, true, true);
+               if(module_words.size() > frame_headers::LengthMask)
+                  throw std::runtime_error("data_generator: module data too long for one MVLC frame, reduce occupancy");
+               words.push_back(((u32)frame_headers::BlockRead << frame_headers::TypeShift)
+                               | ((u32)stack << frame_headers::StackNumShift) | module_words.size());
+               words.insert(words.end(), module_words.begin(), module_words.end());
+            });
+            auto len = words.size() - stack_header_pos - 1;
+            if(len > frame_headers::LengthMask)
+               throw std::runtime_error("data_generator: event too long for one MVLC frame, reduce occupancy");
+            words[stack_header_pos] = ((u32)frame_headers::StackFrame << frame_headers::TypeShift)
+                  | ((u32)stack << frame_headers::StackNumShift) | len;
+         }
+      }
+   };
+
+   inline void data_generator::generate_module(const module &mod, bool with_eoe, bool header_if_empty)
+   {
+      // fill module_words with header & data for one module (header only written if there is data,
+      // unless header_if_empty=true)
+
+      module_words.clear();
+      const uint32_t header = data_flags::header_found | ((uint32_t)mod.id << 16);
+      const uint32_t eoe = data_flags::eoe_found_mask | (event_number & data_flags::eoe_event_counter_mask);
+      module_words.push_back(header);
+
+      if(mod.is_mdpp_module())
+      {
+         auto nchan = mod[0].get_number_of_channels();
+         uint32_t flag_shift = (nchan==16) ? 20 : 21;
+         for(uint32_t c=0; c<nchan; ++c)
+         {
+            if(uniform() >= config.mdpp_occupancy) continue;
+            // flags: 0=ADC/QDC_long, 1=TDC, 3=QDC_short
+            module_words.push_back(data_flags::mdpp_data | (0u << flag_shift) | (c << 16) | peak_value(0x10000));
+            if(mod.firmware==MDPP_QDC)
+               module_words.push_back(data_flags::mdpp_data | (3u << flag_shift) | (c << 16) | peak_value(0x10000));
+            if(uniform() < config.mdpp_tdc_probability)
+               module_words.push_back(data_flags::mdpp_data | (1u << flag_shift) | (c << 16) | peak_value(0x10000));
+         }
+      }
+      else if(mod.is_vmmr_module())
+      {
+         for(int b=0; b<mod.get_number_of_buses(); ++b)
+         {
+            bool bus_fired=false;
+            for(uint32_t s=0; s<128; ++s)
+            {
+               if(uniform() >= config.vmmr_occupancy) continue;
+               bus_fired=true;
+               module_words.push_back(data_flags::vmmr_data_adc | ((uint32_t)b << 24) | (s << 12) | peak_value(0x1000));
+            }
+            if(bus_fired && uniform() < config.vmmr_tdc_probability)
+               module_words.push_back(data_flags::vmmr_data_tdc | ((uint32_t)b << 24) | peak_value(0x10000));
+         }
+      }
+      else if(mod.is_tgv_module())
+      {
+         module_words.push_back(data_flags::tgv_data_ready_mask);
+         module_words.push_back(timestamp & 0xffff);
+         module_words.push_back((timestamp >> 16) & 0xffff);
+         module_words.push_back((timestamp >> 32) & 0xffff);
+      }
+      else if(mod.is_mvlc_scaler())
+      {
+         if(is_scaler_event())
+         {
+            uint64_t scaler = (uint64_t)event_number * 1000 + uniform_int(1000);
+            for(int i=0; i<4; ++i) module_words.push_back((scaler >> (16*i)) & 0xffff);
+         }
+      }
+
+      if(module_words.size()==1 && !header_if_empty)
+      {
+         module_words.clear();
+         return;
+      }
+      // length in header counts data words + EOE
+      uint32_t length = module_words.size();
+      module_words[0] |= mod.is_vmmr_module() ? (length & data_flags::vmmr_data_length_mask)
+                                              : (length & data_flags::mdpp_data_length_mask);
+      if(with_eoe)
+         module_words.push_back((mod.is_tgv_module() || mod.is_mvlc_scaler()) ? data_flags::eoe_found_mask : eoe);
+   }
+}
+
+#endif // MESYTEC_DATA_GENERATOR_H
@@ -0,0 +1,233 @@
+#include "mesytec_buffer_reader.h"
+#include "mesytec_data_generator.h"
+#include "mesytec_latency_histogram.h"
+#include "mesytec_mfm_frame.h"
+#include "../narval/zmq_compat.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+
+/**
+  Host for Narval actors, to test their throughput offline (without Narval).
+
+  The actor shared library (by default libzmq_narval_receiver.so from this build) is loaded with dlopen(),
+  and driven through the same C ABI as Narval uses (process_config, process_register, process_initialise,
+  process_start, process_block, process_stop, process_unload). A publisher thread sends MFM frames of
+  synthetic events (see mesytec::data_generator) as fast as possible on a local tcp port, which is passed
+  to the actor as its 'algo_path'.
+
+  For each output buffer size, process_block is called in a loop for a few seconds, and the throughput
+  (MB/s, frames/s), the number of frames per output block and the latency of each call are printed.
+  Frames in the output buffers are checked (MFM header byte 0xc1 and frame sizes adding up to the size
+  of the block).
+
+  Usage: narval_actor_harness [actor.so] [buffer_size1,buffer_size2,... (bytes)] [seconds_per_size] [port]
+*/
+
+namespace
+{
+   struct my_struct;
+   using process_config_t = void (*)(char*, unsigned int*);
+   using process_register_t = my_struct* (*)(unsigned int*);
+   using process_block_t = void (*)(my_struct*, void*, unsigned int, unsigned int*, unsigned int*);
+   using process_call_t = void (*)(my_struct*, unsigned int*);
+
+   struct narval_actor
+   {
+      void* handle{nullptr};
+      process_config_t config{nullptr};
+      process_register_t do_register{nullptr};
+      process_block_t block{nullptr};
+      // optional symbols
+      process_call_t initialise{nullptr};
+      process_call_t start{nullptr};
+      process_call_t stop{nullptr};
+      process_call_t unload{nullptr};
+
+      narval_actor(const std::string& library)
+      {
+         handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+         if(!handle) throw std::runtime_error(std::string("narval_actor: ") + dlerror());
+         config = (process_config_t)required_symbol("process_config");
+         do_register = (process_register_t)required_symbol("process_register");
+         block = (process_block_t)required_symbol("process_block");
+         initialise = (process_call_t)dlsym(handle, "process_initialise");
+         start = (process_call_t)dlsym(handle, "process_start");
+         stop = (process_call_t)dlsym(handle, "process_stop");
+         unload = (process_call_t)dlsym(handle, "process_unload");
+      }
+      ~narval_actor()
+      {
+         if(handle) dlclose(handle);
+      }
+      void* required_symbol(const std::string& name)
+      {
+         auto sym = dlsym(handle, name.c_str());
+         if(!sym) throw std::runtime_error("narval_actor: missing symbol " + name);
+         return sym;
+      }
+      static void check(const std::string& call, unsigned int error_code)
+      {
+         if(error_code) throw std::runtime_error(call + " returned error code " + std::to_string(error_code));
+      }
+      void call_optional(process_call_t f, const std::string& name, my_struct* algo_data)
+      {
+         if(!f) return;
+         unsigned int error_code = 0;
+         f(algo_data, &error_code);
+         check(name, error_code);
+      }
+   };
+
+   void run_publisher(const std::vector<std::vector<uint8_t>>& frames, const std::string& endpoint,
+                      std::atomic<bool>& stop, std::atomic<uint64_t>& frames_sent)
+   {
+      zmq::context_t context(1);
+      zmq::socket_t pub(context, ZMQ_PUB);
+      int linger = 0;
+#ifdef ZMQ_SETSOCKOPT_DEPRECATED
+      pub.set(zmq::sockopt::linger, linger);
+#else
+      pub.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+#endif
+      pub.bind(endpoint.c_str());
+      size_t i = 0;
+      while(!stop)
+      {
+         auto& f = frames[i];
+         zmq::message_t msg(f.size());
+         memcpy(msg.data(), f.data(), f.size());
+#ifdef ZMQ_USE_SEND_FLAGS
+         pub.send(msg,zmq::send_flags::none);
+#else
+         pub.send(msg);
+#endif
+         frames_sent.fetch_add(1, std::memory_order_relaxed);
+         i = (i+1) % frames.size();
+      }
+      pub.close();
+   }
+
+   size_t count_frames(const uint8_t* block, size_t size, bool& corrupt)
+   {
+      // walk MFM frames in output block: byte 0 = 0xc1, bytes 1-3 = frame size/2
+      size_t n = 0, pos = 0;
+      while(pos + mesytec::mfm_header_size <= size)
+      {
+         if(block[pos] != 0xc1) { corrupt = true; return n; }
+         size_t frame_size = 2*((size_t)block[pos+1] | ((size_t)block[pos+2] << 8) | ((size_t)block[pos+3] << 16));
+         if(frame_size < mesytec::mfm_header_size) { corrupt = true; return n; }
+         pos += frame_size;
+         ++n;
+      }
+      if(pos != size) corrupt = true;
+      return n;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   std::string library = NARVAL_ACTOR_LIBRARY;
+   std::vector<unsigned> buffer_sizes{64*1024, 256*1024, 1024*1024, 4*1024*1024};
+   double seconds_per_size = 3.;
+   int port = 5599;
+   if(argc>1) library = argv[1];
+   if(argc>2)
+   {
+      buffer_sizes.clear();
+      std::istringstream ss(argv[2]);
+      std::string s;
+      while(std::getline(ss,s,',')) buffer_sizes.push_back(std::stoul(s));
+   }
+   if(argc>3) seconds_per_size = std::stod(argv[3]);
+   if(argc>4) port = std::stoi(argv[4]);
+   std::string endpoint = "tcp://127.0.0.1:" + std::to_string(port);
+
+   // MFM frames of synthetic events
+   mesytec::buffer_reader reader;
+   reader.read_crate_map(BENCHMARK_CRATE_MAP);
+   mesytec::data_generator generator(reader.get_setup());
+   std::vector<std::vector<uint8_t>> frames;
+   std::vector<uint32_t> words;
+   size_t total_frame_bytes = 0;
+   for(int i=0; i<10000; ++i)
+   {
+      words.clear();
+      generator.next_event(words);
+      reader.read_event_in_buffer((const uint8_t*)words.data(), words.size()*4,
+                                  [&](mesytec::event& ev, mesytec::experimental_setup&){
+         frames.emplace_back(mesytec::mfm_frame_size(ev));
+         mesytec::write_mfm_frame(ev, frames.back().data());
+         total_frame_bytes += frames.back().size();
+      });
+   }
+   printf("Actor: %s\nPublishing %lu frames (mean size %.0f bytes) on %s\n\n", library.c_str(), frames.size(),
+          (double)total_frame_bytes/frames.size(), endpoint.c_str());
+
+   std::atomic<bool> stop_publisher{false};
+   std::atomic<uint64_t> frames_sent{0};
+   std::thread publisher(run_publisher, std::cref(frames), endpoint, std::ref(stop_publisher), std::ref(frames_sent));
+
+   narval_actor actor(library);
+   unsigned int error_code = 0;
+   std::vector<char> algo_path(endpoint.begin(), endpoint.end());
+   algo_path.push_back(0);
+   actor.config(algo_path.data(), &error_code);
+   narval_actor::check("process_config", error_code);
+   auto algo_data = actor.do_register(&error_code);
+   narval_actor::check("process_register", error_code);
+   actor.call_optional(actor.initialise, "process_initialise", algo_data);
+
+   std::vector<std::string> results;
+   for(auto size : buffer_sizes)
+   {
+      std::vector<uint8_t> output_buffer(size);
+      mesytec::latency_histogram call_latency;
+      actor.call_optional(actor.start, "process_start", algo_data);
+      // let subscription propagate
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+      uint64_t blocks = 0, empty_blocks = 0, bytes = 0, nframes = 0;
+      bool corrupt = false;
+      auto t0 = std::chrono::steady_clock::now();
+      double elapsed = 0;
+      while(elapsed < seconds_per_size)
+      {
+         unsigned int used = 0;
+         auto t_call = mesytec::latency_timestamp();
+         actor.block(algo_data, output_buffer.data(), size, &used, &error_code);
+         call_latency.record(mesytec::latency_timestamp() - t_call);
+         narval_actor::check("process_block", error_code);
+         ++blocks;
+         if(!used) ++empty_blocks;
+         bytes += used;
+         nframes += count_frames(output_buffer.data(), used, corrupt);
+         elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+      }
+      actor.call_optional(actor.stop, "process_stop", algo_data);
+
+      char line[256];
+      snprintf(line, sizeof(line), "%12u %10llu %10llu %12.1f %12.0f %10.1f %10.1f %10.1f %10.1f%s", size,
+               (unsigned long long)blocks, (unsigned long long)empty_blocks, bytes/elapsed/1.e6, nframes/elapsed,
+               blocks > empty_blocks ? (double)nframes/(blocks-empty_blocks) : 0.,
+               call_latency.percentile(50)/1.e3, call_latency.percentile(99)/1.e3, call_latency.get_max()/1.e3,
+               corrupt ? "  CORRUPT OUTPUT" : "");
+      results.push_back(line);
+   }
+   actor.call_optional(actor.unload, "process_unload", algo_data);
+   stop_publisher = true;
+   publisher.join();
+
+   // actor prints its own messages during the lifecycle: print summary at the end
+   printf("\n%12s %10s %10s %12s %12s %10s %10s %10s %10s\n", "buffer [B]", "blocks", "empty", "MB/s", "frames/s",
+          "frames/blk", "p50 [us]", "p99 [us]", "max [us]");
+   for(auto& r : results) printf("%s\n", r.c_str());
+   printf("\nframes published: %llu\n", (unsigned long long)frames_sent.load());
+}
@@ -0,0 +1,42 @@
+# - Try to find LZ4
+# Once done this will define
+# LZ4_FOUND - System has LZ4
+# LZ4_INCLUDE_DIRS - The LZ4 include directories
+# LZ4_LIBRARIES - The libraries needed to use LZ4
+
+find_path (LZ4_INCLUDE_DIR
+      NAMES lz4.h
+      )
+
+find_library (LZ4_LIBRARY
+      NAMES lz4
+      )
+
+if((NOT LZ4_INCLUDE_DIR) OR (NOT LZ4_LIBRARY))
+   ## load in pkg-config support
+   find_package(PkgConfig QUIET)
+
+   if(PkgConfig_FOUND)
+      ## use pkg-config to get hints for lz4 locations
+      pkg_check_modules(PC_LZ4 QUIET liblz4)
+
+      find_path(LZ4_INCLUDE_DIR
+        NAMES lz4.h
+        PATHS ${PC_LZ4_INCLUDE_DIRS}
+        )
+
+      find_library(LZ4_LIBRARY
+        NAMES lz4
+        PATHS ${PC_LZ4_LIBRARY_DIRS}
+        )
+   endif(PkgConfig_FOUND)
+
+endif((NOT LZ4_INCLUDE_DIR) OR (NOT LZ4_LIBRARY))
+
+set ( LZ4_LIBRARIES ${LZ4_LIBRARY} )
+set ( LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR} )
+
+include ( FindPackageHandleStandardArgs )
+# handle the QUIETLY and REQUIRED arguments and set LZ4_FOUND to TRUE
+# if all listed variables are TRUE
+find_package_handle_standard_args ( LZ4 DEFAULT_MSG LZ4_LIBRARY LZ4_INCLUDE_DIR )
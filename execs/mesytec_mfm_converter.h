@@ -0,0 +1,242 @@
+#ifndef MESYTEC_MFM_CONVERTER_H
+#define MESYTEC_MFM_CONVERTER_H
+
+#include "mesytec_data.h"
+#include "mesytec_event_filter.h"
+#include "mesytec_event_sink.h"
+#include "mesytec_event_topic.h"
+#include "mesytec_experimental_setup.h"
+#include "mesytec_histogrammer.h"
+#include "mesytec_latency_histogram.h"
+#include "mesytec_mfm_frame.h"
+#include "mesytec_sharding.h"
+#include "mesytec_shm_ring.h"
+#include "mesytec_zero_suppression.h"
+#include "../narval/zmq_compat.h"
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct pipeline_latencies
+{
+   // latencies [ns] of each stage of the receiver->parser->MFM encode->publish pipeline
+   mesytec::latency_histogram parse;              // buffer received (or previous event published) -> event ready
+   mesytec::latency_histogram encode;             // building MFM frame
+   mesytec::latency_histogram publish;            // sending MFM frame on ZMQ socket
+   mesytec::latency_histogram receive_to_publish; // buffer received -> event published
+   mesytec::latency_histogram buffer;             // buffer received -> all events in buffer published
+   uint64_t buffer_received_time{0};
+   uint64_t last_stage_end_time{0};
+
+   void print() const
+   {
+      std::cout << "[MESYTEC] : pipeline stage latencies:\n";
+      parse.print("  parse (per event)");
+      encode.print("  MFM encode");
+      publish.print("  publish");
+      receive_to_publish.print("  receive->publish");
+      buffer.print("  buffer");
+   }
+};
+
+/**
+  Callback for mesytec::mvlc_parser_buffer_reader::read_buffer_collate_events() which converts each
+  collated event to an MFM frame and publishes it on a ZMQ PUB socket.
+
+  Used by mesytec_receiver_mfm_transmitter, and by benchmarks which run the same pipeline in-process
+  (in which case the endpoint is an "inproc://" address of the given context).
+
+  If a shared memory ring is given (shm), each frame is also written directly into it for local consumers.
+
+  If zero suppression is given, suppressed VMMR data are removed from each event before it is filtered and
+  encoded (online spectra are filled with all data), and events left without data are not published.
+  With an event fan-out, this is done by mfm_publish_sink on its own copy of each event.
+
+  If a filter is given, only events accepted by it are published (online spectra are filled with all events).
+
+  If shards are given, events are distributed between the endpoints (one PUB socket per shard), and each
+  frame carries its shard number and sequence number in the shard (see mesytec::set_mfm_frame_shard()).
+
+  If topics are given, each frame is published as a 2-part message [topic][frame] (see mesytec::event_topic)
+  so that subscribers can select events by subscription.
+
+  Pass it to the buffer reader with std::ref() to avoid copying it for every buffer.
+*/
+struct mesytec_mfm_converter
+{
+   std::vector<zmq::socket_t*> pubs; // one socket per shard
+   std::string spytype = "ZMQ_PUB";
+   static const size_t frame_buffer_size = 0x400000; // 4 MB
+   std::unique_ptr<unsigned char[]> mfmevent{new unsigned char[frame_buffer_size]};
+   unsigned char* frame_buffer{mfmevent.get()}; // frames are built here (can be replaced by a mesytec::locked_buffer)
+   mesytec::histogrammer* histos{nullptr}; // if set, each event is used to fill online spectra
+   pipeline_latencies* latencies{nullptr}; // if set, latency of each stage is recorded
+   mesytec::shm_ring_producer* shm{nullptr}; // if set, frames are also written in this shared memory ring
+   mesytec::event_topic* topics{nullptr}; // if set, each frame is preceded by its topic
+   mesytec::zero_suppression* suppression{nullptr}; // if set, applied to each event before MFM encoding
+   mesytec::event_filter* filter{nullptr}; // if set, events rejected by filter are not published
+   mesytec::shard_selector* shards{nullptr}; // if set, chooses socket (endpoint) for each event
+   std::vector<uint16_t> shard_sequence;
+
+   mesytec_mfm_converter(zmq::context_t& context, const std::string& endpoint)
+      : mesytec_mfm_converter(context, std::vector<std::string>{endpoint})
+   {}
+
+   mesytec_mfm_converter(zmq::context_t& context, const std::vector<std::string>& endpoints)
+      : shard_sequence(endpoints.size())
+   {
+      // with several endpoints, a shard_selector (shards) must be given to distribute events between them
+      for(auto& zmq_spy_port : endpoints)
+      {
+         zmq::socket_t* pub{nullptr};
+         try {
+            pub=new zmq::socket_t(context, ZMQ_PUB);
+            int linger = 0;
+#ifdef ZMQ_SETSOCKOPT_DEPRECATED
+            pub->set(zmq::sockopt::linger, linger);
+#else
+            pub->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));   // linger equal to 0 for a fast socket shutdown
+#endif
+         } catch (zmq::error_t &e) {
+            std::cout << "ERROR: " << "process_initialise: failed to start " << spytype << " event spy: " << e.what () << std::endl;
+         }
+         try {
+            pub->bind(zmq_spy_port.c_str());
+         } catch (zmq::error_t &e) {
+            std::cout << "ERROR" << "process_start: failed to bind " << spytype << " endpoint " << zmq_spy_port << ": " << e.what () << std::endl;
+         }
+         pubs.push_back(pub);
+      }
+   }
+
+   void shutdown()
+   {
+      std::cout << "Shutting down transmitter" << std::endl;
+      for(auto pub : pubs)
+      {
+         pub->close();
+         delete pub;
+      }
+      pubs.clear();
+   }
+
+   void operator()(mesytec::event &mesy_event, mesytec::experimental_setup& setup)
+   {
+      // called for each complete event parsed from the mesytec stream
+      //
+      // this builds an MFMFrame for each event and publishes it on the ZMQ socket
+
+      uint64_t t_ready = latencies ? mesytec::latency_timestamp() : 0;
+
+      if(!mesy_event.has_data())
+      {
+         std::cerr << "***************** EMPTY EVENT *****************\n";
+         return;
+      }
+      if(histos) histos->fill(mesy_event);
+      if(suppression)
+      {
+         suppression->apply(mesy_event);
+         if(!mesy_event.has_data())
+         {
+            if(latencies) latencies->last_stage_end_time = mesytec::latency_timestamp();
+            return;
+         }
+      }
+      publish(mesy_event, setup, t_ready);
+   }
+
+   void publish(const mesytec::event &mesy_event, const mesytec::experimental_setup& setup, uint64_t t_ready = 0)
+   {
+      // filter, encode & publish an event (zero suppression & spectra are handled by operator()).
+      // also called by mfm_publish_sink in a sink thread of an event fan-out, where latencies must not be used
+
+      if(filter && !filter->accept(mesy_event))
+      {
+         if(latencies) latencies->last_stage_end_time = mesytec::latency_timestamp();
+         return;
+      }
+
+     // mesy_event.ls(setup);
+
+      ///////////////////MFM FRAME CONVERSION////////////////////////////////////
+      // 24 bytes for MFM header, plus the Mesytec data buffer.
+      // when a shared memory ring is used, the frame is built directly in the ring (if the ring is full,
+      // the frame is only sent on the ZMQ socket)
+      unsigned char* frame = shm ? shm->reserve(mesytec::mfm_frame_size(mesy_event)) : nullptr;
+      if(!frame) frame = frame_buffer;
+      size_t mfmeventsize = mesytec::write_mfm_frame(mesy_event, frame);
+      unsigned int shard = 0;
+      if(shards)
+      {
+         shard = shards->select(mesy_event);
+         mesytec::set_mfm_frame_shard(frame, shard, shard_sequence[shard]++);
+      }
+      if(frame != frame_buffer) shm->commit(mfmeventsize);
+      ///////////////////MFM FRAME CONVERSION////////////////////////////////////
+
+      uint64_t t_encoded = latencies ? mesytec::latency_timestamp() : 0;
+
+      // Now send frame on ZMQ socket (of shard)
+      auto pub = pubs[shard];
+      if(topics)
+      {
+         uint8_t topic[mesytec::event_topic::size];
+         zmq::message_t topic_msg(topic, topics->encode(mesy_event, topic));
+#ifdef ZMQ_USE_SEND_FLAGS
+         pub->send(topic_msg,zmq::send_flags::sndmore);
+#else
+         pub->send(topic_msg,ZMQ_SNDMORE);
+#endif
+      }
+      zmq::message_t msg(mfmeventsize);
+      memcpy(msg.data(), frame, mfmeventsize);
+#ifdef ZMQ_USE_SEND_FLAGS
+      pub->send(msg,zmq::send_flags::none);
+#else
+      pub->send(msg);
+#endif
+
+      if(latencies)
+      {
+         uint64_t t_published = mesytec::latency_timestamp();
+         latencies->parse.record(t_ready - latencies->last_stage_end_time);
+         latencies->encode.record(t_encoded - t_ready);
+         latencies->publish.record(t_published - t_encoded);
+         latencies->receive_to_publish.record(t_published - latencies->buffer_received_time);
+         latencies->last_stage_end_time = t_published;
+      }
+   }
+};
+
+/**
+  Sink of a mesytec::event_fanout which publishes events (MFM frames on ZMQ sockets and optionally in a shared memory
+  ring, see mesytec_mfm_converter) in the sink's own thread.
+
+  Events are given to the converter's publish(), after the converter's zero suppression (if any) has been applied
+  to a copy of the event: the events dispatched keep all data for the other sinks, so that online spectra filled by a
+  mesytec::histogram_sink are the same as without fan-out. The converter's latencies must not be set.
+*/
+struct mfm_publish_sink : public mesytec::event_sink
+{
+   mesytec_mfm_converter& converter;
+   mesytec::event suppressed; // copy of event for zero suppression (the event given to sinks is shared)
+
+   mfm_publish_sink(mesytec_mfm_converter& c) : converter{c} {}
+   std::string name() const override { return "publish"; }
+   void process(const mesytec::event& ev, const mesytec::experimental_setup& setup) override
+   {
+      if(!converter.suppression)
+      {
+         converter.publish(ev, setup);
+         return;
+      }
+      suppressed.copy_from(ev);
+      converter.suppression->apply(suppressed);
+      if(suppressed.has_data()) converter.publish(suppressed, setup);
+   }
+};
+
+#endif // MESYTEC_MFM_CONVERTER_H
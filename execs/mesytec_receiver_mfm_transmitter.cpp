@@ -1,106 +1,50 @@
 #include "mesytec_buffer_reader.h"
 #include "mesytec_buffer_reader_mvlc_parser.h"
+#include "mesytec_event_sink.h"
+#include "mesytec_low_latency.h"
 #include "mesytec_experimental_setup.h"
+#include "mesytec_mfm_converter.h"
+#include "mesytec_raw_recorder.h"
 #include <string>
-#include "../narval/zmq_compat.h"
+#include <memory>
 #include <ctime>
 #include <thread>
 #include <chrono>
+#include <csignal>
+#include <functional>
+#include <map>
+#include <unistd.h>
 #include "boost/program_options.hpp"
 
-unsigned char mfmevent[0x400000]; // 4 MB buffer
 zmq::context_t context(1);	// for ZeroMQ communications
 
-struct mesytec_mfm_converter
+volatile std::sig_atomic_t stop_requested = 0;    // set by SIGINT/SIGTERM
+volatile std::sig_atomic_t dump_requested = 0;    // set by SIGUSR1
+void signal_handler(int sig)
 {
-   zmq::socket_t* pub;
-   //std::string zmq_spy_port = "tcp://*:9097";
-   std::string zmq_spy_port = "tcp://*:";
-   std::string spytype = "ZMQ_PUB";
-
-   mesytec_mfm_converter(int port)
-   {
-      zmq_spy_port = zmq_spy_port + std::to_string(port);
-      try {
-         pub=new zmq::socket_t(context, ZMQ_PUB);
-         int linger = 0;
-#ifdef ZMQ_SETSOCKOPT_DEPRECATED
-         pub->set(zmq::sockopt::linger, linger);
-#else
-         pub->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));   // linger equal to 0 for a fast socket shutdown
-#endif
-      } catch (zmq::error_t &e) {
-         std::cout << "ERROR: " << "process_initialise: failed to start " << spytype << " event spy: " << e.what () << std::endl;
-      }
-      try {
-         pub->bind(zmq_spy_port.c_str());
-      } catch (zmq::error_t &e) {
-           std::cout << "ERROR" << "process_start: failed to bind " << spytype << " endpoint " << zmq_spy_port << ": " << e.what () << std::endl;
-      }
-
-   }
-
-   mesytec_mfm_converter(const mesytec_mfm_converter&) = default;
-
-   void shutdown()
-   {
-      std::cout << "Shutting down transmitter" << std::endl;
-      pub->close();
-      delete pub;
-   }
+   if(sig==SIGUSR1) dump_requested = 1;
+   else stop_requested = 1;
+}
 
-   void operator()(mesytec::event &mesy_event, mesytec::experimental_setup& setup)
-   {
-      // called for each complete event parsed from the mesytec stream
-      //
-      // this builds an MFMFrame for each event and copies it into the output stream,
-      // unless there is no room left in the buffer, in which case it will be treated
-      // the next time that process_block is called
+namespace po = boost::program_options;
 
-      if(!mesy_event.has_data())
-      {
-         std::cerr << "***************** EMPTY EVENT *****************\n";
-         return;
-      }
-      // 24 bytes for MFM header, plus the Mesytec data buffer
-      size_t mfmeventsize = 24 + mesy_event.size_of_buffer()*4;
-
-     // mesy_event.ls(setup);
-
-      ///////////////////MFM FRAME CONVERSION////////////////////////////////////
-      mfmevent[0] = 0xc1;  // little-endian, blob frame, unit block size 2 bytes (?)
-      *((uint32_t*)(&mfmevent[1])) = (uint32_t)mfmeventsize/2;// frameSize in unit block size
-      mfmevent[4] = 0x0;  // dataSource
-      *((uint16_t*)(&mfmevent[5])) = mesytec::mfm_frame_type; // frame type
-      mfmevent[7] = 0x1; // frame revision 1
-
-      // next 6 bytes [8]-[13] are for the timestamp
-      *((uint16_t*)(&mfmevent[8])) = mesy_event.get_tgv_ts_lo();
-      *((uint16_t*)(&mfmevent[10])) = mesy_event.get_tgv_ts_mid();
-      *((uint16_t*)(&mfmevent[12])) = mesy_event.get_tgv_ts_hi();
-      //printf("mfmframe: ts_lo %#06x  ts_mid %#06x  ts_hi %#06x\n",*((uint16_t*)(&mfmevent[8])),*((uint16_t*)(&mfmevent[10])),*((uint16_t*)(&mfmevent[12])));
-
-      // bytes [14]-[17]: event number (event counter from mesytec EOE)
-      *((uint32_t*)(&mfmevent[14])) = mesy_event.get_event_counter();
-      // bytes [20]-[23] number of bytes in mesytec data blob
-      *((uint32_t*)(&mfmevent[20])) = (uint32_t)mesy_event.size_of_buffer()*4;
-
-      // copy mesytec data into mfm frame 'blob'
-      memcpy(mfmevent+24, mesy_event.get_output_buffer().data(), mfmeventsize-24);
-      ///////////////////MFM FRAME CONVERSION////////////////////////////////////
-
-      // Now send frame on ZMQ socket
-      zmq::message_t msg(mfmeventsize);
-      memcpy(msg.data(), mfmevent, mfmeventsize);
-#ifdef ZMQ_USE_SEND_FLAGS
-      pub->send(msg,zmq::send_flags::none);
+bool poll_for_data(zmq::socket_t& socket, int spin_us, int timeout_ms)
+{
+   // busy-poll the socket (zero timeout) for spin_us microseconds, then wait in zmq_poll for at most timeout_ms
+   // (unlike sleeping, zmq_poll returns as soon as data arrives)
+#ifdef ZMQ_USE_RECV_WITH_REFERENCE
+   zmq_pollitem_t item{socket.handle(), 0, ZMQ_POLLIN, 0};
 #else
-      pub->send(msg);
+   zmq_pollitem_t item{(void*)socket, 0, ZMQ_POLLIN, 0};
 #endif
+   auto spin_end = std::chrono::steady_clock::now() + std::chrono::microseconds(spin_us);
+   do
+   {
+      if(zmq_poll(&item, 1, 0) > 0) return true;
    }
-};
-
-namespace po = boost::program_options;
+   while(std::chrono::steady_clock::now() < spin_end);
+   return zmq_poll(&item, 1, timeout_ms) > 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -112,6 +56,34 @@ int main(int argc, char *argv[])
          ("mvme_host", po::value<std::string>(), "url of host where mvme-zmq is runnning")
          ("mvme_port", po::value<int>(), "[option] port number of mvme-zmq host (default: 5575)")
          ("zmq_port", po::value<int>(), "[option] port on which to publish MFM data (default: 9097)")
+         ("histo_file", po::value<std::string>(), "[option] fill online spectra and write snapshots in this (memory-mapped) file, e.g. /dev/shm/mesytec_spectra")
+         ("histo_bins", po::value<int>(), "[option] number of bins for 1D online spectra (default: 1024)")
+         ("histo_2d", po::value<std::vector<std::string>>(), "[option] add 2D online spectrum DET_X:type,DET_Y:type[,nbins] (type=adc,tdc,qdc_long,...). can be repeated.")
+         ("histo_interval", po::value<int>(), "[option] interval in seconds between snapshots of online spectra (default: 1)")
+         ("raw_file", po::value<std::string>(), "[option] record all buffers received from mvme in this file (and following files .1, .2, ...)")
+         ("raw_file_size", po::value<int>(), "[option] size of each raw recording file [MB] (default: 1024)")
+         ("raw_files", po::value<int>(), "[option] number of raw recording files, the oldest is overwritten when all are full (default: 10)")
+         ("shards", po::value<int>(), "[option] distribute events between this number of shards, published on ports zmq_port, zmq_port+1, ... (default: 1)")
+         ("shard_by", po::value<std::string>(), "[option] sharding policy: event (event counter), round_robin, or tgv (TGV time slices) (default: event)")
+         ("shard_tgv_slice", po::value<uint64_t>(), "[option] width of TGV time slices for --shard_by tgv, in TGV ticks (default: 1000000)")
+         ("filter", po::value<std::string>(), "[option] only publish events accepted by this filter, e.g. \"prescale scaler 100; scaler or detector PISTA_E_* adc > 300\" (see README)")
+         ("pedestals", po::value<std::string>(), "[option] suppress VMMR ADC data <= pedestal + threshold, read for each channel from this file (see README)")
+         ("subtract_pedestals", "[option] with --pedestals, subtract pedestal from VMMR ADC data which are kept")
+         ("learn_pedestals", po::value<std::string>(), "[option] learn VMMR pedestals & thresholds (pedestal run) and write them in this file when stopped")
+         ("pedestal_sigma", po::value<double>(), "[option] with --learn_pedestals, thresholds are this number of standard deviations of the pedestals (default: 3)")
+         ("topics", "[option] publish each MFM frame with a topic (event class & module presence mask) for subscription filtering, see README")
+         ("shm", po::value<std::string>(), "[option] also write MFM frames in a shared memory ring with this name (/dev/shm/name) for consumers on this host")
+         ("shm_size", po::value<int>(), "[option] size of shared memory ring [MB] (default: 64)")
+         ("fanout", "[option] parse each event once and give it to sinks (publication, online spectra, run files, statistics) running in their own threads, see README")
+         ("run_file", po::value<std::string>(), "[option] with --fanout, also write events as MFM frames in run files (first file, e.g. mesytec_run_12.dat)")
+         ("run_file_size", po::value<int>(), "[option] maximum size of each run file [MB] (default: 1024)")
+         ("stats", "[option] with --fanout, print numbers of events and data words of each module with the status")
+         ("sink_queue", po::value<int>(), "[option] with --fanout, maximum number of events waiting for each sink (default: 4096)")
+         ("sink_policy", po::value<std::vector<std::string>>(), "[option] with --fanout, SINK=POLICY: what to do when the queue of a sink (publish, histograms, run_file, stats) is full: block, drop_newest or drop_oldest. can be repeated.")
+         ("low_latency", "[option] busy-poll the mvme socket, build MFM frames in a pre-faulted, locked (huge page) buffer and lock all memory, see README")
+         ("spin_us", po::value<int>(), "[option] with --low_latency, time [us] to busy-poll for data before waiting in zmq_poll (default: 1000)")
+         ("cpu_affinity", po::value<std::vector<std::string>>(), "[option] THREAD=CPU: run a thread on the given CPU (threads: main, raw_recorder, and with --fanout publish, histograms, run_file, stats). can be repeated.")
+         ("resync", "[option] skip corrupted data (invalid frame headers, unknown modules, undecodable module data) and carry on instead of abandoning the whole buffer, see README")
          ("debug", "[option] enable debug output")
          ("trace", "[option] enable trace output")
          ;
@@ -175,6 +147,70 @@ int main(int argc, char *argv[])
 
    MESYbuf.initialise_readout();
 
+   if(vm.count("resync"))
+   {
+      MESYbuf.set_resync();
+      printf("[MESYTEC] : resync mode: corrupted data will be skipped\n");
+   }
+
+   std::unique_ptr<mesytec::histogrammer> histos;
+   std::string histo_file;
+   int histo_interval=1;
+   if(vm.count("histo_file"))
+   {
+      histo_file = vm["histo_file"].as<std::string>();
+      if(vm.count("histo_interval")) histo_interval = vm["histo_interval"].as<int>();
+      MESYbuf.read_detector_correspondence(path_to_setup + "/detector_correspondence.dat");
+      int histo_bins = 1024;
+      if(vm.count("histo_bins")) histo_bins = vm["histo_bins"].as<int>();
+      histos.reset(new mesytec::histogrammer(MESYbuf.get_setup(), histo_bins));
+      if(vm.count("histo_2d"))
+      {
+         for(auto& spec : vm["histo_2d"].as<std::vector<std::string>>())
+         {
+            // DET_X:type,DET_Y:type[,nbins]
+            std::istringstream ss(spec);
+            std::string x, y, nbins;
+            std::getline(ss,x,',');
+            std::getline(ss,y,',');
+            std::getline(ss,nbins);
+            auto colx = x.rfind(':'), coly = y.rfind(':');
+            if(colx==std::string::npos || coly==std::string::npos)
+            {
+               std::cout << "[MESYTEC] : ignoring badly formed 2D spectrum definition " << spec << std::endl;
+               continue;
+            }
+            histos->add_2d(x.substr(0,colx), mesytec::histogrammer::data_type_from_name(x.substr(colx+1)),
+                           y.substr(0,coly), mesytec::histogrammer::data_type_from_name(y.substr(coly+1)),
+                           nbins.empty() ? 256 : std::stoi(nbins));
+         }
+      }
+      printf ("[MESYTEC] : filling %lu online spectra, snapshot every %d s in %s\n",
+              histos->number_of_spectra(), histo_interval, histo_file.c_str());
+   }
+
+   std::unique_ptr<mesytec::raw_recorder> recorder;
+   if(vm.count("raw_file"))
+   {
+      size_t raw_file_size = 1024;
+      int raw_files = 10;
+      if(vm.count("raw_file_size")) raw_file_size = vm["raw_file_size"].as<int>();
+      if(vm.count("raw_files")) raw_files = vm["raw_files"].as<int>();
+      recorder.reset(new mesytec::raw_recorder(vm["raw_file"].as<std::string>(), raw_file_size*1024*1024, raw_files));
+      printf ("[MESYTEC] : recording raw mvme buffers in %s (%d files of %lu MB)\n",
+              vm["raw_file"].as<std::string>().c_str(), raw_files, raw_file_size);
+   }
+
+   std::unique_ptr<mesytec::shm_ring_producer> shm_ring;
+   if(vm.count("shm"))
+   {
+      size_t shm_size = 64;
+      if(vm.count("shm_size")) shm_size = vm["shm_size"].as<int>();
+      shm_ring.reset(new mesytec::shm_ring_producer(vm["shm"].as<std::string>(), shm_size*1024*1024));
+      printf ("[MESYTEC] : writing MFM frames in shared memory ring %s (%lu MB)\n",
+              vm["shm"].as<std::string>().c_str(), shm_size);
+   }
+
    // start zmq receiver here (probably)
    zmq::socket_t* pub{nullptr};
    try {
@@ -211,12 +247,184 @@ int main(int argc, char *argv[])
    uint32_t events_treated=0;
    zmq::message_t event;
 
-   mesytec_mfm_converter CONVERTER(spy_port);
+   std::unique_ptr<mesytec::shard_selector> shards;
+   std::vector<std::string> endpoints{"tcp://*:" + std::to_string(spy_port)};
+   if(vm.count("shards") && vm["shards"].as<int>() > 1)
+   {
+      std::string shard_by = "event";
+      uint64_t shard_tgv_slice = 1000000;
+      if(vm.count("shard_by")) shard_by = vm["shard_by"].as<std::string>();
+      if(vm.count("shard_tgv_slice")) shard_tgv_slice = vm["shard_tgv_slice"].as<uint64_t>();
+      shards.reset(new mesytec::shard_selector(vm["shards"].as<int>(),
+                                               mesytec::shard_selector::policy_from_string(shard_by), shard_tgv_slice));
+      for(unsigned int i = 1; i < shards->get_number_of_shards(); ++i)
+         endpoints.push_back("tcp://*:" + std::to_string(spy_port + i));
+      printf ("[MESYTEC] : events distributed by %s between %u shards on ports %d-%d\n",
+              shard_by.c_str(), shards->get_number_of_shards(), spy_port, spy_port + shards->get_number_of_shards() - 1);
+   }
+   mesytec_mfm_converter CONVERTER(context, endpoints);
+   CONVERTER.shards = shards.get();
+   CONVERTER.histos = histos.get();
+   pipeline_latencies latencies;
+   CONVERTER.latencies = &latencies;
+   CONVERTER.shm = shm_ring.get();
+   std::unique_ptr<mesytec::event_filter> filter;
+   if(vm.count("filter"))
+   {
+      // detector names used in filter
+      if(!histos) MESYbuf.read_detector_correspondence(path_to_setup + "/detector_correspondence.dat");
+      filter.reset(new mesytec::event_filter(vm["filter"].as<std::string>(), MESYbuf.get_setup()));
+      CONVERTER.filter = filter.get();
+      printf ("[MESYTEC] : publishing only events accepted by filter: %s\n", filter->get_expression().c_str());
+   }
+   std::unique_ptr<mesytec::zero_suppression> suppression;
+   std::string learn_pedestals_file;
+   if(vm.count("pedestals") || vm.count("learn_pedestals"))
+   {
+      suppression.reset(new mesytec::zero_suppression(MESYbuf.get_setup()));
+      if(vm.count("learn_pedestals"))
+      {
+         learn_pedestals_file = vm["learn_pedestals"].as<std::string>();
+         suppression->set_learning(true);
+         printf ("[MESYTEC] : learning VMMR pedestals, will be written in %s when stopped\n", learn_pedestals_file.c_str());
+      }
+      else
+      {
+         suppression->read_table(vm["pedestals"].as<std::string>());
+         suppression->set_subtract_pedestals(vm.count("subtract_pedestals"));
+         printf ("[MESYTEC] : suppressing VMMR data below thresholds in %s%s\n", vm["pedestals"].as<std::string>().c_str(),
+                 vm.count("subtract_pedestals") ? " (with pedestal subtraction)" : "");
+      }
+      CONVERTER.suppression = suppression.get();
+   }
+   std::unique_ptr<mesytec::event_topic> topics;
+   if(vm.count("topics"))
+   {
+      topics.reset(new mesytec::event_topic(MESYbuf.get_setup()));
+      CONVERTER.topics = topics.get();
+      printf ("[MESYTEC] : publishing MFM frames with topics\n");
+   }
+   std::unique_ptr<mesytec::event_fanout> fanout;
+   mesytec::stats_sink* stats{nullptr};
+   if(vm.count("fanout"))
+   {
+      // default policies: events are only lost for run files if the parser has to wait for the disk
+      std::map<std::string, mesytec::event_fanout::policy> policies{
+         {"publish", mesytec::event_fanout::policy::drop_newest},
+         {"histograms", mesytec::event_fanout::policy::drop_oldest},
+         {"run_file", mesytec::event_fanout::policy::block},
+         {"stats", mesytec::event_fanout::policy::drop_oldest}};
+      if(vm.count("sink_policy"))
+      {
+         for(auto& spec : vm["sink_policy"].as<std::vector<std::string>>())
+         {
+            auto eq = spec.find('=');
+            if(eq==std::string::npos || !policies.count(spec.substr(0,eq)))
+            {
+               std::cout << "[MESYTEC] : ignoring badly formed sink policy " << spec << std::endl;
+               continue;
+            }
+            policies[spec.substr(0,eq)] = mesytec::event_fanout::policy_from_string(spec.substr(eq+1));
+         }
+      }
+      size_t sink_queue = 4096;
+      if(vm.count("sink_queue")) sink_queue = vm["sink_queue"].as<int>();
+
+      // spectra, publication & run files are done by sinks: zero suppression is applied by the publish and run_file
+      // sinks to their own copy of each event, so that spectra are filled with all data (as without fan-out)
+      fanout.reset(new mesytec::event_fanout(MESYbuf.get_setup()));
+      CONVERTER.histos = nullptr;
+      CONVERTER.latencies = nullptr;
+      fanout->add_sink(std::unique_ptr<mesytec::event_sink>(new mfm_publish_sink(CONVERTER)), sink_queue, policies["publish"]);
+      if(histos)
+         fanout->add_sink(std::unique_ptr<mesytec::event_sink>(new mesytec::histogram_sink(*histos)), sink_queue, policies["histograms"]);
+      if(vm.count("run_file"))
+      {
+         uint64_t run_file_size = 1024;
+         if(vm.count("run_file_size")) run_file_size = vm["run_file_size"].as<int>();
+         std::unique_ptr<mesytec::run_file_sink> run_files(new mesytec::run_file_sink(vm["run_file"].as<std::string>(), run_file_size*1024*1024));
+         if(suppression && !suppression->is_learning()) run_files->set_zero_suppression(*suppression);
+         fanout->add_sink(std::move(run_files), sink_queue, policies["run_file"]);
+         printf ("[MESYTEC] : writing MFM frames in run files %s\n", vm["run_file"].as<std::string>().c_str());
+      }
+      if(vm.count("stats"))
+      {
+         stats = new mesytec::stats_sink;
+         fanout->add_sink(std::unique_ptr<mesytec::event_sink>(stats), sink_queue, policies["stats"]);
+      }
+      fanout->start();
+      printf ("[MESYTEC] : events given to %lu sinks in their own threads (queues of %lu events)\n", fanout->number_of_sinks(), sink_queue);
+   }
+   // callback used with --fanout
+   auto dispatch_event = [&](mesytec::event& ev, mesytec::experimental_setup&)
+   {
+      if(!ev.has_data()) return;
+      fanout->dispatch(ev);
+   };
+
+   bool low_latency = vm.count("low_latency");
+   int spin_us = 1000;
+   std::unique_ptr<mesytec::locked_buffer> frame_buffer;
+   if(low_latency)
+   {
+      if(vm.count("spin_us")) spin_us = vm["spin_us"].as<int>();
+      frame_buffer.reset(new mesytec::locked_buffer(CONVERTER.frame_buffer_size));
+      CONVERTER.frame_buffer = frame_buffer->data();
+      printf ("[MESYTEC] : low latency mode: busy-polling mvme socket for %d us before waiting for data\n", spin_us);
+      printf ("[MESYTEC] :  - MFM frame buffer: %s\n", frame_buffer->describe().c_str());
+   }
+   if(vm.count("cpu_affinity"))
+   {
+      for(auto& spec : vm["cpu_affinity"].as<std::vector<std::string>>())
+      {
+         auto eq = spec.find('=');
+         if(eq==std::string::npos)
+         {
+            std::cout << "[MESYTEC] : ignoring badly formed CPU affinity " << spec << std::endl;
+            continue;
+         }
+         auto thread = spec.substr(0,eq);
+         int cpu = std::stoi(spec.substr(eq+1));
+         bool done = false, found = true;
+         if(thread=="main") done = mesytec::set_current_thread_affinity(cpu);
+         else if(thread=="raw_recorder" && recorder) done = recorder->set_writer_affinity(cpu);
+         else
+         {
+            found = false;
+            for(size_t i = 0; fanout && i < fanout->number_of_sinks(); ++i)
+            {
+               if(fanout->get_sink_name(i)!=thread) continue;
+               found = true;
+               done = fanout->set_sink_affinity(i, cpu);
+            }
+         }
+         if(!found) printf ("[MESYTEC] :  - no thread %s: CPU affinity ignored\n", thread.c_str());
+         else if(done) printf ("[MESYTEC] :  - thread %s runs on CPU %d\n", thread.c_str(), cpu);
+         else printf ("[MESYTEC] :  - could not set CPU affinity of thread %s to CPU %d\n", thread.c_str(), cpu);
+      }
+   }
+   if(low_latency)
+   {
+      // once all buffers (rings, event pool...) are allocated
+      if(mesytec::lock_all_memory()) printf ("[MESYTEC] :  - all memory locked\n");
+      else printf ("[MESYTEC] :  - could not lock all memory (check ulimit -l)\n");
+   }
+
+   std::signal(SIGINT, signal_handler);
+   std::signal(SIGTERM, signal_handler);
+   std::signal(SIGUSR1, signal_handler);
+   printf ("[MESYTEC] : send SIGUSR1 (kill -USR1 %d) to print latencies of pipeline stages\n", (int)getpid());
    const int status_update_interval=5; // print infos every x seconds
+   time_t last_snapshot_time=current_time;
 
    /*** MAIN LOOP ***/
-   while(1)
+   while(!stop_requested)
    {
+      if(dump_requested)
+      {
+         dump_requested = 0;
+         latencies.print();
+      }
       tot_events_parsed=MESYbuf.get_total_events_parsed();
       time_t t;
       time(&t);
@@ -230,9 +438,45 @@ int main(int argc, char *argv[])
          now.erase(now.size()-1);//remove new line character
          std::cout << "[MESYTEC] : " << now << " : parse rate " << (tot_events_parsed-last_tot_events_parsed)/time_elapsed << " evt./sec, total events: "
             << std::dec << tot_events_parsed << "...\n";
+         if(recorder && recorder->get_buffers_dropped())
+            std::cout << "[MESYTEC] : raw recording: " << recorder->get_buffers_dropped() << " buffers not recorded (disk too slow)\n";
+         if(suppression && !suppression->is_learning())
+            std::cout << "[MESYTEC] : zero suppression removed " << suppression->get_words_suppressed() << " of " << suppression->get_words_tested() << " VMMR data words\n";
+         if(filter)
+            std::cout << "[MESYTEC] : filter accepted " << filter->get_events_accepted() << " of " << filter->get_events_tested() << " events\n";
+         if(shm_ring && shm_ring->get_messages_dropped())
+            std::cout << "[MESYTEC] : shared memory ring: " << shm_ring->get_messages_dropped() << " frames not written (ring full)\n";
+         if(!MESYbuf.get_error_counters().empty())
+         {
+            std::cout << "[MESYTEC] : errors in data: ";
+            MESYbuf.get_error_counters().print(std::cout);
+            std::cout << "\n";
+         }
+         if(!MESYbuf.get_resync_counters().empty())
+         {
+            std::cout << "[MESYTEC] : resync: ";
+            MESYbuf.get_resync_counters().print(std::cout);
+            std::cout << "\n";
+         }
+         if(fanout) fanout->print_statistics();
+         if(stats) stats->print(MESYbuf.get_setup());
          last_tot_events_parsed=tot_events_parsed;
       }
+      if(histos && difftime(t,last_snapshot_time)>=histo_interval)
+      {
+         last_snapshot_time=t;
+         try
+         {
+            histos->snapshot(histo_file);
+         }
+         catch (std::exception& e)
+         {
+            std::cout << "[MESYTEC] : Error writing snapshot of spectra : " << e.what() << std::endl;
+         }
+      }
 
+      // in low latency mode, only receive when data is ready (waits at most 100 ms, like ZMQ_RCVTIMEO)
+      if(low_latency && !poll_for_data(*pub, spin_us, timeout)) continue;
       try{
 #ifdef ZMQ_USE_RECV_WITH_REFERENCE
          if(!pub->recv(event))
@@ -240,7 +484,7 @@ int main(int argc, char *argv[])
          if(!pub->recv(&event))
 #endif
          {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if(!low_latency) std::this_thread::sleep_for(std::chrono::milliseconds(100));
             continue;
          }
       }
@@ -252,17 +496,58 @@ int main(int argc, char *argv[])
 
 //      std::cout << "received a zmq message!\n";
 
+      latencies.buffer_received_time = latencies.last_stage_end_time = mesytec::latency_timestamp();
+      if(recorder) recorder->record(event.data(), event.size(), latencies.buffer_received_time);
+
       try
       {
-         events_treated = MESYbuf.read_buffer_collate_events((const uint8_t*)event.data(), event.size(), CONVERTER);
+         // pass converter by reference to avoid copying it for every buffer
+         if(fanout)
+            events_treated = MESYbuf.read_buffer_collate_events((const uint8_t*)event.data(), event.size(), dispatch_event);
+         else
+            events_treated = MESYbuf.read_buffer_collate_events((const uint8_t*)event.data(), event.size(), std::ref(CONVERTER));
+         latencies.buffer.record(mesytec::latency_timestamp() - latencies.buffer_received_time);
       }
       catch (std::exception& e)
       {
          std::string what{ e.what() };
          std::cout << "[MESYTEC] : Error parsing Mesytec buffer : " << what << std::endl;
+         if(recorder)
+            std::cout << "[MESYTEC] : buffer was recorded with sequence number " << recorder->get_sequence() << std::endl;
          // abandon buffer & try next one
          MESYbuf.reset();
          continue;
       }
    }
+
+   latencies.print();
+   if(recorder)
+   {
+      recorder.reset(); // waits for all buffers to be written
+      std::cout << "[MESYTEC] : raw recording finished\n";
+   }
+   if(fanout)
+   {
+      fanout->stop(); // sinks finish the events in their queues
+      fanout->print_statistics();
+   }
+   // with --fanout, pedestals are accumulated in the thread of the publish sink, which is stopped above
+   if(suppression && suppression->is_learning())
+   {
+      double n_sigma = 3;
+      if(vm.count("pedestal_sigma")) n_sigma = vm["pedestal_sigma"].as<double>();
+      suppression->finish_learning(n_sigma);
+      try
+      {
+         suppression->write_table(learn_pedestals_file);
+         std::cout << "[MESYTEC] : VMMR pedestals written in " << learn_pedestals_file << std::endl;
+      }
+      catch (std::exception& e)
+      {
+         std::cout << "[MESYTEC] : Error writing pedestals : " << e.what() << std::endl;
+      }
+   }
+   CONVERTER.shutdown();
+   pub->close();
+   delete pub;
 }
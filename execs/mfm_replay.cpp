@@ -0,0 +1,267 @@
+#include "mesytec_run_files.h"
+#ifdef MESYTEC_DATA_WITH_LZ4
+#include "mesytec_compressed_run.h"
+#endif
+#include <string>
+#include "../narval/zmq_compat.h"
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include "boost/program_options.hpp"
+
+zmq::context_t context(1);	// for ZeroMQ communications
+
+namespace po = boost::program_options;
+
+using replay_clock = std::chrono::steady_clock;
+
+struct replay_pacing
+{
+   // decides when each message should be sent
+   //
+   // realtime : from timestamps of recorded data, divided by speed
+   // fixed rate : 'rate' messages per second
+   // otherwise : as fast as possible
+
+   bool realtime{false};
+   double speed{1.};
+   double rate{0.};
+   double max_gap{10.};  // [s] larger jumps in recorded timestamps are not reproduced
+
+   replay_clock::time_point start;
+   uint64_t messages{0};
+   uint64_t first_timestamp{0}, last_timestamp{0};
+
+   void restart()
+   {
+      start = replay_clock::now();
+      messages = 0;
+      first_timestamp = last_timestamp = 0;
+   }
+
+   void wait(uint64_t timestamp_ns)
+   {
+      // wait until message with given timestamp (in ns) is due
+      replay_clock::time_point due;
+      if(realtime)
+      {
+         if(!messages || timestamp_ns < last_timestamp || timestamp_ns - last_timestamp > max_gap*1.e9)
+         {
+            // first message, timestamp reset or long pause: restart pacing from this message
+            start = replay_clock::now();
+            first_timestamp = timestamp_ns;
+         }
+         last_timestamp = timestamp_ns;
+         due = start + std::chrono::duration_cast<replay_clock::duration>(
+                  std::chrono::duration<double>((timestamp_ns - first_timestamp)*1.e-9/speed));
+      }
+      else if(rate > 0)
+         due = start + std::chrono::duration_cast<replay_clock::duration>(std::chrono::duration<double>(messages/rate));
+      ++messages;
+      if(!realtime && !(rate > 0)) return;
+
+      // sleep if more than 200us early, then spin
+      auto early = due - replay_clock::now();
+      if(early > std::chrono::microseconds(200)) std::this_thread::sleep_for(early - std::chrono::microseconds(200));
+      while(replay_clock::now() < due) {}
+   }
+};
+
+int main(int argc, char *argv[])
+{
+   po::options_description desc("\nmfm_replay\n\nReplay a run written by zmq_receiver (MFM frames) or a raw recording of mvme buffers"
+                                 "\non a ZMQ PUB socket\n\nUsage");
+
+   desc.add_options()
+         ("help", "produce this message")
+         ("file", po::value<std::string>(), "first file of run, e.g. mesytec_run_12.dat (following files .1, .2, ... are read automatically)")
+         ("raw", "[option] file is a raw recording of mvme buffers (default: MFM frames)")
+         ("zmq_port", po::value<int>(), "[option] port on which to publish data (default: 9097 for MFM frames, 5575 for raw buffers)")
+         ("realtime", "[option] replay with timing given by TGV timestamps of MFM frames / reception time of raw buffers")
+         ("speed", po::value<double>(), "[option] speed multiplier for realtime replay (implies --realtime)")
+         ("tgv_tick", po::value<double>(), "[option] duration of one TGV timestamp tick in ns (default: 10)")
+         ("rate", po::value<double>(), "[option] replay at fixed rate of messages (frames or buffers) per second")
+         ("loop", po::value<int>(), "[option] replay run this many times (default: 1, 0=forever)")
+         ("hwm", po::value<int>(), "[option] send high water mark of PUB socket (default: ZMQ default 1000)")
+         ("wait", po::value<int>(), "[option] wait this many seconds for subscribers before starting (default: 1)")
+         ;
+
+   po::variables_map vm;
+   try
+   {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+   }
+   catch(...)
+   {
+      // in case of unknown options, print help & exit
+      std::cout << desc << "\n";
+      return 0;
+   }
+
+   if (vm.count("help") || !vm.count("file")) {
+      std::cout << desc << "\n";
+      return 0;
+   }
+
+   auto file = vm["file"].as<std::string>();
+   bool raw = vm.count("raw");
+   int port = raw ? 5575 : 9097;
+   if(vm.count("zmq_port")) port = vm["zmq_port"].as<int>();
+   std::string zmq_port = "tcp://*:" + std::to_string(port);
+
+   replay_pacing pacing;
+   pacing.realtime = vm.count("realtime") || vm.count("speed");
+   if(vm.count("speed")) pacing.speed = vm["speed"].as<double>();
+   if(vm.count("rate")) pacing.rate = vm["rate"].as<double>();
+   double tgv_tick = 10.;
+   if(vm.count("tgv_tick")) tgv_tick = vm["tgv_tick"].as<double>();
+   int loops = 1;
+   if(vm.count("loop")) loops = vm["loop"].as<int>();
+   int wait = 1;
+   if(vm.count("wait")) wait = vm["wait"].as<int>();
+
+   if(pacing.realtime && pacing.rate > 0)
+   {
+      std::cout << "[MESYTEC] : choose either --realtime/--speed or --rate\n";
+      return 1;
+   }
+
+   // XPUB with XPUB_NODROP behaves like PUB, except that when the high water mark is reached sending
+   // fails with EAGAIN instead of silently dropping the message: this allows to count drops
+   zmq::socket_t pub(context, ZMQ_XPUB);
+   int linger = 0;
+   int nodrop = 1;
+#ifdef ZMQ_SETSOCKOPT_DEPRECATED
+   pub.set(zmq::sockopt::linger, linger);
+   pub.set(zmq::sockopt::xpub_nodrop, nodrop);
+   if(vm.count("hwm")) pub.set(zmq::sockopt::sndhwm, vm["hwm"].as<int>());
+#else
+   pub.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+   pub.setsockopt(ZMQ_XPUB_NODROP, &nodrop, sizeof(nodrop));
+   if(vm.count("hwm"))
+   {
+      int hwm = vm["hwm"].as<int>();
+      pub.setsockopt(ZMQ_SNDHWM, &hwm, sizeof(hwm));
+   }
+#endif
+   try {
+      pub.bind(zmq_port.c_str());
+   } catch (zmq::error_t &e) {
+      std::cout << "[MESYTEC] : ERROR: failed to bind ZeroMQ endpoint " << zmq_port << ": " << e.what () << std::endl;
+      return 1;
+   }
+   printf("[MESYTEC] : replaying %s (%s) on %s\n", file.c_str(), raw ? "raw mvme buffers" : "MFM frames", zmq_port.c_str());
+   if(pacing.realtime) printf("[MESYTEC] : realtime replay, speed x%g\n", pacing.speed);
+   else if(pacing.rate > 0) printf("[MESYTEC] : fixed rate %g messages/s\n", pacing.rate);
+   else printf("[MESYTEC] : replay as fast as possible\n");
+   std::this_thread::sleep_for(std::chrono::seconds(wait));
+
+   std::unique_ptr<mesytec::mfm_run_reader> mfm_run;
+   std::unique_ptr<mesytec::raw_recording_reader> raw_run;
+#ifdef MESYTEC_DATA_WITH_LZ4
+   std::unique_ptr<mesytec::compressed_run_reader> compressed_run;
+   if(!raw && mesytec::is_compressed_run_file(file))
+   {
+      compressed_run.reset(new mesytec::compressed_run_reader(file));
+      printf("[MESYTEC] : compressed run with %lu frames in %lu blocks\n", compressed_run->get_number_of_frames(),
+             compressed_run->get_number_of_blocks());
+      if(compressed_run->get_truncated_bytes())
+         printf("[MESYTEC] : %lu bytes of incomplete blocks are ignored\n", compressed_run->get_truncated_bytes());
+   }
+   else
+#endif
+   if(raw) raw_run.reset(new mesytec::raw_recording_reader(file));
+   else mfm_run.reset(new mesytec::mfm_run_reader(file));
+   // next MFM frame from either kind of run file
+   auto next_frame = [&](std::vector<uint8_t>& frame)
+   {
+#ifdef MESYTEC_DATA_WITH_LZ4
+      if(compressed_run) return compressed_run->next(frame);
+#endif
+      return mfm_run->next(frame);
+   };
+
+   std::vector<uint8_t> data;
+   mesytec::raw_buffer_header raw_header;
+   uint64_t sent=0, dropped=0, bytes=0;
+   uint64_t last_sent=0, last_dropped=0, last_bytes=0;
+   const int status_update_interval=5; // print infos every x seconds
+   auto replay_start = replay_clock::now();
+   auto last_status = replay_start;
+
+   bool read_error = false;
+   for(int loop=0; (!loops || loop<loops) && !read_error; ++loop)
+   {
+      if(loop)
+      {
+         if(raw) raw_run->rewind();
+#ifdef MESYTEC_DATA_WITH_LZ4
+         else if(compressed_run) compressed_run->rewind();
+#endif
+         else mfm_run->rewind();
+      }
+      pacing.restart();
+      while(1)
+      {
+         uint64_t timestamp;
+         try
+         {
+            if(raw)
+            {
+               if(!raw_run->next(data, raw_header)) break;
+               timestamp = raw_header.timestamp;
+            }
+            else
+            {
+               if(!next_frame(data)) break;
+               timestamp = mesytec::mfm_run_reader::tgv_timestamp(data.data())*tgv_tick;
+            }
+         }
+         catch (std::exception& e)
+         {
+            std::cout << "[MESYTEC] : Error reading run : " << e.what() << std::endl;
+            read_error = true;
+            break;
+         }
+
+         pacing.wait(timestamp);
+
+         zmq::message_t msg(data.size());
+         memcpy(msg.data(), data.data(), data.size());
+#ifdef ZMQ_USE_SEND_FLAGS
+         bool ok = (bool)pub.send(msg, zmq::send_flags::dontwait);
+#else
+         bool ok = pub.send(msg, ZMQ_DONTWAIT);
+#endif
+         if(ok)
+         {
+            ++sent;
+            bytes += data.size();
+         }
+         else
+            ++dropped; // high water mark reached
+
+         auto now = replay_clock::now();
+         double elapsed = std::chrono::duration<double>(now - last_status).count();
+         if(elapsed >= status_update_interval)
+         {
+            printf("[MESYTEC] : sent %.0f msg/s (%.1f MB/s), HWM drops %.0f msg/s, total sent %llu dropped %llu\n",
+                   (sent-last_sent)/elapsed, (bytes-last_bytes)/elapsed/1.e6, (dropped-last_dropped)/elapsed,
+                   (unsigned long long)sent, (unsigned long long)dropped);
+            last_status = now;
+            last_sent = sent;
+            last_dropped = dropped;
+            last_bytes = bytes;
+         }
+      }
+   }
+
+   double elapsed = std::chrono::duration<double>(replay_clock::now() - replay_start).count();
+   printf("[MESYTEC] : replay finished: %llu messages sent in %.1f s (%.0f msg/s, %.1f MB/s), %llu dropped at HWM (%.2f%%)\n",
+          (unsigned long long)sent, elapsed, sent/elapsed, bytes/elapsed/1.e6, (unsigned long long)dropped,
+          (sent+dropped) ? 100.*dropped/(sent+dropped) : 0.);
+   pub.close();
+}
@@ -0,0 +1,120 @@
+#include "mesytec_buffer_reader.h"
+#include "mesytec_columnar.h"
+#include "mesytec_run_files.h"
+#ifdef MESYTEC_DATA_WITH_LZ4
+#include "mesytec_compressed_run.h"
+#endif
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "boost/program_options.hpp"
+
+namespace po = boost::program_options;
+
+int main(int argc, char *argv[])
+{
+   po::options_description desc("\nmfm_to_columnar\n\nConvert a run of MFM frames (as written by zmq_receiver) into a columnar file"
+                                 "\nfor offline analysis with mesytec::columnar_reader\n\nUsage");
+
+   desc.add_options()
+         ("help", "produce this message")
+         ("file", po::value<std::string>(), "first file of run, e.g. mesytec_run_12.dat (following files .1, .2, ... are read automatically)")
+         ("config_dir", po::value<std::string>(), "directory with crate_map.dat file (and optionally detector_correspondence.dat for detector names)")
+         ("output", po::value<std::string>(), "name of columnar file to write")
+         ("chunk_events", po::value<int>(), "[option] number of events in each chunk - default 65536")
+         ;
+
+   po::variables_map vm;
+   try
+   {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+   }
+   catch(...)
+   {
+      // in case of unknown options, print help & exit
+      std::cout << desc << "\n";
+      return 0;
+   }
+
+   if (vm.count("help") || !vm.count("file") || !vm.count("config_dir") || !vm.count("output")) {
+      std::cout << desc << "\n";
+      return 0;
+   }
+
+   auto file = vm["file"].as<std::string>();
+   auto output = vm["output"].as<std::string>();
+   uint32_t chunk_events = 65536;
+   if(vm.count("chunk_events")) chunk_events = vm["chunk_events"].as<int>();
+
+   try
+   {
+      mesytec::buffer_reader MESYbuf;
+      MESYbuf.read_crate_map(vm["config_dir"].as<std::string>() + "/crate_map.dat");
+      std::ifstream detector_correspondence(vm["config_dir"].as<std::string>() + "/detector_correspondence.dat");
+      if(detector_correspondence.good())
+         MESYbuf.read_detector_correspondence(vm["config_dir"].as<std::string>() + "/detector_correspondence.dat");
+
+      std::unique_ptr<mesytec::mfm_run_reader> mfm_run;
+#ifdef MESYTEC_DATA_WITH_LZ4
+      std::unique_ptr<mesytec::compressed_run_reader> compressed_run;
+      if(mesytec::is_compressed_run_file(file)) compressed_run.reset(new mesytec::compressed_run_reader(file));
+      else
+#endif
+      mfm_run.reset(new mesytec::mfm_run_reader(file));
+      auto next_frame = [&](std::vector<uint8_t>& frame)
+      {
+#ifdef MESYTEC_DATA_WITH_LZ4
+         if(compressed_run) return compressed_run->next(frame);
+#endif
+         return mfm_run->next(frame);
+      };
+
+      mesytec::columnar_writer writer(output, MESYbuf.get_setup(), chunk_events);
+      std::vector<uint8_t> frame;
+      uint64_t frames = 0, bytes = 0, parse_errors = 0;
+      auto start = std::chrono::steady_clock::now();
+      while(next_frame(frame))
+      {
+         ++frames;
+         bytes += frame.size();
+         uint32_t event_number, blob_size;
+         memcpy(&event_number, &frame[14], 4);
+         memcpy(&blob_size, &frame[20], 4);
+         if(24 + (size_t)blob_size > frame.size())
+         {
+            ++parse_errors;
+            continue;
+         }
+         auto timestamp = mesytec::mfm_run_reader::tgv_timestamp(frame.data());
+         try
+         {
+            MESYbuf.read_event_in_buffer(&frame[24], blob_size,
+                                         [&](mesytec::event& ev, mesytec::experimental_setup&)
+            {
+               writer.add_event(ev, event_number, timestamp);
+            }, frame[7]);
+         }
+         catch (std::exception& e)
+         {
+            ++parse_errors;
+            std::cout << "[MESYTEC] : Error parsing MFM frame " << frames << " : " << e.what() << std::endl;
+         }
+      }
+      writer.close();
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      printf("[MESYTEC] : %lu events written in %s\n", writer.get_number_of_events(), output.c_str());
+      printf("[MESYTEC] : converted %.1f MB of MFM frames in %.1f s (%.1f MB/s, %.0f events/s)\n", bytes/1.e6, elapsed,
+             bytes/1.e6/elapsed, frames/elapsed);
+      if(parse_errors)
+         printf("[MESYTEC] : %lu frames could not be parsed\n", parse_errors);
+   }
+   catch (std::exception& e)
+   {
+      std::cout << "[MESYTEC] : " << e.what() << std::endl;
+      return 1;
+   }
+}
@@ -0,0 +1,126 @@
+#include "mesytec_buffer_reader_mvlc_parser.h"
+#include "mesytec_event_filter.h"
+#include "mesytec_mvlc_listfile.h"
+#include "mesytec_mfm_frame.h"
+#include "mesytec_run_files.h"
+#include <memory>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include "boost/program_options.hpp"
+
+namespace po = boost::program_options;
+
+int main(int argc, char *argv[])
+{
+   po::options_description desc("\nmvlc_listfile_to_mfm\n\nConvert an MVLC listfile written by mvme into a run of MFM frames"
+                                 "\n(as written by zmq_receiver)\n\nUsage");
+
+   desc.add_options()
+         ("help", "produce this message")
+         ("listfile", po::value<std::string>(), "MVLC listfile (extracted from mvme zip archive)")
+         ("config_dir", po::value<std::string>(), "directory with crate_map.dat file (and detector_correspondence.dat for --filter)")
+         ("run", po::value<int>(), "run number, output is written in mesytec_run_[run].dat")
+         ("output", po::value<std::string>(), "[option] name of first output file (instead of mesytec_run_[run].dat)")
+         ("filesize", po::value<int>(), "[option] file size [MB] - default 1024 MB")
+         ("filter", po::value<std::string>(), "[option] only write events accepted by this filter (same syntax as mesytec_receiver_mfm_transmitter --filter)")
+         ("crateconfig", po::value<std::string>(), "[option] read MVLC crate config from this file instead of the listfile")
+         ("debug", "[option] enable debug output")
+         ;
+
+   po::variables_map vm;
+   try
+   {
+      po::store(po::parse_command_line(argc, argv, desc), vm);
+      po::notify(vm);
+   }
+   catch(...)
+   {
+      // in case of unknown options, print help & exit
+      std::cout << desc << "\n";
+      return 0;
+   }
+
+   if (vm.count("help") || !vm.count("listfile") || !vm.count("config_dir") || (!vm.count("run") && !vm.count("output"))) {
+      std::cout << desc << "\n";
+      return 0;
+   }
+
+   if (vm.count("debug"))
+      spdlog::set_level(spdlog::level::debug);
+
+   std::string output = vm.count("output") ? vm["output"].as<std::string>()
+                                           : "mesytec_run_" + std::to_string(vm["run"].as<int>()) + ".dat";
+   uint64_t filesize = 1024;
+   if(vm.count("filesize")) filesize = vm["filesize"].as<int>();
+
+   try
+   {
+      mesytec::mvlc_listfile_reader listfile(vm["listfile"].as<std::string>());
+
+      mesytec::mvlc_parser_buffer_reader MESYbuf;
+      MESYbuf.read_crate_map(vm["config_dir"].as<std::string>() + "/crate_map.dat");
+      if(vm.count("crateconfig"))
+         MESYbuf.read_mvlc_crateconfig(vm["crateconfig"].as<std::string>());
+      else
+      {
+         if(listfile.get_crate_config().empty())
+         {
+            std::cout << "[MESYTEC] : no crate config found in listfile, use --crateconfig\n";
+            return 1;
+         }
+         MESYbuf.read_mvlc_crateconfig_from_yaml(listfile.get_crate_config());
+      }
+      MESYbuf.initialise_readout();
+
+      std::unique_ptr<mesytec::event_filter> filter;
+      if(vm.count("filter"))
+      {
+         MESYbuf.read_detector_correspondence(vm["config_dir"].as<std::string>() + "/detector_correspondence.dat");
+         filter.reset(new mesytec::event_filter(vm["filter"].as<std::string>(), MESYbuf.get_setup()));
+      }
+
+      mesytec::mfm_run_writer writer(output, filesize*1024*1024);
+      std::vector<uint8_t> mfmevent(0x400000);
+      uint64_t parse_errors = 0, timeticks = 0;
+
+      auto start = std::chrono::steady_clock::now();
+      listfile.read(
+               [&](const uint32_t* data, size_t nwords)
+      {
+         try
+         {
+            MESYbuf.read_buffer_collate_events((const uint8_t*)data, nwords*4,
+                                               [&](mesytec::event& ev, mesytec::experimental_setup&)
+            {
+               if(!ev.has_data() || (filter && !filter->accept(ev))) return;
+               if(mesytec::mfm_frame_size(ev) > mfmevent.size()) mfmevent.resize(mesytec::mfm_frame_size(ev));
+               writer.write(mfmevent.data(), mesytec::write_mfm_frame(ev, mfmevent.data()));
+            });
+         }
+         catch (std::exception& e)
+         {
+            ++parse_errors;
+            std::cout << "[MESYTEC] : Error parsing Mesytec buffer : " << e.what() << std::endl;
+         }
+      },
+      [&](uint8_t subtype, const std::vector<uint32_t>&)
+      {
+         if(subtype == mesytec::system_event::subtype::UnixTimetick) ++timeticks;
+      });
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      printf("[MESYTEC] : %lu events written in %s... (run duration ~%lu s)\n", writer.get_frames_written(), output.c_str(), timeticks);
+      printf("[MESYTEC] : converted %.1f MB in %.1f s (%.1f MB/s, %.0f events/s)\n", listfile.get_file_size()/1.e6, elapsed,
+             listfile.get_file_size()/1.e6/elapsed, writer.get_frames_written()/elapsed);
+      if(filter)
+         printf("[MESYTEC] : filter accepted %lu of %lu events\n", filter->get_events_accepted(), filter->get_events_tested());
+      if(listfile.get_skipped_words() || parse_errors)
+         printf("[MESYTEC] : %lu words skipped in listfile, %lu parse errors\n", listfile.get_skipped_words(), parse_errors);
+   }
+   catch (std::exception& e)
+   {
+      std::cout << "[MESYTEC] : " << e.what() << std::endl;
+      return 1;
+   }
+}
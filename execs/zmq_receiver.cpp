@@ -1,5 +1,13 @@
 #include <string>
+#include <memory>
 #include "../narval/zmq_compat.h"
+#include "mesytec_shm_ring.h"
+#include "mesytec_event_topic.h"
+#include "mesytec_sharding.h"
+#ifdef MESYTEC_DATA_WITH_LZ4
+#include "mesytec_compressed_run.h"
+#endif
+#include <csignal>
 #include <ctime>
 #include <thread>
 #include <chrono>
@@ -9,6 +17,11 @@
 
 zmq::context_t context(1);	// for ZeroMQ communications
 
+volatile std::sig_atomic_t stop_requested = 0;    // set by SIGINT/SIGTERM
+void signal_handler(int)
+{
+   stop_requested = 1;
+}
 
 namespace po = boost::program_options;
 
@@ -22,16 +35,18 @@ struct mfm_header_decoder
     blob_size_t blob_size;
 
     mfm_header_decoder(zmq::message_t& M)
+        : mfm_header_decoder(M.data<uint8_t>(), M.size())
+    {}
+    mfm_header_decoder(const uint8_t* ev_dat, size_t size)
     {
         // extract infos from message buffer, assumed to contain 1 MFMFrame
         // WARNING - endianness is not tested, it is assumed!
 
-        if(M.size()<24){
+        if(size<24){
             throw( std::runtime_error("message size < 24 bytes : not an MFM header ?") );
         }
-        auto ev_dat = M.data<uint8_t>();
         frame_size = *((frame_size_t*)&ev_dat[1]) * 2;// size in 16-bit units
-        assert(M.size() == frame_size);
+        assert(size == frame_size);
         frame_type = *((frame_type_t*)&ev_dat[5]);
         if(frame_type != 0x4adf){
             throw( std::runtime_error("not a Mesytec frame!") );
@@ -48,8 +63,17 @@ int main(int argc, char *argv[])
             ("help", "produce this message")
             ("zmq_host", po::value<std::string>(), "url of host where mesytec_receiver_mfm_transmitter is runnning")
             ("zmq_port", po::value<int>(), "port on which to receive MFM data")
+            ("shards", po::value<int>(), "[option] receive and merge all shards of a sharded transmitter, on ports zmq_port, zmq_port+1, ... (default: 1)")
+            ("subscribe", po::value<std::string>(), "[option] only receive events with this topic (transmitter with --topics): physics, scaler, or hexadecimal topic prefix 0x... (default: all)")
+            ("shm", po::value<std::string>(), "[option] read MFM data from shared memory ring with this name (transmitter on same host with --shm), instead of zmq_host/zmq_port")
+            ("shm_lossy", "[option] do not hold back transmitter if too slow to read shared memory ring (frames may be lost)")
             ("run", po::value<int>(), "run number")
             ("filesize", po::value<int>(), "file size [MB] - default 1024 MB")
+#ifdef MESYTEC_DATA_WITH_LZ4
+            ("compress", "[option] write LZ4-compressed blocks of frames in mesytec_run_[run].mfmz (see README)")
+            ("block_size", po::value<int>(), "[option] uncompressed size of blocks with --compress [kB] - default 4096 kB")
+            ("compression_threads", po::value<int>(), "[option] number of compression threads with --compress - default 2")
+#endif
             ;
 
     po::variables_map vm;
@@ -70,24 +94,39 @@ int main(int argc, char *argv[])
         return 0;
     }
 
-    if(!vm.count("zmq_port")||!vm.count("zmq_host")||!vm.count("run"))
+    if(((!vm.count("zmq_port")||!vm.count("zmq_host")) && !vm.count("shm"))||!vm.count("run"))
     {
         std::cout << desc << "\n";
         return 0;
     }
 
+    auto run_number = vm["run"].as<int>();
+    auto filesize = 1024;
+    if(vm.count("filesize")) filesize = vm["filesize"].as<int>();
+
+    std::string shm_name;
+    bool shm_lossy = vm.count("shm_lossy");
+    std::unique_ptr<mesytec::shm_ring_consumer> shm_ring;
+    if(vm.count("shm"))
+    {
+        shm_name = vm["shm"].as<std::string>();
+        shm_ring.reset(new mesytec::shm_ring_consumer(shm_name, shm_lossy));
+        std::cout << "[MESYTEC] : Reading shared memory ring " << shm_name << (shm_lossy ? " (lossy)" : "") << std::endl;
+    }
+
     std::string zmq_port = "tcp://";
+    zmq::socket_t* pub{nullptr};
+    mesytec::shard_sequence_checker shard_checker;
+    if(!shm_ring)
+    {
     std::string path_to_host = vm["zmq_host"].as<std::string>();
     int host_port;
     host_port = vm["zmq_port"].as<int>();
     zmq_port = zmq_port + path_to_host + ":" + std::to_string(host_port);
-
-    auto run_number = vm["run"].as<int>();
-    auto filesize = 1024;
-    if(vm.count("filesize")) filesize = vm["filesize"].as<int>();
+    std::string subscription;
+    if(vm.count("subscribe")) subscription = mesytec::event_topic::subscription(vm["subscribe"].as<std::string>());
 
     // start zmq receiver here (probably)
-    zmq::socket_t* pub{nullptr};
     try {
         pub = new zmq::socket_t(context, ZMQ_SUB);
     } catch (zmq::error_t &e) {
@@ -100,17 +139,25 @@ int main(int argc, char *argv[])
 #else
     pub->setsockopt(ZMQ_RCVTIMEO, &timeout, sizeof(int));
 #endif
+    // a SUB socket connected to several endpoints receives (fair-queued) messages from all of them
+    int number_of_shards = 1;
+    if(vm.count("shards")) number_of_shards = vm["shards"].as<int>();
+    for(int shard = 0; shard < number_of_shards; ++shard)
+    {
+    zmq_port = "tcp://" + path_to_host + ":" + std::to_string(host_port + shard);
     try {
         pub->connect(zmq_port.c_str());
     } catch (zmq::error_t &e) {
         std::cout << "[MESYTEC] : ERROR" << "process_start: failed to bind ZeroMQ endpoint " << zmq_port << ": " << e.what () << std::endl;
     }
     std::cout << "[MESYTEC] : Connected to MESYTECSpy " << zmq_port << std::endl;
+    }
 #ifdef ZMQ_SETSOCKOPT_DEPRECATED
-   pub->set(zmq::sockopt::subscribe,"");
+   pub->set(zmq::sockopt::subscribe,subscription);
 #else
-    pub->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+    pub->setsockopt(ZMQ_SUBSCRIBE, subscription.data(), subscription.size());
 #endif
+    }
 
     time_t current_time;
     time(&current_time);
@@ -134,11 +181,55 @@ int main(int argc, char *argv[])
     uint64_t file_size = filesize*1024*1024;
     uint64_t file_used = 0;
 
+#ifdef MESYTEC_DATA_WITH_LZ4
+    std::unique_ptr<mesytec::compressed_run_writer> compressed_output;
+    std::vector<uint8_t> frame_copy;
+    if(vm.count("compress"))
+    {
+        uint32_t block_size = 4096*1024;
+        if(vm.count("block_size")) block_size = vm["block_size"].as<int>()*1024;
+        int threads = 2;
+        if(vm.count("compression_threads")) threads = vm["compression_threads"].as<int>();
+        file_name = "mesytec_run_" + std::to_string(run_number) + ".mfmz";
+        compressed_output.reset(new mesytec::compressed_run_writer(file_name, file_size, block_size, threads));
+        printf ("[MESYTEC] : writing LZ4-compressed blocks of %u kB in %s (%d threads)\n", block_size/1024, file_name.c_str(), threads);
+    }
+    else
+#endif
     output_file.open(file_name, std::ios_base::out | std::ios_base::binary);
 
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+
     /*** MAIN LOOP ***/
-    while(1)
+    while(!stop_requested)
     {
+        const uint8_t* frame_data;
+        size_t frame_length;
+        if(shm_ring)
+        {
+            uint32_t size;
+            if(!(frame_data = shm_ring->next(size, 100)))
+            {
+                if(shm_ring->producer_closed())
+                {
+                    // transmitter stopped: wait for it to be restarted
+                    std::cout << "[MESYTEC] : shared memory ring " << shm_name << " closed, waiting for transmitter..." << std::endl;
+                    shm_ring.reset();
+                    while(!shm_ring)
+                    {
+                        std::this_thread::sleep_for(std::chrono::seconds(1));
+                        try {
+                            shm_ring.reset(new mesytec::shm_ring_consumer(shm_name, shm_lossy));
+                        } catch (std::exception&) {}
+                    }
+                }
+                continue;
+            }
+            frame_length = size;
+        }
+        else
+        {
         try{
 #ifdef ZMQ_USE_RECV_WITH_REFERENCE
             if(!pub->recv(event))
@@ -155,9 +246,37 @@ int main(int argc, char *argv[])
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
             continue;
         }
+        if(event.more())
+        {
+            // first part was the topic of the event: frame follows
+#ifdef ZMQ_USE_RECV_WITH_REFERENCE
+            if(!pub->recv(event)) continue;
+#else
+            if(!pub->recv(&event)) continue;
+#endif
+        }
+        frame_data = event.data<uint8_t>();
+        frame_length = event.size();
+        }
 
         ++tot_events_parsed;
-        mfm_header_decoder decod(event);
+        mfm_header_decoder decod(frame_data, frame_length);
+        shard_checker.check(frame_data);
+#ifdef MESYTEC_DATA_WITH_LZ4
+        if(compressed_output)
+        {
+            if(shm_ring)
+            {
+                // frame in shared memory ring can only be used once it has been released
+                frame_copy.assign(frame_data, frame_data + decod.frame_size);
+                if(!shm_ring->release()) continue; // (lossy) frame was overwritten while being copied
+                frame_data = frame_copy.data();
+            }
+            compressed_output->write(frame_data, decod.frame_size);
+        }
+        else
+        {
+#endif
         if(buffer_used+decod.frame_size > buffer_size)
         {
             // buffer is full - dump to disk
@@ -181,9 +300,13 @@ int main(int argc, char *argv[])
             frames_in_buffer = 0;
         }
         // copy frame to buffer
-        memcpy(buffer+buffer_used, event.data(), decod.frame_size);
+        memcpy(buffer+buffer_used, frame_data, decod.frame_size);
+        if(shm_ring && !shm_ring->release()) continue; // (lossy) frame was overwritten while being copied
         buffer_used += decod.frame_size;
         ++frames_in_buffer;
+#ifdef MESYTEC_DATA_WITH_LZ4
+        }
+#endif
 
         time_t t;
         time(&t);
@@ -196,7 +319,20 @@ int main(int argc, char *argv[])
             std::string now = asctime(timeinfo);
             now.erase(now.size()-1);//remove new line character
             std::cout << "[MESYTEC] : " << now << " : parse rate " << tot_events_parsed/time_elapsed << " evt./sec...\n";
+#ifdef MESYTEC_DATA_WITH_LZ4
+            if(compressed_output && compressed_output->get_bytes_in())
+                printf("[MESYTEC] : compressed %.1f MB to %.1f MB (%.1f%%)\n", compressed_output->get_bytes_in()/1.e6,
+                       compressed_output->get_bytes_out()/1.e6, 100.*compressed_output->get_bytes_out()/compressed_output->get_bytes_in());
+#endif
+            if(shard_checker.get_frames_lost()) shard_checker.print();
             tot_events_parsed=0;
         }
     }
+
+    // write data still in memory
+    std::cout << "[MESYTEC] : stopping, closing file " << file_name << std::endl;
+#ifdef MESYTEC_DATA_WITH_LZ4
+    compressed_output.reset();
+#endif
+    if(buffer_used) output_file.write((const char*)buffer,buffer_used);
 }
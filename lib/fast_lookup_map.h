@@ -260,6 +260,18 @@ public:
          throw std::runtime_error("no object in map with requested index " + std::to_string(id) + " [maxindex=" + std::to_string(maxindex) +"]");
       return *objects[id];
    }
+   /// \returns pointer to object with given index, or nullptr if not in map (never throws)
+   /// \param id index of required object
+   Object* find_object(Index id)
+   {
+      return has_object(id) ? &(*objects[id]) : nullptr;
+   }
+   /// \returns pointer to object with given index, or nullptr if not in map (never throws)
+   /// \param id index of required object
+   const Object* find_object(Index id) const
+   {
+      return has_object(id) ? &(*objects[id]) : nullptr;
+   }
    Object& operator[](Index id) { return get_object(id); }
    const Object& operator[](Index id) const { return get_object(id); }
 };
@@ -0,0 +1,105 @@
+#include "mesytec_batch_parser.h"
+#include "mesytec_run_files.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace mesytec
+{
+   batch_parser::batch_parser(size_t _max_events, size_t _max_hits)
+      : max_events{_max_events}, max_hits{_max_hits},
+        timestamp(_max_events), event_counter(_max_events),
+        event_index(_max_hits), module(_max_hits), bus(_max_hits), channel(_max_hits), type(_max_hits), value(_max_hits)
+   {
+      /// \param[in] _max_events maximum number of events decoded by each call to parse()
+      /// \param[in] _max_hits maximum number of hits decoded by each call to parse()
+
+      if(!max_events || !max_hits) throw std::invalid_argument("batch_parser: max_events and max_hits must be > 0");
+   }
+
+   size_t batch_parser::parse(const uint8_t *frames, size_t nbytes)
+   {
+      /// \param[in] frames buffer containing MFM frames one after the other
+      /// \param[in] nbytes size of buffer in bytes
+      /// \returns number of bytes of buffer used, i.e. of whole frames decoded
+      ///
+      /// Frames are decoded until the end of the buffer, an incomplete frame at the end of the buffer, or the
+      /// maximum number of events or hits is reached (a frame is only used if all its hits fit in the arrays).
+      /// Call again with the rest of the buffer to decode the following frames.
+      ///
+      /// Throws std::runtime_error if a frame header is not valid, or the exceptions of buffer_reader if a frame
+      /// cannot be decoded. If the resync mode of the reader is used (get_reader().set_resync()), invalid data
+      /// between frames and frames which cannot be decoded are skipped instead.
+
+      events = hits = 0;
+      size_t used = 0;
+      while(nbytes - used >= 24 && events < max_events)
+      {
+         auto frame = frames + used;
+         auto frame_size = mfm_run_reader::frame_size(frame);
+         uint32_t blob_size;
+         memcpy(&blob_size, frame + 20, 4);
+         if(reader.get_resync())
+         {
+            if(!is_mfm_frame_header(frame, nbytes - used))
+            {
+               used = reader.resync_to_next_frame(frames, nbytes, used);
+               continue;
+            }
+         }
+         else if(frame_size < 24 || 24 + (size_t)blob_size > frame_size)
+         {
+            uint32_t word;
+            memcpy(&word, frame, 4);
+            reader.report_error(parse_status::bad_frame_header, word, 0, used);
+            throw std::runtime_error("batch_parser: bad MFM frame header at offset " + std::to_string(used));
+         }
+         if(frame_size > nbytes - used) break;
+
+         bool full = false;
+         bool decoded = false; // false if frame quarantined in resync mode
+         reader.read_event_in_buffer(frame + 24, blob_size, [&](event& ev, experimental_setup& setup)
+         {
+            decoded = true;
+            size_t n = 0;
+            for(auto& mod_data : ev.get_module_data())
+               if(setup.get_module(mod_data.get_module_id()).firmware != MVLC_SCALER) n += mod_data.get_channel_data().size();
+            if(hits + n > max_hits)
+            {
+               // frame will be decoded again by next call
+               full = true;
+               return;
+            }
+            for(auto& mod_data : ev.get_module_data())
+            {
+               auto id = mod_data.get_module_id();
+               if(setup.get_module(id).firmware == MVLC_SCALER) continue;
+               for(auto& d : mod_data.get_channel_data())
+               {
+                  event_index[hits] = events;
+                  module[hits] = id;
+                  bus[hits] = d.get_bus_number();
+                  channel[hits] = d.get_channel_number();
+                  type[hits] = d.get_data_type();
+                  value[hits] = d.get_data();
+                  ++hits;
+               }
+            }
+         }, frame[7]);
+         if(full)
+         {
+            if(!events) throw std::runtime_error("batch_parser: max_hits too small for one event");
+            break;
+         }
+         if(!decoded)
+         {
+            used += frame_size;
+            continue;
+         }
+         memcpy(&event_counter[events], frame + 14, 4);
+         timestamp[events] = mfm_run_reader::tgv_timestamp(frame);
+         ++events;
+         used += frame_size;
+      }
+      return used;
+   }
+}
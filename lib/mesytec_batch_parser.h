@@ -0,0 +1,88 @@
+#ifndef MESYTEC_BATCH_PARSER_H
+#define MESYTEC_BATCH_PARSER_H
+
+#include "mesytec_buffer_reader.h"
+#include <cstdint>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class batch_parser
+      @brief decode a batch of MFM frames into contiguous arrays (e.g. for NumPy)
+
+      parse() decodes the frames in a buffer (a sequence of whole MFM frames, e.g. read from a run file written by
+      zmq_receiver) with a buffer_reader, and fills arrays which are allocated once with the maximum number of
+      events & hits of a batch:
+
+      | array         | type     | size               | contents |
+      |---------------|----------|--------------------|----------|
+      | timestamp     | uint64_t | number of events   | 48-bit TGV timestamp from MFM frame header |
+      | event_counter | uint32_t | number of events   | event number from MFM frame header |
+      | event_index   | uint32_t | number of hits     | index of event of hit in the batch |
+      | module        | uint8_t  | number of hits     | HW address of module |
+      | bus           | uint8_t  | number of hits     | bus number (0 for MDPP) |
+      | channel       | uint8_t  | number of hits     | channel number (subaddress for VMMR) |
+      | type          | uint8_t  | number of hits     | mesytec::module::datatype_t |
+      | value         | uint16_t | number of hits     | 16-bit data |
+
+      The arrays are overwritten by each call to parse(), and never reallocated: their addresses do not change,
+      so that they can be shared without copying (see the Python bindings in `python/`). Data of MVLC_SCALER
+      modules is not included.
+
+      ~~~~{.cpp}
+      mesytec::batch_parser parser;
+      parser.get_reader().read_crate_map("crate_map.dat");
+      size_t used = 0;
+      while(used < nbytes)
+      {
+         used += parser.parse(frames + used, nbytes - used);
+         \// use parser.get_value()[0 ... parser.get_number_of_hits()-1], etc.
+      }
+      ~~~~
+    */
+   class batch_parser
+   {
+      buffer_reader reader;
+      size_t max_events;
+      size_t max_hits;
+      size_t events{0};
+      size_t hits{0};
+
+      std::vector<uint64_t> timestamp;
+      std::vector<uint32_t> event_counter;
+      std::vector<uint32_t> event_index;
+      std::vector<uint8_t> module;
+      std::vector<uint8_t> bus;
+      std::vector<uint8_t> channel;
+      std::vector<uint8_t> type;
+      std::vector<uint16_t> value;
+
+   public:
+      batch_parser(size_t max_events = 65536, size_t max_hits = 16*1024*1024);
+
+      /**
+         @return buffer_reader used to decode frames (read crate map & detector correspondence with it)
+       */
+      buffer_reader& get_reader() { return reader; }
+      const experimental_setup& get_setup() const { return reader.get_setup(); }
+
+      size_t parse(const uint8_t* frames, size_t nbytes);
+
+      size_t get_max_events() const { return max_events; }
+      size_t get_max_hits() const { return max_hits; }
+      size_t get_number_of_events() const { return events; }
+      size_t get_number_of_hits() const { return hits; }
+
+      const uint64_t* get_timestamp() const { return timestamp.data(); }
+      const uint32_t* get_event_counter() const { return event_counter.data(); }
+      const uint32_t* get_event_index() const { return event_index.data(); }
+      const uint8_t* get_module() const { return module.data(); }
+      const uint8_t* get_bus() const { return bus.data(); }
+      const uint8_t* get_channel() const { return channel.data(); }
+      const uint8_t* get_type() const { return type.data(); }
+      const uint16_t* get_value() const { return value.data(); }
+   };
+}
+
+#endif // MESYTEC_BATCH_PARSER_H
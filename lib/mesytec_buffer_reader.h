@@ -5,12 +5,18 @@
 
 #include "mesytec_data.h"
 #include "mesytec_experimental_setup.h"
+#include "mesytec_data_selection.h"
+#include "mesytec_mfm_frame.h"
 #include <cassert>
 #include <ios>
 #include <ostream>
 #include <cstring>
 #include <ctime>
 #include <array>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #define MESYTEC_DATA_BUFFER_READER_NO_DEFINE_SETUP
 #define MESYTEC_DATA_BUFFER_READER_CALLBACK_WITH_EVENT_AND_SETUP
@@ -34,21 +40,41 @@ namespace mesytec
       bool reading_data=false;
       uint8_t* buf_pos=nullptr;
       bool reading_mvlc_scaler{false};
+      data_selection selection;
+      bool use_selection{false};
+      bool resync{false};
+      resync_counters resync_count;
+      parse_error_counters error_count;
+      parse_error_callback error_callback;
+      parse_error last_error;
 
       /**
              Decode buffers encapsulated in MFM frames with frame revision id=1:
                  + buffers only contain module header and data words for modules which fire/produce data
+
+             If a data_selection is used, words of modules which are not selected are skipped without
+             being decoded. As EOE and fill words are not written in the frame, the length field of the
+             module header cannot be used to jump over the module's data: instead we simply look for the
+             next module header.
+
+             In resync mode, the block of a module which is not in the crate map is skipped in the same way
+             (quarantined), as well as any data words before the first module header.
+
+             No exceptions are thrown for corrupted data: errors are reported (see report_error()) and returned.
              */
-      template<typename CallbackFunction>
-      void read_event_in_buffer_v1(const uint8_t* _buf, size_t nbytes, CallbackFunction F)
+      parse_status decode_event_v1(const uint8_t* _buf, size_t nbytes, event& mesy_event)
       {
          assert(nbytes%4==0);
 
          int words_to_read = nbytes/4;
          buf_pos = const_cast<uint8_t*>(_buf);
-         event mesy_event;
+         mesy_event.clear();
          mod_data.clear();
-         module *current_module;
+         module *current_module{nullptr};
+         bool skip_module = false;      // module not selected: ignore its data
+         bool select_channels = false;  // only some channels of module selected: test each word
+         bool quarantined = false;      // (resync mode) unknown module: skip its data
+         bool orphan_data = false;      // (resync mode) data words before first module header
          while(words_to_read--)
          {
             auto next_word = read_data_word(buf_pos);
@@ -56,65 +82,102 @@ namespace mesytec
             if(is_module_header(next_word))
             {
                // add previously read module to event
-               if(mod_data.module_id) mesy_event.add_module_data(mod_data);
+               if(mod_data.module_id && !skip_module && (!select_channels || mod_data.has_data()))
+                  mesy_event.add_module_data(mod_data);
 
                // new module
-               current_module = &mesytec_setup.get_module(module_id(next_word));
+               auto id = module_id(next_word);
+               skip_module = use_selection && !selection.has_module(id);
+               quarantined = false;
+               if(!skip_module && !(current_module = mesytec_setup.find_module(id)))
+               {
+                  auto status = report_error(parse_status::unknown_module, next_word, id, buf_pos - _buf);
+                  if(!resync) return status;
+                  ++resync_count.modules_quarantined;
+                  quarantined = skip_module = true;
+               }
+               if(skip_module)
+               {
+                  mod_data.clear();
+                  buf_pos+=4;
+                  continue;
+               }
+               select_channels = use_selection && !selection.has_all_data(id);
                auto firmware = current_module->firmware;
                mod_data.set_header_word(next_word,firmware);
 
                reading_mvlc_scaler = current_module->firmware == MVLC_SCALER;
             }
+            else if(skip_module)
+            {
+               // not decoded
+               if(quarantined) resync_count.bytes_skipped+=4;
+            }
+            else if(!current_module)
+            {
+               if(!orphan_data)
+               {
+                  // reported once per frame
+                  auto status = report_error(parse_status::data_before_module_header, next_word, 0, buf_pos - _buf);
+                  if(!resync) return status;
+                  orphan_data = true;
+               }
+               resync_count.bytes_skipped+=4;
+            }
             else if(reading_mvlc_scaler)
             {
                mod_data.add_data(next_word);
             }
             else if(is_mdpp_data(next_word)||is_vmmr_data(next_word)) {
                current_module->set_data_word(next_word);
+               auto type = current_module->get_data_type();
+               auto channel = current_module->get_channel_number();
                if(current_module->firmware == VMMR)
-                  mod_data.add_data( current_module->get_data_type(), current_module->get_bus_number(), current_module->get_channel_number(),
-                                     current_module->get_channel_data(), next_word);
-               else
-                  mod_data.add_data( current_module->get_data_type(), current_module->get_channel_number(),
-                                     current_module->get_channel_data(), next_word);
+               {
+                  auto bus = current_module->get_bus_number();
+                  if(!select_channels || selection.accept(mod_data.module_id, bus, channel, type))
+                     mod_data.add_data( type, bus, channel, current_module->get_channel_data(), next_word);
+               }
+               else if(!select_channels || selection.accept(mod_data.module_id, 0, channel, type))
+                  mod_data.add_data( type, channel, current_module->get_channel_data(), next_word);
             }
             buf_pos+=4;
          }
          // add last read module to event
-         if(mod_data.module_id) mesy_event.add_module_data(mod_data);
-
-         // read all data - call function
-         F(mesy_event,mesytec_setup);
+         if(mod_data.module_id && !skip_module && (!select_channels || mod_data.has_data()))
+            mesy_event.add_module_data(mod_data);
+         return parse_status::ok;
       }
       /**
              Decode buffers encapsulated in MFM frames, with frame revision id=0:
                 + buffers included 'End-of-Event' words (which could in actual fact be StackFrame headers etc.),
                   as well as module headers even for modules with no data
              */
-      template<typename CallbackFunction>
-      void read_event_in_buffer_v0(const uint8_t* _buf, size_t nbytes, CallbackFunction F)
+      parse_status decode_event_v0(const uint8_t* _buf, size_t nbytes, event& mesy_event)
       {
          assert(nbytes%4==0);
 
          int words_to_read = nbytes/4;
          buf_pos = const_cast<uint8_t*>(_buf);
-         event mesy_event;
+         mesy_event.clear();
 
          while(words_to_read--)
          {
             auto next_word = read_data_word(buf_pos);
             if(is_module_header(next_word))
             {
-               auto firmware = mesytec_setup.get_module(module_id(next_word)).firmware;
-               mod_data.set_header_word(next_word,firmware);
+               auto mod = mesytec_setup.find_module(module_id(next_word));
+               if(!mod) return report_error(parse_status::unknown_module, next_word, module_id(next_word), buf_pos - _buf);
+               mod_data.set_header_word(next_word,mod->firmware);
                got_header = true;
                reading_data = false;
             }
             else if(is_mdpp_data(next_word)) {
                reading_data=true;
-               auto& mod = mesytec_setup.get_module(mod_data.module_id);
-               mod.set_data_word(next_word);
-               mod_data.add_data( mod.get_data_type(), mod.get_channel_number(), mod.get_channel_data(), next_word);
+               auto mod = mesytec_setup.find_module(mod_data.module_id);
+               if(!mod) return report_error(parse_status::data_before_module_header, next_word, mod_data.module_id, buf_pos - _buf);
+               mod->set_data_word(next_word);
+               mod_data.add_data( mod->get_data_type(), mod->get_channel_number(), mod->get_channel_data(), next_word);
             }
             // due to the confusion between 'end of event' and 'frame header' words in revision 0,
             // here we replace the original test 'if(is_end_of_event...' with 'if(is_end_of_event || is_frame_header...'
@@ -131,8 +194,7 @@ namespace mesytec
             }
             buf_pos+=4;
          }
-         // read all data - call function
-         F(mesy_event,mesytec_setup);
+         return parse_status::ok;
       }
    public:
       buffer_reader() = default;
@@ -158,6 +220,76 @@ namespace mesytec
       {
          mesytec_setup.read_detector_correspondence(det_cor_file);
       }
+      /**
+               @return description of experimental configuration used to decode data
+             */
+      const experimental_setup& get_setup() const { return mesytec_setup; }
+      /**
+               only decode the modules/channels/data types in the selection (see mesytec::data_selection).
+               Only used for MFM frames with revision id>=1.
+
+               @param sel selection to use (a copy is kept). An empty selection means all data is decoded.
+             */
+      void set_data_selection(const data_selection& sel)
+      {
+         selection = sel;
+         use_selection = !selection.empty();
+      }
+      /**
+               decode all data (default)
+             */
+      void clear_data_selection()
+      {
+         selection.clear();
+         use_selection = false;
+      }
+      const data_selection& get_data_selection() const { return selection; }
+      /**
+               resync mode: carry on after corrupted data instead of throwing exceptions.
+
+               Blocks of modules which are not in the crate map are skipped (quarantined), frames which cannot
+               be decoded are skipped, and when iterating over a buffer of frames with events(), corrupted data
+               between frames is skipped by searching for the next valid MFM frame header.
+               Everything skipped is counted, see get_resync_counters().
+             */
+      void set_resync(bool on = true) { resync = on; }
+      bool get_resync() const { return resync; }
+      const resync_counters& get_resync_counters() const { return resync_count; }
+      void clear_resync_counters() { resync_count.clear(); }
+
+      /**
+               @param cb function called with each error found in the data (with resync mode, e.g. to log or dump the
+                         corrupted data: errors do not interrupt decoding). An empty function removes the callback.
+
+               Errors are found and reported without exceptions being thrown: in strict (non-resync) mode, the
+               exceptions of read_event_in_buffer() and decode_event() are only thrown after the error is reported.
+               Use try_decode_event() to avoid them completely.
+             */
+      void set_error_callback(parse_error_callback cb) { error_callback = std::move(cb); }
+      /**
+               @return number of errors of each type found in the data so far
+             */
+      const parse_error_counters& get_error_counters() const { return error_count; }
+      void clear_error_counters() { error_count.clear(); }
+      /**
+               @return context of the last error found in the data
+             */
+      const parse_error& get_last_error() const { return last_error; }
+      /**
+               count an error found in the data and call the error callback (if any)
+
+               @return the status of the error
+             */
+      parse_status report_error(parse_status status, uint32_t word, uint8_t mod_id, size_t offset)
+      {
+         last_error.status = status;
+         last_error.word = word;
+         last_error.module_id = mod_id;
+         last_error.offset = offset;
+         error_count.count(status);
+         if(error_callback) error_callback(last_error);
+         return status;
+      }
 
       /**
              @param _buf pointer to the beginning of the buffer
@@ -179,21 +311,231 @@ namespace mesytec
 
              Straight after the call, the event will be deleted, so don't bother keeping a copy of a
              reference to it, any data must be treated/copied/moved in the callback function.
+
+             In resync mode (see set_resync()), F is not called for frames which cannot be decoded.
       */
       template<typename CallbackFunction>
       void read_event_in_buffer(const uint8_t* _buf, size_t nbytes, CallbackFunction F, u8 mfm_frame_rev = 1)
       {
+         // in resync mode, frames which cannot be decoded are quarantined: no callback
+         event mesy_event;
+         if(decode_event(_buf, nbytes, mesy_event, mfm_frame_rev)) F(mesy_event,mesytec_setup);
+      }
+
+      /**
+             @param _buf pointer to the beginning of the buffer
+             @param nbytes size of buffer in bytes
+             @param mesy_event event to fill with the decoded data (any previous data is cleared)
+             @param mfm_frame_rev revision number of the MFM frame [default: 1]
+
+             @return false if the frame was quarantined (resync mode only): the event is then empty
+
+             Same as read_event_in_buffer(), but the event is decoded into an event belonging to the caller
+             (e.g. from a mesytec::event_pool) instead of being given to a callback. The event counter and
+             TGV timestamp of the event are not modified.
+
+             In resync mode, instead of throwing an exception, a frame which cannot be decoded is counted
+             in resync_counters::frames_quarantined.
+      */
+      bool decode_event(const uint8_t* _buf, size_t nbytes, event& mesy_event, u8 mfm_frame_rev = 1)
+      {
+         if(try_decode_event(_buf, nbytes, mesy_event, mfm_frame_rev) == parse_status::ok) return true;
+         if(!resync) throw std::runtime_error("buffer_reader: " + last_error.describe());
+         return false;
+      }
+      /**
+             @param _buf pointer to the beginning of the buffer
+             @param nbytes size of buffer in bytes
+             @param mesy_event event to fill with the decoded data (any previous data is cleared)
+             @param mfm_frame_rev revision number of the MFM frame [default: 1]
+
+             @return parse_status::ok if the event was decoded, otherwise the error which stopped decoding
+                     (the event is then empty, and the error has been reported, see set_error_callback())
+
+             Same as decode_event(), but never throws for corrupted data. In resync mode, blocks of unknown modules
+             are quarantined without stopping decoding (parse_status::ok is returned if the rest of the frame could be
+             decoded).
+      */
+      parse_status try_decode_event(const uint8_t* _buf, size_t nbytes, event& mesy_event, u8 mfm_frame_rev = 1)
+      {
+         parse_status status;
          switch(mfm_frame_rev)
          {
          case 0:
-            read_event_in_buffer_v0(_buf,nbytes,F);
+            status = decode_event_v0(_buf,nbytes,mesy_event);
             break;
          case 1:
-            read_event_in_buffer_v1(_buf,nbytes,F);
+            status = decode_event_v1(_buf,nbytes,mesy_event);
             break;
          default:
-            throw std::runtime_error("unknown MFM frame revision");
+            status = report_error(parse_status::unknown_frame_revision, mfm_frame_rev, 0, 0);
+         }
+         if(status != parse_status::ok)
+         {
+            mesy_event.clear();
+            if(resync) ++resync_count.frames_quarantined;
+         }
+         return status;
+      }
+      /**
+         @param frames buffer containing MFM frames
+         @param nbytes size of buffer in bytes
+         @param offset position of a frame with an invalid header
+         @return position of next valid MFM frame header (or nbytes)
+
+         Used in resync mode to skip corrupted data between frames (counted in resync_counters). The invalid header
+         is reported as parse_status::bad_frame_header.
+       */
+      size_t resync_to_next_frame(const uint8_t* frames, size_t nbytes, size_t offset)
+      {
+         uint32_t word = 0;
+         memcpy(&word, frames + offset, std::min<size_t>(4, nbytes - offset));
+         report_error(parse_status::bad_frame_header, word, 0, offset);
+         auto next_frame = find_mfm_frame_header(frames, nbytes, offset + 1);
+         ++resync_count.resyncs;
+         resync_count.bytes_skipped += next_frame - offset;
+         return next_frame;
+      }
+
+      /**
+         @class event_range
+         @brief pull-style iteration over the events in a buffer of MFM frames
+
+         Returned by buffer_reader::events(). Each step decodes the next frame of the buffer into a single
+         event object which is reused for all frames (no allocation per event once the vectors have grown to
+         the size of the largest event): a reference to it is only valid until the next step.
+
+         Iteration stops at the end of the buffer, or before an incomplete frame at the end of the buffer:
+         get_bytes_used() then gives the offset where the next batch should start. Event counter and TGV timestamp
+         of each event are set from the MFM frame header.
+       */
+      class event_range
+      {
+         buffer_reader* reader;
+         const uint8_t* frames;
+         size_t nbytes;
+         size_t offset{0};
+         event current;
+         const uint8_t* current_frame{nullptr};
+
+      public:
+         event_range(buffer_reader& r, const uint8_t* _frames, size_t _nbytes)
+            : reader{&r}, frames{_frames}, nbytes{_nbytes}
+         {}
+         /**
+            decode the next frame of the buffer
+
+            @return false if there are no more (complete) frames in the buffer
+
+            Throws std::runtime_error if a frame header is not valid, or the exceptions of buffer_reader if a frame
+            cannot be decoded. In the latter case, iteration can continue with the following frame.
+            In resync mode (see buffer_reader::set_resync()), invalid data is skipped instead.
+          */
+         bool next()
+         {
+            while(nbytes - offset >= 24)
+            {
+               auto frame = frames + offset;
+               size_t frame_size = 2*(frame[1] | (frame[2] << 8) | (frame[3] << 16));
+               uint32_t blob_size;
+               memcpy(&blob_size, frame + 20, 4);
+               if(reader->resync)
+               {
+                  if(!is_mfm_frame_header(frame, nbytes - offset))
+                  {
+                     offset = reader->resync_to_next_frame(frames, nbytes, offset);
+                     continue;
+                  }
+               }
+               else if(frame_size < 24 || 24 + (size_t)blob_size > frame_size)
+               {
+                  uint32_t word;
+                  memcpy(&word, frame, 4);
+                  reader->report_error(parse_status::bad_frame_header, word, 0, offset);
+                  throw std::runtime_error("buffer_reader::event_range: bad MFM frame header at offset " + std::to_string(offset));
+               }
+               if(frame_size > nbytes - offset) return false;
+               // frame is consumed even if it cannot be decoded, to allow to carry on with the next one
+               offset += frame_size;
+               current_frame = frame;
+               // in resync mode, frames which cannot be decoded are skipped
+               if(!reader->decode_event(frame + 24, blob_size, current, frame[7])) continue;
+               memcpy(&current.event_counter, frame + 14, 4);
+               memcpy(&current.tgv_ts_lo, frame + 8, 2);
+               memcpy(&current.tgv_ts_mid, frame + 10, 2);
+               memcpy(&current.tgv_ts_hi, frame + 12, 2);
+               return true;
+            }
+            return false;
+         }
+         /**
+            @return the last decoded event
+          */
+         event& get_event() { return current; }
+         /**
+            @return pointer to the MFM frame of the last decoded event
+          */
+         const uint8_t* get_frame() const { return current_frame; }
+         /**
+            @return number of bytes of the buffer used, i.e. of whole frames read so far
+          */
+         size_t get_bytes_used() const { return offset; }
+
+         class iterator
+         {
+            event_range* range;
+         public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = event;
+            using difference_type = std::ptrdiff_t;
+            using pointer = event*;
+            using reference = event&;
+
+            explicit iterator(event_range* r = nullptr) : range{r} {}
+            event& operator*() const { return range->current; }
+            event* operator->() const { return &range->current; }
+            iterator& operator++()
+            {
+               if(!range->next()) range = nullptr;
+               return *this;
+            }
+            bool operator==(const iterator& other) const { return range == other.range; }
+            bool operator!=(const iterator& other) const { return range != other.range; }
+         };
+         /**
+            decodes the first (next) frame of the buffer
+          */
+         iterator begin()
+         {
+            iterator it{this};
+            return ++it;
+         }
+         iterator end() { return iterator{}; }
+      };
+      /**
+         @param frames buffer containing MFM frames one after the other (e.g. read from a run file)
+         @param nbytes size of buffer in bytes
+         @return range of the events in the buffer
+
+         Pull-style alternative to read_event_in_buffer(), the frame revision of each frame is taken from its header:
+
+         ~~~~{.cpp}
+         for(auto& ev : reader.events(frames, nbytes))
+         {
+            \// ev is only valid until the next iteration
          }
+         ~~~~
+
+         Several ranges (from different readers) can be advanced in step with event_range::next(), e.g. to merge runs.
+         The buffer_reader must outlive the range, and only one range of the same reader should be used at a time.
+       */
+      event_range events(const uint8_t* frames, size_t nbytes)
+      {
+         return event_range(*this, frames, nbytes);
+      }
+      event_range events(const std::vector<uint8_t>& frames)
+      {
+         return event_range(*this, frames.data(), frames.size());
       }
    };
 }
@@ -4,6 +4,7 @@
 #include "mesytec-mvlc/mesytec-mvlc.h"
 #include "mesytec_data.h"
 #include "mesytec_experimental_setup.h"
+#include "mesytec_data_selection.h"
 
 namespace mesytec
 {
@@ -19,6 +20,118 @@ class mvlc_parser_buffer_reader
     mvlc::readout_parser::ReadoutParserCounters mvlcParserCounters;
     mvlc::readout_parser::ReadoutParserState mvlcParserState;
     size_t inputBufferNumber = 0;
+    data_selection selection;
+    bool use_selection = false;
+    bool resync = false;
+    resync_counters resync_count;
+    parse_error_counters error_count;
+    parse_error_callback error_callback;
+    parse_error last_error;
+
+    parse_status report_error(parse_status status, uint32_t word, uint8_t mod_id, size_t offset)
+    {
+        // count error, call error callback. returns the status.
+        last_error.status = status;
+        last_error.word = word;
+        last_error.module_id = mod_id;
+        last_error.offset = offset;
+        error_count.count(status);
+        if (error_callback) error_callback(last_error);
+        return status;
+    }
+
+    bool log_error() const
+    {
+        // with a flood of corrupted data, only log the 1st, 2nd, 4th, 8th... error of each type
+        auto n = error_count.get(last_error.status);
+        return (n & (n-1)) == 0;
+    }
+
+    void reset_parser_state()
+    {
+        // (resync mode) start again from a clean parser state: any partially assembled event is lost
+        if (mesy_event.has_data()) ++resync_count.events_quarantined;
+        mesy_event.clear();
+        mod_data.clear();
+        auto userContext = mvlcParserState.userContext;
+        mvlcParserState = mvlc::readout_parser::make_readout_parser(mvlcCrateConfig.stacks);
+        mvlcParserState.userContext = userContext;
+    }
+
+    bool is_stack_frame_start(u32 word) const
+    {
+        // StackFrame header of one of the event readout stacks (stack 0 is used for direct commands)
+        if (get_frame_type(word) != frame_headers::StackFrame) return false;
+        auto stack = extract_frame_info(word).stack;
+        return stack >= 1 && stack <= mvlcParserState.readoutStructure.size();
+    }
+
+    static bool is_top_level_frame(u32 word)
+    {
+        auto type = get_frame_type(word);
+        return type == frame_headers::StackFrame || type == frame_headers::StackContinuation
+              || type == frame_headers::SystemEvent || type == frame_headers::StackError;
+    }
+
+    void parse_words(const uint32_t *buf, size_t words)
+    {
+        // (resync mode) parse a run of words, with a clean restart if the readout parser throws
+        try
+        {
+            mesytec::mvlc::readout_parser::parse_readout_buffer(
+                mvlcCrateConfig.connectionType,
+                mvlcParserState,
+                mvlcParserCallbacks,
+                mvlcParserCounters,
+                ++inputBufferNumber,
+                buf, words);
+        }
+        catch (const std::exception &e)
+        {
+            spdlog::warn("read_buffer_collate_events: resync after parser error: {}", e.what());
+            ++resync_count.resyncs;
+            ++resync_count.frames_quarantined;
+            reset_parser_state();
+        }
+    }
+
+    uint32_t read_buffer_resync(const uint32_t *buf, size_t bufWords)
+    {
+        if (mvlcCrateConfig.connectionType != mvlc::ConnectionType::USB)
+        {
+            // ETH buffers are sequences of packets which the readout parser resynchronises itself (lost packets)
+            parse_words(buf, bufWords);
+            return total_number_events_parsed;
+        }
+        // USB buffers only contain whole frames: check the chain of frame headers, and give each run of valid
+        // frames to the readout parser. After an invalid header, look for the next StackFrame of a readout stack.
+        size_t pos = 0;
+        while (pos < bufWords)
+        {
+            size_t end = pos;
+            while (end < bufWords && is_top_level_frame(buf[end]))
+            {
+                size_t frameEnd = end + 1 + extract_frame_info(buf[end]).len;
+                if (frameEnd > bufWords) break;
+                end = frameEnd;
+            }
+            if (end > pos) parse_words(buf + pos, end - pos);
+            if (end == bufWords) break;
+
+            size_t next = end + 1;
+            while (next < bufWords && !is_stack_frame_start(buf[next])) ++next;
+            report_error(parse_status::bad_frame_header, buf[end], 0, 4*end);
+            if (log_error())
+                spdlog::warn("read_buffer_collate_events: invalid frame header {:#010x}, skipped {} words to next StackFrame"
+                             " ({} bad frame headers so far)",
+                             buf[end], next - end, error_count.get(parse_status::bad_frame_header));
+            ++resync_count.resyncs;
+            resync_count.bytes_skipped += 4*(next - end);
+            reset_parser_state();
+            pos = next;
+        }
+        return total_number_events_parsed;
+    }
 
 public:
     void reset()
@@ -37,11 +150,87 @@ public:
         mesytec_setup.read_crate_map(map_file);
     }
 
+    void read_detector_correspondence(const std::string &det_cor_file)
+    {
+        mesytec_setup.read_detector_correspondence(det_cor_file);
+    }
+
+    const experimental_setup &get_setup() const { return mesytec_setup; }
+
+    /**
+       Only keep the modules/channels/data types in the selection (see mesytec::data_selection).
+       Data of modules which are not selected is skipped without being looked at; for partially
+       selected modules, each data word is decoded and only the selected ones are kept (with their
+       decoded type, bus, channel and data).
+
+       An empty selection means all data is kept (without being decoded).
+     */
+    void set_data_selection(const data_selection &sel)
+    {
+        selection = sel;
+        use_selection = !selection.empty();
+    }
+
+    void clear_data_selection()
+    {
+        selection.clear();
+        use_selection = false;
+    }
+
+    const data_selection &get_data_selection() const { return selection; }
+
+    /**
+       Resync mode: carry on after corrupted data instead of throwing exceptions (which make the caller drop
+       the whole buffer).
+
+       + a module block which cannot be decoded (e.g. malformed scaler block) is skipped (quarantined),
+         and the rest of the event is kept;
+       + an event for which the callback function throws is dropped, and parsing continues;
+       + USB buffers: when a frame header is not valid, the following words are skipped up to the next
+         StackFrame header of a readout stack, and parsing continues in the same buffer;
+       + if the MVLC readout parser throws, it is restarted from a clean state with the next run of frames.
+
+       Everything skipped is counted, see get_resync_counters().
+     */
+    void set_resync(bool on = true) { resync = on; }
+    bool get_resync() const { return resync; }
+    const resync_counters &get_resync_counters() const { return resync_count; }
+    void clear_resync_counters() { resync_count.clear(); }
+
+    /**
+       Errors found in the data (unknown modules, malformed module data, invalid frame headers) are counted by
+       type (see get_error_counters()) and given to the error callback if one is set, without exceptions being
+       thrown; warnings are only logged for the 1st, 2nd, 4th, 8th... error of each type. Without resync mode,
+       malformed module data then makes read_buffer_collate_events() throw.
+     */
+    void set_error_callback(parse_error_callback cb) { error_callback = std::move(cb); }
+    const parse_error_counters &get_error_counters() const { return error_count; }
+    void clear_error_counters() { error_count.clear(); }
+    const parse_error &get_last_error() const { return last_error; }
+
     void read_mvlc_crateconfig(const std::string &conf_file)
     {
         mvlcCrateConfig = mesytec::mvlc::crate_config_from_yaml_file(conf_file);
     }
 
+    /**
+       Read MVLC crate configuration from a YAML string (e.g. the one stored in an MVLC listfile,
+       see mvlc_listfile_reader::get_crate_config())
+     */
+    void read_mvlc_crateconfig_from_yaml(const std::string &yaml)
+    {
+        mvlcCrateConfig = mesytec::mvlc::crate_config_from_yaml(yaml);
+    }
+
+    /**
+       Use an MVLC crate configuration built in memory instead of reading mvlc_crateconfig.yaml
+       (e.g. for benchmarks with synthetic data)
+     */
+    void set_mvlc_crateconfig(const mvlc::CrateConfig &config)
+    {
+        mvlcCrateConfig = config;
+    }
+
     void initialise_readout()
     {
         mvlcParserState = mvlc::readout_parser::make_readout_parser(mvlcCrateConfig.stacks);
@@ -119,113 +308,186 @@ public:
 
         CallbackFunction F = *reinterpret_cast<CallbackFunction *>(userContext);
 
+        for (unsigned moduleIndex = 0; moduleIndex < moduleCount; ++moduleIndex)
+        {
+            auto status = read_module_data(moduleDataList[moduleIndex], eventIndex, moduleIndex);
+            if (status == parse_status::ok) continue;
+
+            mod_data.clear();
+            if (resync)
+                ++resync_count.modules_quarantined;
+            else if (status != parse_status::unknown_module) // data of unknown modules is always skipped
+                throw std::runtime_error("event_data_callback: " + last_error.describe());
+        }
+
+        // wait until data from all readout stacks have been collated before calling callback function
+        if(eventIndex+1 == static_cast<int>(mvlcParserState.readoutStructure.size()))
+        {
+           if (resync)
+           {
+              try
+              {
+                 F(mesy_event, mesytec_setup); // invoke the output callback
+              }
+              catch (const std::exception &e)
+              {
+                 spdlog::warn("event_data_callback: event dropped: {}", e.what());
+                 ++resync_count.events_quarantined;
+              }
+           }
+           else
+              F(mesy_event, mesytec_setup); // invoke the output callback
+           mesy_event.clear();
+           ++total_number_events_parsed;
+        }
+    }
+
+    parse_status read_module_data(const mvlc::readout_parser::ModuleData &moduleData, int eventIndex, unsigned moduleIndex)
+    {
+        // decode data of one module and add it to the event being collated. errors are reported & returned.
         int tgvTimestampStartIndex = 2;
         int tgvTimestampStatusIndex = 1;
 
-        for (unsigned moduleIndex = 0; moduleIndex < moduleCount; ++moduleIndex)
+        if (moduleData.data.size>2) // not just a header+EoE, but also some data in between!
         {
-            const auto &moduleData = moduleDataList[moduleIndex];
-
-            if (moduleData.data.size>2) // not just a header+EoE, but also some data in between!
-            {
-                auto header = moduleData.data.data[0];
+            auto header = moduleData.data.data[0];
 
-                auto moduleId = module_id(header);
+            auto moduleId = module_id(header);
 
-                //std::cout << "got " << moduleData.data.size-1 << " data words for mod-id " << std::hex << std::showbase << (int)moduleId << std::dec << std::endl;
-                if (!mesytec_setup.has_module(moduleId))
+            //std::cout << "got " << moduleData.data.size-1 << " data words for mod-id " << std::hex << std::showbase << (int)moduleId << std::dec << std::endl;
+            // pointer to current module being read out
+            auto mod = mesytec_setup.find_module(moduleId);
+            if (!mod)
+            {
+                report_error(parse_status::unknown_module, header, moduleId, moduleIndex);
+                if (log_error())
                 {
                     const auto &moduleName = mvlcParserState.readoutStructure[eventIndex][moduleIndex].name;
                     spdlog::warn("event_data_callback: module '{}' (index={}) with id={:#04x} not present in experimental setup"
-                                 ", data_len={}, data={:#010x}",
+                                 ", data_len={}, data={:#010x} ({} unknown module blocks so far)",
                         moduleName, moduleIndex, moduleId,
                         moduleData.data.size,
-                        fmt::join(moduleData.data.data, moduleData.data.data+moduleData.data.size, ", "));
-                    continue;
+                        fmt::join(moduleData.data.data, moduleData.data.data+moduleData.data.size, ", "),
+                        error_count.get(parse_status::unknown_module));
                 }
+                return parse_status::unknown_module;
+            }
 
-                // pointer to current module being read out
-                auto mod = &mesytec_setup.get_module(moduleId);
+            // Special handling for TGV: data is not stored like other modules
+            if (mod->is_tgv_module())
+            {
+               spdlog::trace("event_data_callback:TGV: moduleData.data.size={}",moduleData.data.size);
+               if (moduleData.data.size < static_cast<u32>(tgvTimestampStartIndex+3))
+                  return bad_module_data(moduleData, moduleId, moduleIndex);
+
+               // check status of TGV data
+               if(!(moduleData.data.data[tgvTimestampStatusIndex] & data_flags::tgv_data_ready_mask))
+               {
+                  spdlog::warn("*** WARNING *** Got BAD TIMESTAMP from TGV (TGV NOT READY) *** WARNING *** status={:#10x}",moduleData.data.data[tgvTimestampStatusIndex]);
+               }
+               // get 3 centrum timestamp words from TGV data
+                mesy_event.tgv_ts_lo  = (moduleData.data.data[tgvTimestampStartIndex+0] & data_flags::tgv_data_mask_lo);
+                mesy_event.tgv_ts_mid = (moduleData.data.data[tgvTimestampStartIndex+1] & data_flags::tgv_data_mask_lo);
+                mesy_event.tgv_ts_hi  = (moduleData.data.data[tgvTimestampStartIndex+2] & data_flags::tgv_data_mask_lo);
+                spdlog::trace("event_data_callback:TGV: lo={} mid={} hi={}",mesy_event.tgv_ts_lo,mesy_event.tgv_ts_mid,mesy_event.tgv_ts_hi);
+
+                return parse_status::ok;
+            }
 
-                // Special handling for TGV: data is not stored like other modules
-                if (mod->is_tgv_module())
-                {
-                   spdlog::trace("event_data_callback:TGV: moduleData.data.size={}",moduleData.data.size);
-
-                   // check status of TGV data
-                   if(!(moduleData.data.data[tgvTimestampStatusIndex] & data_flags::tgv_data_ready_mask))
-                   {
-                      spdlog::warn("*** WARNING *** Got BAD TIMESTAMP from TGV (TGV NOT READY) *** WARNING *** status={:#10x}",moduleData.data.data[tgvTimestampStatusIndex]);
-                   }
-                   // get 3 centrum timestamp words from TGV data
-                    mesy_event.tgv_ts_lo  = (moduleData.data.data[tgvTimestampStartIndex+0] & data_flags::tgv_data_mask_lo);
-                    mesy_event.tgv_ts_mid = (moduleData.data.data[tgvTimestampStartIndex+1] & data_flags::tgv_data_mask_lo);
-                    mesy_event.tgv_ts_hi  = (moduleData.data.data[tgvTimestampStartIndex+2] & data_flags::tgv_data_mask_lo);
-                    spdlog::trace("event_data_callback:TGV: lo={} mid={} hi={}",mesy_event.tgv_ts_lo,mesy_event.tgv_ts_mid,mesy_event.tgv_ts_hi);
-
-                    continue;
-                }
+            if (use_selection && !selection.has_module(moduleId))
+            {
+                // skip the whole module block: only the event counter in the EOE is needed
+                auto eoe = moduleData.data.data[moduleData.data.size-1];
+                if (mod->is_mesytec_module() && is_end_of_event(eoe))
+                    mesy_event.event_counter = event_counter(eoe);
+                return parse_status::ok;
+            }
 
-                mod_data.set_header_word(header, mod->firmware); // also clears mod_data prior to setting the header word
+            mod_data.set_header_word(header, mod->firmware); // also clears mod_data prior to setting the header word
 
-                if (mod->is_mvlc_scaler()) // only ever true on the very first word of the scaler readout ("write_marker 0x40c60005")
-                {
-                    assert(moduleData.data.size == 12); // count of the write_marker and vme_read commands in the "Scalers" readout block
-                    const size_t ScalerWordCount = 4;
+            if (mod->is_mvlc_scaler()) // only ever true on the very first word of the scaler readout ("write_marker 0x40c60005")
+            {
+                // count of the write_marker and vme_read commands in the "Scalers" readout block
+                if (moduleData.data.size != 12)
+                    return bad_module_data(moduleData, moduleId, moduleIndex);
+                const size_t ScalerWordCount = 4;
 
-                    // scaler0
-                    size_t scalerWordOffset = 1;
-                    for (size_t i=0; i<ScalerWordCount; ++i)
-                        mod_data.add_data(moduleData.data.data[scalerWordOffset+i]);
+                // scaler0
+                size_t scalerWordOffset = 1;
+                for (size_t i=0; i<ScalerWordCount; ++i)
+                    mod_data.add_data(moduleData.data.data[scalerWordOffset+i]);
 
-                    mesy_event.add_module_data(mod_data);
+                mesy_event.add_module_data(mod_data);
 
-                    assert(is_end_of_event(moduleData.data.data[scalerWordOffset+ScalerWordCount])); // must end up on 0xc0000000
-                    assert(is_module_header(moduleData.data.data[scalerWordOffset+ScalerWordCount+1])); // ensure we are on 0x40c70005
-                    assert(scalerWordOffset+ScalerWordCount+1 == 6);
+                assert(is_end_of_event(moduleData.data.data[scalerWordOffset+ScalerWordCount])); // must end up on 0xc0000000
+                assert(is_module_header(moduleData.data.data[scalerWordOffset+ScalerWordCount+1])); // ensure we are on 0x40c70005
+                assert(scalerWordOffset+ScalerWordCount+1 == 6);
 
-                    // scaler1 - change the current module before processing the data
-                    header = moduleData.data.data[6];
-                    moduleId = module_id(header);
-                    mod = &mesytec_setup.get_module(moduleId);
-                    assert(mod->is_mvlc_scaler());
-                    mod_data.set_header_word(header, mod->firmware);
+                // scaler1 - change the current module before processing the data
+                header = moduleData.data.data[6];
+                moduleId = module_id(header);
+                mod = mesytec_setup.find_module(moduleId);
+                if (!mod || !mod->is_mvlc_scaler())
+                    return bad_module_data(moduleData, moduleId, moduleIndex);
+                mod_data.set_header_word(header, mod->firmware);
 
-                    scalerWordOffset = 7;
-                    for (size_t i=0; i<ScalerWordCount; ++i)
-                        mod_data.add_data(moduleData.data.data[scalerWordOffset+i]);
+                scalerWordOffset = 7;
+                for (size_t i=0; i<ScalerWordCount; ++i)
+                    mod_data.add_data(moduleData.data.data[scalerWordOffset+i]);
 
-                    mesy_event.add_module_data(mod_data);
+                if (!use_selection || selection.has_module(moduleId)) mesy_event.add_module_data(mod_data);
 
-                    assert(is_end_of_event(moduleData.data.data[scalerWordOffset+ScalerWordCount])); // must end up on 0xc0000000 again
+                assert(is_end_of_event(moduleData.data.data[scalerWordOffset+ScalerWordCount])); // must end up on 0xc0000000 again
 
-                    continue; // scalers handled to completion
-                }
+                return parse_status::ok; // scalers handled to completion
+            }
 
-                // The module is neither tgv nor mvlc scaler.
+            // The module is neither tgv nor mvlc scaler.
 
-                // process all the remaining non-header data words that are part of this modules readout
-                for (size_t di=1; di<moduleData.data.size; ++di)
-                {
-                   if(!is_end_of_event(moduleData.data.data[di])                                 // WARNING! 0xc..... end of event word is the last data word
-                         && !(mod->is_mesytec_module() && is_fill_word(moduleData.data.data[di])) // WARNING2! for Mesytec modules fill words (0) may be included here!
-                         )
-                   {
-                      mod_data.add_data(moduleData.data.data[di]);
-                   }
-                }
+            // only some channels/data types selected: decode words to decide which to keep
+            bool select_channels = use_selection && !selection.has_all_data(moduleId) && mod->is_mesytec_module();
 
-                mesy_event.add_module_data(mod_data);
+            // process all the remaining non-header data words that are part of this modules readout
+            for (size_t di=1; di<moduleData.data.size; ++di)
+            {
+               if(!is_end_of_event(moduleData.data.data[di])                                 // WARNING! 0xc..... end of event word is the last data word
+                     && !(mod->is_mesytec_module() && is_fill_word(moduleData.data.data[di])) // WARNING2! for Mesytec modules fill words (0) may be included here!
+                     )
+               {
+                  auto word = moduleData.data.data[di];
+                  if(select_channels)
+                  {
+                     auto type = mod->get_data_type(word);
+                     auto bus = mod->get_bus_number(word);
+                     auto channel = mod->get_channel_number(word);
+                     if(selection.accept(moduleId, bus, channel, type))
+                        mod_data.add_data(type, bus, channel, mod->get_channel_data(word), word);
+                  }
+                  else
+                     mod_data.add_data(word);
+               }
+               else if(mod->is_mesytec_module() && is_end_of_event(moduleData.data.data[di]))
+               {
+                  // event counter of Mesytec modules is used as event number of collated event
+                  mesy_event.event_counter = event_counter(moduleData.data.data[di]);
+               }
             }
-        }
 
-        // wait until data from all readout stacks have been collated before calling callback function
-        if(eventIndex+1 == static_cast<int>(mvlcParserState.readoutStructure.size()))
-        {
-           F(mesy_event, mesytec_setup); // invoke the output callback
-           mesy_event.clear();
-           ++total_number_events_parsed;
+            if(!select_channels || mod_data.has_data()) mesy_event.add_module_data(mod_data);
         }
+        return parse_status::ok;
+    }
+
+    parse_status bad_module_data(const mvlc::readout_parser::ModuleData &moduleData, uint8_t moduleId, unsigned moduleIndex)
+    {
+        report_error(parse_status::bad_module_data, moduleData.data.data[0], moduleId, moduleIndex);
+        if (log_error())
+            spdlog::warn("event_data_callback: bad data for module id={:#04x} (index={}), data_len={}, data={:#010x}"
+                         " ({} bad module data blocks so far)",
+                moduleId, moduleIndex, moduleData.data.size,
+                fmt::join(moduleData.data.data, moduleData.data.data+moduleData.data.size, ", "),
+                error_count.get(parse_status::bad_module_data));
+        return parse_status::bad_module_data;
     }
 
     void system_event_callback(void *userContext, int crateIndex, const u32 *header, u32 size)
@@ -251,6 +513,8 @@ public:
 
         mvlcParserState.userContext = reinterpret_cast<void *>(&F);
 
+        if (resync) return read_buffer_resync(buf, bufWords);
+
         mesytec::mvlc::readout_parser::parse_readout_buffer(
             mvlcCrateConfig.connectionType,
             mvlcParserState,
@@ -0,0 +1,194 @@
+#include "mesytec_calibration.h"
+#include "mesytec_histogrammer.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace mesytec
+{
+   calibration::calibration()
+      : table(1)
+   {}
+
+   void calibration::set_coefficients(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type, const coefficients &c)
+   {
+      auto& s = slots[mod_id];
+      auto index = slot_index(bus, channel, type);
+      if(index >= s.size()) s.resize(slot_index(bus+1, 0, module::unknown), 0);
+      if(s[index]) table[s[index]] = c;
+      else
+      {
+         s[index] = table.size();
+         table.push_back(c);
+      }
+   }
+
+   void calibration::set_polynomial(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type, const std::vector<float> &coefficients)
+   {
+      /// \param[in] mod_id address of module
+      /// \param[in] bus bus number (VMMR modules; 0 for MDPP modules)
+      /// \param[in] channel channel number
+      /// \param[in] type data type
+      /// \param[in] coefficients c0, c1, ... of polynomial c0 + c1*x + c2*x^2 + ... (i.e. offset, gain, ...)
+
+      if(coefficients.empty() || coefficients.size() > max_degree+1)
+         throw std::invalid_argument("calibration: polynomial must have between 1 and " + std::to_string(max_degree+1)
+                                     + " coefficients");
+      if(channel > 127) throw std::invalid_argument("calibration: channel number must be < 128");
+      calibration::coefficients c;
+      c.c.fill(0);
+      std::copy(coefficients.begin(), coefficients.end(), c.c.begin());
+      set_coefficients(mod_id, bus, channel, type, c);
+   }
+
+   void calibration::set_lookup_table(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type, std::vector<float> values)
+   {
+      /// \param[in] mod_id address of module
+      /// \param[in] bus bus number (VMMR modules; 0 for MDPP modules)
+      /// \param[in] channel channel number
+      /// \param[in] type data type
+      /// \param[in] values calibrated value for each raw value 0, 1, 2, ... (raw values beyond the end of the table
+      ///            are given the last value)
+
+      if(values.empty()) throw std::invalid_argument("calibration: empty lookup table");
+      if(channel > 127) throw std::invalid_argument("calibration: channel number must be < 128");
+      coefficients c;
+      c.lookup_table = lookup_tables.size();
+      lookup_tables.push_back(std::move(values));
+      set_coefficients(mod_id, bus, channel, type, c);
+   }
+
+   void calibration::read_calibration_file(const std::string &calibration_file, const experimental_setup &setup)
+   {
+      /// \param[in] calibration_file full path to file with calibrations
+      /// \param[in] setup description of crate (to know which modules have buses)
+      ///
+      /// The file contains a line for each calibrated (module, [bus,] channel, data type), with the same layout
+      /// as the detector correspondence file (see experimental_setup::read_detector_correspondence()), followed
+      /// by either the coefficients of the polynomial (offset, gain[, c2[, c3]]) or `lut` and the name of a file
+      /// with the calibrated value for each raw value (one per line, path relative to the calibration file):
+      ///
+      ///~~~
+      /// # mod-id, [bus,] channel, data type, calibration
+      /// 0x0,0,adc,-12.5,0.0625
+      /// 0x10,2,qdc_long,0,1.2,1.5e-6
+      /// 0x20,1,63,adc,lut,pista_de_63.lut
+      ///~~~
+      ///
+      /// Empty lines and lines beginning with '#' are ignored. Throws std::runtime_error if the file cannot
+      /// be read or a line cannot be decoded.
+
+      std::ifstream file(calibration_file);
+      if(!file.good())
+         throw std::runtime_error("calibration: failed to open file " + calibration_file);
+      auto directory = calibration_file.substr(0, calibration_file.find_last_of('/') + 1);
+
+      std::string line;
+      int line_number = 0;
+      while(std::getline(file, line))
+      {
+         ++line_number;
+         std::vector<std::string> fields;
+         std::istringstream ss(line);
+         std::string f;
+         while(std::getline(ss, f, ','))
+         {
+            auto first = f.find_first_not_of(" \t\r");
+            auto last = f.find_last_not_of(" \t\r");
+            fields.push_back(first == std::string::npos ? "" : f.substr(first, last-first+1));
+         }
+         if(fields.empty() || fields[0].empty() || fields[0][0] == '#') continue;
+
+         auto error = [&](const std::string& what) {
+            return std::runtime_error("calibration: problem decoding line " + std::to_string(line_number)
+                                      + " of " + calibration_file + " : " + what + " [" + line + "]");
+         };
+         try {
+            size_t i = 0;
+            auto mod_id = std::stoi(fields.at(i++), nullptr, 0);
+            if(mod_id < 0 || mod_id > 255 || !setup.has_module(mod_id)) throw error("unknown module");
+            int bus = setup.get_module(mod_id).is_vmmr_module() ? std::stoi(fields.at(i++), nullptr, 0) : 0;
+            auto channel = std::stoi(fields.at(i++), nullptr, 0);
+            auto type = histogrammer::data_type_from_name(fields.at(i++));
+            if(type == module::unknown) throw error("unknown data type");
+            if(bus < 0 || bus > 255 || channel < 0 || channel > 127) throw error("invalid bus or channel number");
+            if(fields.at(i) == "lut")
+            {
+               auto lut_file = fields.at(i+1);
+               if(lut_file.empty()) throw error("missing lookup table file");
+               if(lut_file[0] != '/') lut_file = directory + lut_file;
+               std::ifstream lut(lut_file);
+               if(!lut.good()) throw error("failed to open lookup table " + lut_file);
+               std::vector<float> values;
+               float v;
+               while(lut >> v) values.push_back(v);
+               set_lookup_table(mod_id, bus, channel, type, std::move(values));
+            }
+            else
+            {
+               std::vector<float> coeffs;
+               for(; i < fields.size(); ++i) coeffs.push_back(std::stof(fields[i]));
+               set_polynomial(mod_id, bus, channel, type, coeffs);
+            }
+         }
+         catch(std::runtime_error&) { throw; }
+         catch(std::exception& e) {
+            throw error(e.what());
+         }
+      }
+   }
+
+   void calibration::apply(const event &ev, columns &cols)
+   {
+      /// \param[in] ev event to calibrate
+      /// \param[out] cols filled with one entry for each data item of the event
+
+      size_t n = 0;
+      for(auto& mod : ev.get_module_data()) n += mod.get_channel_data().size();
+      cols.resize(n);
+      for(auto& g : gathered) g.resize(n);
+
+      // gather raw values and coefficients
+      size_t i = 0;
+      for(auto& mod : ev.get_module_data())
+      {
+         auto id = mod.get_module_id();
+         for(auto& d : mod.get_channel_data())
+         {
+            auto bus = d.get_bus_number();
+            auto channel = d.get_channel_number();
+            auto type = d.get_data_type();
+            auto raw = d.get_data();
+            cols.module_id[i] = id;
+            cols.bus[i] = bus;
+            cols.channel[i] = channel;
+            cols.type[i] = type;
+            cols.raw[i] = raw;
+            auto& c = table[slot(id, bus, channel, type)];
+            if(c.lookup_table < 0)
+            {
+               for(int k = 0; k <= max_degree; ++k) gathered[k][i] = c.c[k];
+            }
+            else
+            {
+               // lookup tables are applied as a constant term
+               auto& lut = lookup_tables[c.lookup_table];
+               gathered[0][i] = lut[std::min<size_t>(raw, lut.size()-1)];
+               for(int k = 1; k <= max_degree; ++k) gathered[k][i] = 0;
+            }
+            ++i;
+         }
+      }
+
+      // evaluate all polynomials (Horner's method) in one vectorisable loop
+      const float* x = cols.raw.data();
+      const float* c0 = gathered[0].data();
+      const float* c1 = gathered[1].data();
+      const float* c2 = gathered[2].data();
+      const float* c3 = gathered[3].data();
+      float* y = cols.value.data();
+      for(size_t j = 0; j < n; ++j)
+         y[j] = c0[j] + x[j]*(c1[j] + x[j]*(c2[j] + x[j]*c3[j]));
+   }
+}
@@ -0,0 +1,118 @@
+#ifndef MESYTEC_CALIBRATION_H
+#define MESYTEC_CALIBRATION_H
+
+#include "mesytec_data.h"
+#include "mesytec_experimental_setup.h"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class calibration
+      @brief per-channel calibration of decoded data, applied in bulk to all the data of an event
+
+      A calibration is defined for each (module, bus, channel, data type) either as a polynomial of degree
+      up to calibration::max_degree (offset, gain, ...) or as a lookup table giving the calibrated value
+      for each raw value. Calibrations are usually read from a file next to `crate_map.dat`
+      (see read_calibration_file()).
+
+      apply() fills a set of columns (one entry per data item of the event) with the module, bus, channel,
+      data type, raw and calibrated values. The coefficients of all data items are first gathered into
+      contiguous arrays (using a dense table indexed by bus/channel/type for each module, i.e. no map lookups),
+      then all calibrated values are computed in a single loop over the arrays which the compiler vectorises.
+      Data for which no calibration is defined are given their raw value.
+
+      ~~~~{.cpp}
+      mesytec::calibration calib;
+      calib.read_calibration_file("calibration.dat", setup);
+      mesytec::calibration::columns cols;
+
+      \// in callback for each event
+      calib.apply(event, cols);
+      for(size_t i=0; i<cols.size(); ++i) if(cols.type[i]==mesytec::module::ADC) fill(cols.value[i]);
+      ~~~~
+    */
+   class calibration
+   {
+   public:
+      static const int max_degree = 3;
+
+      /**
+         @brief calibrated data of one event, stored as columns with one entry per data item
+       */
+      struct columns
+      {
+         std::vector<uint8_t> module_id;
+         std::vector<uint8_t> bus;
+         std::vector<uint8_t> channel;
+         std::vector<module::datatype_t> type;
+         std::vector<float> raw;
+         std::vector<float> value;
+
+         size_t size() const { return value.size(); }
+         void resize(size_t n)
+         {
+            module_id.resize(n);
+            bus.resize(n);
+            channel.resize(n);
+            type.resize(n);
+            raw.resize(n);
+            value.resize(n);
+         }
+      };
+
+   private:
+      static const int number_of_types = 8;
+      struct coefficients
+      {
+         std::array<float, max_degree+1> c{{0,1,0,0}};
+         int lookup_table{-1}; // index in lookup_tables, or -1 for polynomial
+      };
+      // table[0] is the identity, used for uncalibrated data
+      std::vector<coefficients> table;
+      // for each module: index in table for each (bus*128+channel)*number_of_types+type
+      std::array<std::vector<uint32_t>, 256> slots;
+      std::vector<std::vector<float>> lookup_tables;
+      // gathered coefficients of current event
+      std::array<std::vector<float>, max_degree+1> gathered;
+
+      static size_t slot_index(uint8_t bus, uint8_t channel, module::datatype_t type)
+      {
+         return (bus*128 + channel)*number_of_types + type;
+      }
+      uint32_t slot(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type) const
+      {
+         auto& s = slots[mod_id];
+         auto index = slot_index(bus, channel, type);
+         return index < s.size() ? s[index] : 0;
+      }
+      void set_coefficients(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type, const coefficients& c);
+
+   public:
+      calibration();
+
+      void read_calibration_file(const std::string& calibration_file, const experimental_setup& setup);
+      void set_polynomial(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type,
+                          const std::vector<float>& coefficients);
+      void set_lookup_table(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type,
+                            std::vector<float> values);
+      /**
+         @return true if a calibration is defined for the given data
+       */
+      bool is_calibrated(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type) const
+      {
+         return slot(mod_id, bus, channel, type) != 0;
+      }
+      /**
+         @return number of (module, bus, channel, data type) with a calibration
+       */
+      size_t get_number_of_calibrations() const { return table.size() - 1; }
+
+      void apply(const event& ev, columns& cols);
+   };
+}
+
+#endif // MESYTEC_CALIBRATION_H
@@ -0,0 +1,280 @@
+#include "mesytec_columnar.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mesytec
+{
+   const char columnar_magic[8] = {'M','E','S','Y','C','O','L','1'};
+
+   columnar_writer::columnar_writer(const std::string &_file, const experimental_setup &_setup, uint32_t _chunk_events)
+      : setup{&_setup}, file_name{_file}, chunk_events{_chunk_events}
+   {
+      /// \param[in] _file name of file to write
+      /// \param[in] _setup description of crate (names of modules & detectors)
+      /// \param[in] _chunk_events number of events in each chunk
+
+      if(!chunk_events) throw std::invalid_argument("columnar_writer: chunk_events must be > 0");
+      file.open(file_name, std::ios_base::out | std::ios_base::binary);
+      if(!file.is_open()) throw std::runtime_error("columnar_writer: cannot open " + file_name);
+
+      // header is written again with final values by close()
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, columnar_magic, 8);
+      header.version = columnar_version;
+      header.header_size = sizeof(header);
+      write_bytes(&header, sizeof(header));
+
+      timestamps.reserve(chunk_events);
+      event_counters.reserve(chunk_events);
+      hit_offsets.reserve(chunk_events + 1);
+   }
+
+   columnar_writer::~columnar_writer()
+   {
+      try
+      {
+         close();
+      }
+      catch (std::exception& e)
+      {
+         std::cerr << e.what() << std::endl;
+      }
+   }
+
+   void columnar_writer::add_event(const event &ev, uint32_t event_counter, uint64_t timestamp)
+   {
+      /// \param[in] ev event with decoded data (e.g. from buffer_reader)
+      /// \param[in] event_counter event number (e.g. from MFM frame header)
+      /// \param[in] timestamp TGV timestamp (e.g. from MFM frame header)
+
+      if(event_counters.size() == chunk_events) write_chunk();
+      timestamps.push_back(timestamp);
+      event_counters.push_back(event_counter);
+      hit_offsets.push_back(detectors.size());
+      for(auto& mod_data : ev.get_module_data())
+      {
+         auto id = mod_data.get_module_id();
+         if(setup->get_module(id).firmware == MVLC_SCALER) continue;
+         for(auto& d : mod_data.get_channel_data())
+         {
+            detectors.push_back(get_detector_id(id, d.get_bus_number(), d.get_channel_number()));
+            types.push_back(d.get_data_type());
+            values.push_back(d.get_data());
+         }
+      }
+   }
+
+   uint16_t columnar_writer::get_detector_id(uint8_t mod_id, uint8_t bus, uint8_t channel)
+   {
+      auto& ids = detector_ids[mod_id];
+      size_t index = bus*128 + channel;
+      if(index >= ids.size()) ids.resize(index + 1);
+      if(!ids[index])
+      {
+         if(detector_table.size() == 0xffff) throw std::runtime_error("columnar_writer: too many detectors");
+         columnar_detector det{mod_id, bus, channel, 0, (uint32_t)string_table.size()};
+         auto& mod = setup->get_module(mod_id);
+         if(setup->has_detector(mod_id, bus, channel))
+            string_table += setup->get_detector(mod_id, bus, channel);
+         else
+            string_table += mod.name + "_bus_" + std::to_string(bus) + "_chan_" + std::to_string(channel);
+         string_table.push_back('\0');
+         detector_table.push_back(det);
+         ids[index] = detector_table.size();
+      }
+      return ids[index] - 1;
+   }
+
+   void columnar_writer::write_bytes(const void *data, size_t nbytes)
+   {
+      file.write((const char*)data, nbytes);
+      if(!file.good()) throw std::runtime_error("columnar_writer: error writing " + file_name);
+      file_offset += nbytes;
+   }
+
+   template<typename T>
+   void columnar_writer::write_column(const std::vector<T> &column, uint64_t chunk_start, uint64_t &offset)
+   {
+      // write column padded to a multiple of 8 bytes; offset = its offset relative to chunk_start
+      static const char padding[8]{};
+      offset = file_offset - chunk_start;
+      write_bytes(column.data(), column.size()*sizeof(T));
+      if(file_offset % 8) write_bytes(padding, 8 - file_offset % 8);
+   }
+
+   void columnar_writer::write_chunk()
+   {
+      if(event_counters.empty()) return;
+
+      columnar_chunk_header c;
+      c.offset = file_offset;
+      c.number_of_events = event_counters.size();
+      c.number_of_hits = detectors.size();
+      hit_offsets.push_back(detectors.size());
+      auto ts = std::minmax_element(timestamps.begin(), timestamps.end());
+      c.timestamp_min = *ts.first;
+      c.timestamp_max = *ts.second;
+      auto ec = std::minmax_element(event_counters.begin(), event_counters.end());
+      c.event_counter_min = *ec.first;
+      c.event_counter_max = *ec.second;
+      c.detector_min = c.value_min = 0xffff;
+      c.detector_max = c.value_max = 0;
+      for(size_t i = 0; i < detectors.size(); ++i)
+      {
+         c.detector_min = std::min(c.detector_min, detectors[i]);
+         c.detector_max = std::max(c.detector_max, detectors[i]);
+         c.value_min = std::min(c.value_min, values[i]);
+         c.value_max = std::max(c.value_max, values[i]);
+      }
+
+      write_column(timestamps, c.offset, c.column_offset[columnar_chunk_header::timestamp]);
+      write_column(event_counters, c.offset, c.column_offset[columnar_chunk_header::event_counter]);
+      write_column(hit_offsets, c.offset, c.column_offset[columnar_chunk_header::hit_offset]);
+      write_column(detectors, c.offset, c.column_offset[columnar_chunk_header::detector]);
+      write_column(types, c.offset, c.column_offset[columnar_chunk_header::type]);
+      write_column(values, c.offset, c.column_offset[columnar_chunk_header::value]);
+      chunks.push_back(c);
+
+      header.number_of_events += c.number_of_events;
+      header.number_of_hits += c.number_of_hits;
+      timestamps.clear();
+      event_counters.clear();
+      hit_offsets.clear();
+      detectors.clear();
+      types.clear();
+      values.clear();
+   }
+
+   void columnar_writer::close()
+   {
+      /// Write last chunk, chunk index & detector table, and close file. Called by destructor if not called before.
+
+      if(!file.is_open()) return;
+      write_chunk();
+      header.chunk_index_offset = file_offset;
+      header.number_of_chunks = chunks.size();
+      write_bytes(chunks.data(), chunks.size()*sizeof(columnar_chunk_header));
+      header.detector_table_offset = file_offset;
+      header.number_of_detectors = detector_table.size();
+      write_bytes(detector_table.data(), detector_table.size()*sizeof(columnar_detector));
+      header.string_table_offset = file_offset;
+      write_bytes(string_table.data(), string_table.size());
+      file.seekp(0);
+      write_bytes(&header, sizeof(header));
+      file.close();
+   }
+
+   columnar_reader::columnar_reader(const std::string &file)
+   {
+      /// \param[in] file name of file written by columnar_writer
+      ///
+      /// Throws std::runtime_error if the file cannot be opened & mapped, or is not a (complete) columnar file.
+
+      int fd = open(file.c_str(), O_RDONLY);
+      if(fd < 0) throw std::runtime_error("columnar_reader: cannot open " + file + " : " + strerror(errno));
+      struct stat st;
+      if(fstat(fd, &st) || (size_t)st.st_size < sizeof(columnar_file_header))
+      {
+         ::close(fd);
+         throw std::runtime_error("columnar_reader: " + file + " is not a columnar file");
+      }
+      size = st.st_size;
+      void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if(p == MAP_FAILED) throw std::runtime_error("columnar_reader: cannot map " + file + " : " + strerror(errno));
+      data = (const uint8_t*)p;
+
+      header = (const columnar_file_header*)data;
+      auto fits = [&](uint64_t offset, uint64_t nbytes){ return offset <= size && nbytes <= size - offset; };
+      bool ok = !memcmp(header->magic, columnar_magic, 8) && header->version <= columnar_version
+            && fits(header->chunk_index_offset, (uint64_t)header->number_of_chunks*sizeof(columnar_chunk_header))
+            && fits(header->detector_table_offset, (uint64_t)header->number_of_detectors*sizeof(columnar_detector))
+            && header->string_table_offset <= size;
+      if(ok)
+      {
+         chunks = (const columnar_chunk_header*)(data + header->chunk_index_offset);
+         detectors = (const columnar_detector*)(data + header->detector_table_offset);
+         strings = (const char*)(data + header->string_table_offset);
+         for(uint32_t i = 0; ok && i < header->number_of_chunks; ++i)
+         {
+            auto& c = chunks[i];
+            uint64_t n_event = c.number_of_events, n_hit = c.number_of_hits;
+            uint64_t sizes[] = { 8*n_event, 4*n_event, 4*(n_event+1), 2*n_hit, n_hit, 2*n_hit };
+            for(uint32_t k = 0; ok && k < columnar_chunk_header::number_of_columns; ++k)
+               ok = fits(c.offset, c.column_offset[k]) && fits(c.offset + c.column_offset[k], sizes[k]);
+         }
+         for(uint32_t i = 0; ok && i < header->number_of_detectors; ++i)
+            ok = detectors[i].name_offset < size - header->string_table_offset;
+      }
+      if(!ok)
+      {
+         munmap(p, size);
+         throw std::runtime_error("columnar_reader: " + file + " is not a complete columnar file");
+      }
+   }
+
+   columnar_reader::~columnar_reader()
+   {
+      munmap((void*)data, size);
+   }
+
+   columnar_reader::chunk columnar_reader::get_chunk(size_t index) const
+   {
+      /// \param[in] index index of chunk (0 to get_number_of_chunks()-1)
+      /// \returns pointers to the columns of the chunk, valid as long as the reader exists
+
+      if(index >= header->number_of_chunks) throw std::out_of_range("columnar_reader: no chunk " + std::to_string(index));
+      auto& h = chunks[index];
+      auto column = [&](columnar_chunk_header::column c){ return data + h.offset + h.column_offset[c]; };
+      chunk c;
+      c.header = &h;
+      c.timestamp = (const uint64_t*)column(columnar_chunk_header::timestamp);
+      c.event_counter = (const uint32_t*)column(columnar_chunk_header::event_counter);
+      c.hit_offset = (const uint32_t*)column(columnar_chunk_header::hit_offset);
+      c.detector = (const uint16_t*)column(columnar_chunk_header::detector);
+      c.type = column(columnar_chunk_header::type);
+      c.value = (const uint16_t*)column(columnar_chunk_header::value);
+      return c;
+   }
+
+   const columnar_detector &columnar_reader::get_detector(uint16_t id) const
+   {
+      /// \param[in] id detector ID
+      /// \returns module, bus & channel of detector
+
+      if(id >= header->number_of_detectors) throw std::out_of_range("columnar_reader: no detector " + std::to_string(id));
+      return detectors[id];
+   }
+
+   int columnar_reader::find_detector(const std::string &name) const
+   {
+      /// \param[in] name name of detector
+      /// \returns ID of detector, or -1 if it has no data in the file
+
+      for(uint32_t i = 0; i < header->number_of_detectors; ++i)
+         if(name == strings + detectors[i].name_offset) return i;
+      return -1;
+   }
+
+   int columnar_reader::find_detector(uint8_t mod_id, uint8_t bus, uint8_t channel) const
+   {
+      /// \param[in] mod_id address of module
+      /// \param[in] bus bus number (0 for MDPP modules)
+      /// \param[in] channel channel number (subaddress for VMMR)
+      /// \returns ID of detector, or -1 if it has no data in the file
+
+      for(uint32_t i = 0; i < header->number_of_detectors; ++i)
+      {
+         auto& d = detectors[i];
+         if(d.module_id == mod_id && d.bus == bus && d.channel == channel) return i;
+      }
+      return -1;
+   }
+}
@@ -0,0 +1,202 @@
+#ifndef MESYTEC_COLUMNAR_H
+#define MESYTEC_COLUMNAR_H
+
+#include "mesytec_data.h"
+#include "mesytec_experimental_setup.h"
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @struct columnar_file_header
+      @brief header at the beginning of a columnar file (see columnar_writer)
+    */
+   struct columnar_file_header
+   {
+      char magic[8];                   ///< "MESYCOL1"
+      uint32_t version;
+      uint32_t header_size;            ///< sizeof(columnar_file_header)
+      uint64_t number_of_events;
+      uint64_t number_of_hits;
+      uint64_t chunk_index_offset;     ///< offset of array of columnar_chunk_header
+      uint64_t detector_table_offset;  ///< offset of array of columnar_detector
+      uint64_t string_table_offset;    ///< offset of detector names (null-terminated)
+      uint32_t number_of_chunks;
+      uint32_t number_of_detectors;
+   };
+
+   /**
+      @struct columnar_chunk_header
+      @brief description & statistics of a chunk of events in a columnar file
+
+      Columns are arrays stored one after the other at the given offsets (relative to the start of the chunk, and
+      aligned on 8 bytes). Event columns have number_of_events entries, hit columns number_of_hits entries, and
+      hit_offset has number_of_events+1 entries: the hits of event i are [hit_offset[i], hit_offset[i+1]).
+    */
+   struct columnar_chunk_header
+   {
+      enum column : uint32_t { timestamp, event_counter, hit_offset, detector, type, value, number_of_columns };
+
+      uint64_t offset;                 ///< offset of chunk in file
+      uint32_t number_of_events;
+      uint32_t number_of_hits;
+      uint64_t timestamp_min, timestamp_max;
+      uint32_t event_counter_min, event_counter_max;
+      uint16_t detector_min, detector_max;
+      uint16_t value_min, value_max;
+      uint64_t column_offset[number_of_columns];
+   };
+
+   /**
+      @struct columnar_detector
+      @brief module, bus & channel corresponding to a detector ID of a columnar file
+    */
+   struct columnar_detector
+   {
+      uint8_t module_id;
+      uint8_t bus;
+      uint8_t channel;
+      uint8_t reserved;
+      uint32_t name_offset;            ///< offset of name in string table
+   };
+
+   extern const char columnar_magic[8];
+   const uint32_t columnar_version = 1;
+
+   /**
+      @class columnar_writer
+      @brief write events in a chunked columnar file for fast offline analysis
+
+      Events are accumulated in memory and written in chunks of (by default) 65536 events. For each chunk the
+      columns are:
+
+      | column        | type     | per   | contents |
+      |---------------|----------|-------|----------|
+      | timestamp     | uint64_t | event | 48-bit TGV timestamp |
+      | event_counter | uint32_t | event | event number |
+      | hit_offset    | uint32_t | event | index of first hit of event in chunk (+1 entry) |
+      | detector      | uint16_t | hit   | detector ID (index in detector table of file) |
+      | type          | uint8_t  | hit   | mesytec::module::datatype_t |
+      | value         | uint16_t | hit   | 16-bit data |
+
+      with min/max statistics of timestamp, event counter, detector ID & value in the chunk's header (see
+      columnar_chunk_header). Detector IDs are given to each (module, bus, channel) in the order in which they
+      first appear; the detector table at the end of the file gives their module, bus, channel and name (name of
+      detector from detector correspondence, or `[module]_bus_[bus]_chan_[channel]`).
+
+      Events must contain decoded data, as given by buffer_reader. Data of MVLC_SCALER modules is not written.
+
+      ~~~~{.cpp}
+      mesytec::columnar_writer writer("run_12.col", setup);
+      \// for each event read from MFM frame:
+      writer.add_event(event, event_number, tgv_timestamp);
+      ~~~~
+    */
+   class columnar_writer
+   {
+      const experimental_setup* setup;
+      std::ofstream file;
+      std::string file_name;
+      uint32_t chunk_events;
+      uint64_t file_offset{0};
+      columnar_file_header header;
+
+      // columns of current chunk
+      std::vector<uint64_t> timestamps;
+      std::vector<uint32_t> event_counters;
+      std::vector<uint32_t> hit_offsets;
+      std::vector<uint16_t> detectors;
+      std::vector<uint8_t> types;
+      std::vector<uint16_t> values;
+
+      std::vector<columnar_chunk_header> chunks;
+      std::vector<columnar_detector> detector_table;
+      std::string string_table;
+      // detector ID+1 (0 = none yet) for each module, indexed by bus*128+channel
+      std::array<std::vector<uint16_t>, 256> detector_ids;
+
+      uint16_t get_detector_id(uint8_t mod_id, uint8_t bus, uint8_t channel);
+      void write_chunk();
+      template<typename T> void write_column(const std::vector<T>& column, uint64_t chunk_start, uint64_t& offset);
+      void write_bytes(const void* data, size_t nbytes);
+
+   public:
+      columnar_writer(const std::string& file, const experimental_setup& setup, uint32_t chunk_events = 65536);
+      ~columnar_writer();
+      columnar_writer(const columnar_writer&)=delete;
+      columnar_writer& operator=(const columnar_writer&)=delete;
+
+      void add_event(const event& ev, uint32_t event_counter, uint64_t timestamp);
+      void close();
+
+      uint64_t get_number_of_events() const { return header.number_of_events + event_counters.size(); }
+   };
+
+   /**
+      @class columnar_reader
+      @brief memory-mapped access to a columnar file written by columnar_writer
+
+      The file is mapped in memory and columns are used in place, without any copying or decoding: only the pages
+      of the columns which are actually read are loaded from disk. Chunk statistics can be used to skip chunks
+      without touching their data.
+
+      ~~~~{.cpp}
+      mesytec::columnar_reader run("run_12.col");
+      auto det = run.find_detector("SI_01");
+      for(size_t i = 0; i < run.get_number_of_chunks(); ++i)
+      {
+         auto c = run.get_chunk(i);
+         if(det < c.header->detector_min || det > c.header->detector_max) continue;
+         for(uint32_t h = 0; h < c.header->number_of_hits; ++h)
+            if(c.detector[h] == det) histo.fill(c.value[h]);
+      }
+      ~~~~
+    */
+   class columnar_reader
+   {
+      const uint8_t* data{nullptr};
+      size_t size{0};
+      const columnar_file_header* header;
+      const columnar_chunk_header* chunks;
+      const columnar_detector* detectors;
+      const char* strings;
+
+   public:
+      /**
+         @struct chunk
+         @brief columns of a chunk of events (see columnar_chunk_header)
+       */
+      struct chunk
+      {
+         const columnar_chunk_header* header;
+         const uint64_t* timestamp;
+         const uint32_t* event_counter;
+         const uint32_t* hit_offset;
+         const uint16_t* detector;
+         const uint8_t* type;
+         const uint16_t* value;
+      };
+
+      columnar_reader(const std::string& file);
+      ~columnar_reader();
+      columnar_reader(const columnar_reader&)=delete;
+      columnar_reader& operator=(const columnar_reader&)=delete;
+
+      uint64_t get_number_of_events() const { return header->number_of_events; }
+      uint64_t get_number_of_hits() const { return header->number_of_hits; }
+      size_t get_number_of_chunks() const { return header->number_of_chunks; }
+      chunk get_chunk(size_t index) const;
+
+      size_t get_number_of_detectors() const { return header->number_of_detectors; }
+      const columnar_detector& get_detector(uint16_t id) const;
+      std::string get_detector_name(uint16_t id) const { return strings + get_detector(id).name_offset; }
+      int find_detector(const std::string& name) const;
+      int find_detector(uint8_t mod_id, uint8_t bus, uint8_t channel) const;
+   };
+}
+
+#endif // MESYTEC_COLUMNAR_H
@@ -0,0 +1,427 @@
+#include "mesytec_compressed_run.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <lz4.h>
+
+namespace mesytec
+{
+   const char compressed_run_magic[8] = {'M','E','S','Y','M','F','M','Z'};
+
+   bool is_compressed_run_file(const std::string &file)
+   {
+      /// \param[in] file name of (first) file of a run
+      /// \returns true if file begins like a file written by compressed_run_writer
+
+      std::ifstream f(file, std::ios_base::in | std::ios_base::binary);
+      char magic[8];
+      f.read(magic, 8);
+      return f.gcount() == 8 && !memcmp(magic, compressed_run_magic, 8);
+   }
+
+   compressed_run_writer::compressed_run_writer(const std::string &_first_file, uint64_t _max_file_size,
+                                                uint32_t _block_size, int threads)
+      : first_file{_first_file}, max_file_size{_max_file_size}, block_size{_block_size}
+   {
+      /// \param[in] _first_file name of first file of run
+      /// \param[in] _max_file_size maximum size of each file in bytes
+      /// \param[in] _block_size maximum size of uncompressed blocks in bytes (a larger frame gets a block of its own)
+      /// \param[in] threads number of compression threads
+
+      if(block_size > (uint32_t)LZ4_MAX_INPUT_SIZE) throw std::invalid_argument("compressed_run_writer: block_size too large");
+      if(threads < 1) throw std::invalid_argument("compressed_run_writer: threads must be > 0");
+      open_file();
+      for(int i = 0; i < threads; ++i) workers.emplace_back(&compressed_run_writer::run_worker, this);
+   }
+
+   compressed_run_writer::~compressed_run_writer()
+   {
+      try
+      {
+         flush();
+      }
+      catch (std::exception& e)
+      {
+         std::cerr << e.what() << std::endl;
+      }
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stop = true;
+      }
+      work_available.notify_all();
+      for(auto& w : workers) w.join();
+   }
+
+   void compressed_run_writer::open_file()
+   {
+      auto name = run_file_name(first_file, file_index);
+      file.close();
+      file.clear();
+      file.open(name, std::ios_base::out | std::ios_base::binary);
+      if(!file.is_open()) throw std::runtime_error("compressed_run_writer: cannot open " + name);
+
+      compressed_run_file_header header;
+      memcpy(header.magic, compressed_run_magic, 8);
+      header.version = compressed_run_version;
+      header.header_size = sizeof(header);
+      header.codec = compressed_run_codec_lz4;
+      header.block_size = block_size;
+      header.start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+      file.write((const char*)&header, sizeof(header));
+      file_used = sizeof(header);
+   }
+
+   void compressed_run_writer::write(const uint8_t *frame, size_t size)
+   {
+      /// \param[in] frame MFM frame
+      /// \param[in] size size of frame in bytes
+      ///
+      /// Throws std::runtime_error if a block could not be compressed or written.
+
+      if(current && current->data.size() + size > block_size) submit_current_block();
+      if(!current)
+      {
+         current.reset(new block);
+         current->data.reserve(block_size);
+         current->footer.first_frame = frames_written;
+         current->footer.number_of_frames = 0;
+      }
+      current->data.insert(current->data.end(), frame, frame + size);
+      ++current->footer.number_of_frames;
+      ++frames_written;
+   }
+
+   void compressed_run_writer::flush()
+   {
+      /// Compress and write all frames passed to write() so far (the last block may be smaller than block_size).
+
+      if(current) submit_current_block();
+      write_finished_blocks(0);
+   }
+
+   void compressed_run_writer::submit_current_block()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         to_compress.push_back(current.get());
+         pending.push_back(std::move(current));
+      }
+      work_available.notify_one();
+      write_finished_blocks(2*workers.size());
+   }
+
+   void compressed_run_writer::write_finished_blocks(size_t max_pending)
+   {
+      // write compressed blocks in order, waiting if more than max_pending blocks are not yet written
+
+      std::unique_lock<std::mutex> lock(mutex);
+      while(!pending.empty())
+      {
+         if(pending.front()->done)
+         {
+            auto b = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+            write_block(*b);
+            lock.lock();
+         }
+         else if(pending.size() > max_pending)
+            block_done.wait(lock);
+         else
+            break;
+      }
+   }
+
+   void compressed_run_writer::write_block(block &b)
+   {
+      if(!b.compressed_ok) throw std::runtime_error("compressed_run_writer: LZ4 compression failed");
+      size_t total = b.footer.compressed_size + sizeof(b.footer);
+      if(file_used > sizeof(compressed_run_file_header) && file_used + total > max_file_size)
+      {
+         // current file full - close and open new file
+         file.close();
+         ++file_index;
+         open_file();
+      }
+      file.write((const char*)b.compressed.data(), b.footer.compressed_size);
+      file.write((const char*)&b.footer, sizeof(b.footer));
+      if(!file.good()) throw std::runtime_error("compressed_run_writer: error writing " + run_file_name(first_file, file_index));
+      file_used += total;
+      bytes_in += b.footer.uncompressed_size;
+      bytes_out += total;
+   }
+
+   void compressed_run_writer::run_worker()
+   {
+      while(1)
+      {
+         block* b;
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_available.wait(lock, [&]{ return stop || !to_compress.empty(); });
+            if(to_compress.empty()) return;
+            b = to_compress.front();
+            to_compress.pop_front();
+         }
+         int n = b->data.size();
+         b->compressed.resize(LZ4_compressBound(n));
+         int size = LZ4_compress_default((const char*)b->data.data(), (char*)b->compressed.data(), n, b->compressed.size());
+         b->compressed_ok = size > 0;
+         b->footer.compressed_size = size > 0 ? size : 0;
+         b->footer.uncompressed_size = n;
+         b->footer.magic = compressed_block_magic;
+         // uncompressed data no longer needed
+         std::vector<uint8_t>().swap(b->data);
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            b->done = true;
+         }
+         block_done.notify_all();
+      }
+   }
+
+   namespace
+   {
+      void pread_all(int fd, void* dest, size_t nbytes, uint64_t offset)
+      {
+         auto p = (uint8_t*)dest;
+         while(nbytes)
+         {
+            auto n = pread(fd, p, nbytes, offset);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) throw std::runtime_error(std::string("compressed_run_reader: read error: ") + (n ? strerror(errno) : "unexpected end of file"));
+            p += n;
+            nbytes -= n;
+            offset += n;
+         }
+      }
+   }
+
+   compressed_run_reader::compressed_run_reader(const std::string &_first_file)
+      : first_file{_first_file}
+   {
+      /// \param[in] _first_file name of first file of run
+      ///
+      /// Throws std::runtime_error if the first file cannot be opened, or if a file of the run is not a compressed
+      /// run file. If a file does not end with a complete block (e.g. writer was killed), its incomplete data is
+      /// ignored (see get_truncated_bytes()).
+
+      try
+      {
+         for(int index = 0; ; ++index)
+         {
+            auto name = run_file_name(first_file, index);
+            if(index && access(name.c_str(), F_OK)) break;
+            open_file(index, name);
+         }
+      }
+      catch (...)
+      {
+         for(auto fd : fds) close(fd);
+         throw;
+      }
+   }
+
+   compressed_run_reader::~compressed_run_reader()
+   {
+      for(auto fd : fds) close(fd);
+   }
+
+   void compressed_run_reader::open_file(int index, const std::string &name)
+   {
+      // open file & add its blocks to index, going backwards from the footer of the last block
+
+      int fd = open(name.c_str(), O_RDONLY);
+      if(fd < 0) throw std::runtime_error("compressed_run_reader: cannot open " + name + " : " + strerror(errno));
+      fds.push_back(fd);
+
+      compressed_run_file_header header;
+      struct stat st;
+      if(fstat(fd, &st) || (size_t)st.st_size < sizeof(header))
+         throw std::runtime_error("compressed_run_reader: " + name + " is not a compressed run file");
+      pread_all(fd, &header, sizeof(header), 0);
+      if(memcmp(header.magic, compressed_run_magic, 8))
+         throw std::runtime_error("compressed_run_reader: " + name + " is not a compressed run file");
+      if(header.version > compressed_run_version || header.codec != compressed_run_codec_lz4)
+         throw std::runtime_error("compressed_run_reader: unknown version or compression of " + name);
+
+      std::vector<block_info> file_blocks;
+      auto find_blocks = [&](uint64_t pos)
+      {
+         // go backwards from footer ending at pos: false if it is not a chain of valid footers back to the header
+         file_blocks.clear();
+         while(pos > header.header_size)
+         {
+            block_info b;
+            b.file = index;
+            if(pos < header.header_size + sizeof(b.footer)) return false;
+            pread_all(fd, &b.footer, sizeof(b.footer), pos - sizeof(b.footer));
+            if(b.footer.magic != compressed_block_magic
+                  || pos - sizeof(b.footer) - header.header_size < b.footer.compressed_size) return false;
+            b.offset = pos - sizeof(b.footer) - b.footer.compressed_size;
+            file_blocks.push_back(b);
+            pos = b.offset;
+         }
+         return pos == header.header_size;
+      };
+      if(!find_blocks(st.st_size))
+      {
+         // file does not end with a complete block (writer was stopped while writing it):
+         // use the blocks up to the last complete one
+         uint64_t end = header.header_size;
+         std::vector<uint8_t> chunk(1024*1024);
+         for(uint64_t chunk_end = st.st_size; chunk_end > header.header_size && end == header.header_size; )
+         {
+            uint64_t chunk_start = std::max<uint64_t>(header.header_size, chunk_end > chunk.size() ? chunk_end - chunk.size() : 0);
+            pread_all(fd, chunk.data(), chunk_end - chunk_start, chunk_start);
+            for(uint64_t q = chunk_end; q >= chunk_start + 4; --q)
+            {
+               uint32_t magic;
+               memcpy(&magic, &chunk[q - 4 - chunk_start], 4);
+               if(magic == compressed_block_magic && find_blocks(q))
+               {
+                  end = q;
+                  break;
+               }
+            }
+            // overlap chunks by 3 bytes so that magic across chunk boundary is not missed
+            chunk_end = chunk_start > header.header_size ? chunk_start + 3 : header.header_size;
+         }
+         if(end == header.header_size) file_blocks.clear();
+         truncated_bytes += st.st_size - end;
+      }
+      blocks.insert(blocks.end(), file_blocks.rbegin(), file_blocks.rend());
+   }
+
+   void compressed_run_reader::read_block(size_t index, std::vector<uint8_t> &frames) const
+   {
+      /// \param[in] index index of block in run (0 to get_number_of_blocks()-1)
+      /// \param[out] frames resized to contain the (uncompressed) frames of the block
+      ///
+      /// Can be called from several threads at the same time.
+
+      auto& b = blocks.at(index);
+      std::vector<char> compressed(b.footer.compressed_size);
+      pread_all(fds[b.file], compressed.data(), compressed.size(), b.offset);
+      frames.resize(b.footer.uncompressed_size);
+      int n = LZ4_decompress_safe(compressed.data(), (char*)frames.data(), compressed.size(), frames.size());
+      if(n != (int)b.footer.uncompressed_size)
+         throw std::runtime_error("compressed_run_reader: corrupted block " + std::to_string(index) + " in "
+                                  + run_file_name(first_file, b.file));
+   }
+
+   void compressed_run_reader::for_each_block(int threads, std::function<void (size_t, const std::vector<uint8_t> &)> callback) const
+   {
+      /// \param[in] threads number of threads decompressing blocks
+      /// \param[in] callback called with the index & uncompressed frames of each block of the run
+      ///
+      /// Blocks are decompressed in parallel: the callback is called from several threads at the same time,
+      /// not in order of blocks. Any exception thrown while reading a block or by the callback is rethrown
+      /// after all threads have stopped.
+
+      std::atomic<size_t> next{0};
+      std::exception_ptr error;
+      std::mutex error_mutex;
+      auto work = [&]{
+         std::vector<uint8_t> frames;
+         size_t index;
+         while((index = next++) < blocks.size())
+         {
+            try
+            {
+               read_block(index, frames);
+               callback(index, frames);
+            }
+            catch (...)
+            {
+               std::lock_guard<std::mutex> lock(error_mutex);
+               if(!error) error = std::current_exception();
+               next = blocks.size();
+            }
+         }
+      };
+      std::vector<std::thread> pool;
+      for(int i = 1; i < threads; ++i) pool.emplace_back(work);
+      work();
+      for(auto& t : pool) t.join();
+      if(error) std::rethrow_exception(error);
+   }
+
+   compressed_run_reader::frame_position compressed_run_reader::locate_frame(uint64_t frame_number) const
+   {
+      /// \param[in] frame_number number of frame since start of run (from 0)
+      /// \returns block containing the frame and its offset in the uncompressed block
+      ///
+      /// The block is found from the index; it is decompressed to find the offset of the frame.
+      /// Throws std::out_of_range if the run has fewer frames.
+
+      if(frame_number >= get_number_of_frames())
+         throw std::out_of_range("compressed_run_reader: no frame " + std::to_string(frame_number) + " in run");
+      auto it = std::upper_bound(blocks.begin(), blocks.end(), frame_number,
+                                 [](uint64_t n, const block_info& b){ return n < b.footer.first_frame; });
+      frame_position pos;
+      pos.block = it - blocks.begin() - 1;
+      pos.offset = 0;
+      std::vector<uint8_t> frames;
+      read_block(pos.block, frames);
+      for(auto n = blocks[pos.block].footer.first_frame; n < frame_number; ++n)
+      {
+         pos.offset += mfm_run_reader::frame_size(&frames[pos.offset]);
+         if(pos.offset + 24 > frames.size())
+            throw std::runtime_error("compressed_run_reader: bad MFM frame in block " + std::to_string(pos.block));
+      }
+      return pos;
+   }
+
+   void compressed_run_reader::read_frame(frame_position position, std::vector<uint8_t> &frame) const
+   {
+      /// \param[in] position of frame, e.g. from locate_frame()
+      /// \param[out] frame resized to contain the MFM frame
+
+      std::vector<uint8_t> frames;
+      read_block(position.block, frames);
+      if((size_t)position.offset + 24 > frames.size())
+         throw std::out_of_range("compressed_run_reader: bad frame position");
+      auto size = mfm_run_reader::frame_size(&frames[position.offset]);
+      if(size < 24 || position.offset + size > frames.size())
+         throw std::runtime_error("compressed_run_reader: bad MFM frame in block " + std::to_string(position.block));
+      frame.assign(frames.begin() + position.offset, frames.begin() + position.offset + size);
+   }
+
+   bool compressed_run_reader::next(std::vector<uint8_t> &frame)
+   {
+      /// \param[out] frame resized to contain the next MFM frame of the run
+      /// \returns false at end of run
+
+      while(block_offset >= block_data.size())
+      {
+         if(next_block == blocks.size()) return false;
+         read_block(next_block++, block_data);
+         block_offset = 0;
+      }
+      if(block_offset + 24 > block_data.size())
+         throw std::runtime_error("compressed_run_reader: truncated MFM frame in block " + std::to_string(next_block-1));
+      auto size = mfm_run_reader::frame_size(&block_data[block_offset]);
+      if(size < 24 || block_offset + size > block_data.size())
+         throw std::runtime_error("compressed_run_reader: bad MFM frame in block " + std::to_string(next_block-1));
+      frame.assign(block_data.begin() + block_offset, block_data.begin() + block_offset + size);
+      block_offset += size;
+      return true;
+   }
+
+   void compressed_run_reader::rewind()
+   {
+      next_block = 0;
+      block_data.clear();
+      block_offset = 0;
+   }
+}
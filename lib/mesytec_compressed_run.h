@@ -0,0 +1,207 @@
+#ifndef MESYTEC_COMPRESSED_RUN_H
+#define MESYTEC_COMPRESSED_RUN_H
+
+#include "mesytec_run_files.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @struct compressed_run_file_header
+      @brief header at the beginning of each file of a compressed run (see compressed_run_writer)
+    */
+   struct compressed_run_file_header
+   {
+      char magic[8];             ///< "MESYMFMZ"
+      uint32_t version;
+      uint32_t header_size;      ///< sizeof(compressed_run_file_header)
+      uint32_t codec;            ///< compression of blocks: 1 = LZ4
+      uint32_t block_size;       ///< maximum uncompressed size of blocks [bytes]
+      uint64_t start_time;       ///< unix time at which the file was opened [ns]
+   };
+
+   /**
+      @struct compressed_block_footer
+      @brief footer following the compressed data of each block of a compressed run
+
+      Each block contains whole MFM frames. Files of a compressed run end with the footer of their last block,
+      so that all blocks can be found by going backwards from the end of the file (see compressed_run_reader).
+    */
+   struct compressed_block_footer
+   {
+      uint32_t compressed_size;   ///< size of compressed data preceding this footer [bytes]
+      uint32_t uncompressed_size; ///< size of frames in block [bytes]
+      uint64_t first_frame;       ///< number of first frame of block since start of run
+      uint32_t number_of_frames;
+      uint32_t magic;             ///< compressed_block_magic
+   };
+
+   extern const char compressed_run_magic[8];
+   const uint32_t compressed_run_version = 1;
+   const uint32_t compressed_block_magic = 0x4b425a4d; // "MZBK"
+   const uint32_t compressed_run_codec_lz4 = 1;
+
+   bool is_compressed_run_file(const std::string& file);
+
+   /**
+      @class compressed_run_writer
+      @brief write MFM frames in the files of a run as independently compressed (LZ4) blocks
+
+      Frames are accumulated in blocks of whole frames (default size 4 MB). Full blocks are compressed by a pool of
+      threads and written to disk in order by the thread calling write(), each followed by a
+      compressed_block_footer. As in mfm_run_writer, a new file (`first_file`, `first_file.1`, ...) is opened
+      when the current one would exceed the maximum file size; each file begins with a compressed_run_file_header.
+      If more than 2 blocks per thread are waiting to be compressed, write() waits for the oldest one.
+
+      ~~~~{.cpp}
+      mesytec::compressed_run_writer writer("mesytec_run_12.mfmz", 1024*1024*1024, 4*1024*1024, 4);
+      writer.write(frame, frame_size);
+      ~~~~
+    */
+   class compressed_run_writer
+   {
+      struct block
+      {
+         std::vector<uint8_t> data;
+         std::vector<uint8_t> compressed;
+         compressed_block_footer footer;
+         bool compressed_ok{false};
+         bool done{false};
+      };
+
+      std::string first_file;
+      uint64_t max_file_size;
+      uint32_t block_size;
+      int file_index{0};
+      uint64_t file_used{0};
+      std::ofstream file;
+
+      std::unique_ptr<block> current;
+      uint64_t frames_written{0};
+      uint64_t bytes_in{0};
+      uint64_t bytes_out{0};
+
+      // blocks in order of writing, and those of them waiting for a compression thread
+      std::deque<std::unique_ptr<block>> pending;
+      std::deque<block*> to_compress;
+      std::mutex mutex;
+      std::condition_variable work_available;
+      std::condition_variable block_done;
+      bool stop{false};
+      std::vector<std::thread> workers;
+
+      void open_file();
+      void submit_current_block();
+      void write_finished_blocks(size_t max_pending);
+      void write_block(block& b);
+      void run_worker();
+
+   public:
+      compressed_run_writer(const std::string& first_file, uint64_t max_file_size = 1024*1024*1024,
+                            uint32_t block_size = 4*1024*1024, int threads = 2);
+      ~compressed_run_writer();
+      compressed_run_writer(const compressed_run_writer&)=delete;
+      compressed_run_writer& operator=(const compressed_run_writer&)=delete;
+
+      void write(const uint8_t* frame, size_t size);
+      void flush();
+
+      /**
+         @return number of frames passed to write()
+       */
+      uint64_t get_frames_written() const { return frames_written; }
+      /**
+         @return total size of frames written to disk so far (before compression) [bytes]
+       */
+      uint64_t get_bytes_in() const { return bytes_in; }
+      /**
+         @return total size of compressed blocks written to disk so far (with their footers) [bytes]
+       */
+      uint64_t get_bytes_out() const { return bytes_out; }
+   };
+
+   /**
+      @class compressed_run_reader
+      @brief sequential & random access to the frames of a run written by compressed_run_writer
+
+      When opened, the footers of all blocks of all files of the run are read (going backwards from the end of
+      each file) to build the index of blocks. Blocks can then be read independently, in any order and from
+      several threads at the same time (read_block() only uses pread()), e.g. to decompress a run in parallel
+      with for_each_block(). Frames are numbered from 0 at the start of the run: locate_frame() gives the
+      (block, offset) of any frame.
+
+      ~~~~{.cpp}
+      mesytec::compressed_run_reader run("mesytec_run_12.mfmz");
+      std::vector<uint8_t> frame;
+      while(run.next(frame))
+      {
+         \// ...
+      }
+      auto pos = run.locate_frame(1000000);
+      run.read_frame(pos, frame);
+      ~~~~
+    */
+   class compressed_run_reader
+   {
+   public:
+      struct block_info
+      {
+         int file;                   ///< index of file of run
+         uint64_t offset;            ///< offset of compressed data in file
+         compressed_block_footer footer;
+      };
+      struct frame_position
+      {
+         uint32_t block;             ///< index of block in run
+         uint32_t offset;            ///< offset of frame in uncompressed block [bytes]
+      };
+
+   private:
+      std::string first_file;
+      std::vector<int> fds;
+      std::vector<block_info> blocks;
+      uint64_t truncated_bytes{0};
+
+      // sequential reading
+      size_t next_block{0};
+      std::vector<uint8_t> block_data;
+      size_t block_offset{0};
+
+      void open_file(int index, const std::string& name);
+
+   public:
+      compressed_run_reader(const std::string& first_file);
+      ~compressed_run_reader();
+      compressed_run_reader(const compressed_run_reader&)=delete;
+      compressed_run_reader& operator=(const compressed_run_reader&)=delete;
+
+      size_t get_number_of_blocks() const { return blocks.size(); }
+      const block_info& get_block(size_t index) const { return blocks.at(index); }
+      uint64_t get_number_of_frames() const
+      {
+         return blocks.empty() ? 0 : blocks.back().footer.first_frame + blocks.back().footer.number_of_frames;
+      }
+
+      /**
+         @return number of bytes at the end of files of the run which do not belong to a complete block
+       */
+      uint64_t get_truncated_bytes() const { return truncated_bytes; }
+
+      void read_block(size_t index, std::vector<uint8_t>& frames) const;
+      void for_each_block(int threads, std::function<void(size_t, const std::vector<uint8_t>&)> callback) const;
+      frame_position locate_frame(uint64_t frame_number) const;
+      void read_frame(frame_position position, std::vector<uint8_t>& frame) const;
+
+      bool next(std::vector<uint8_t>& frame);
+      void rewind();
+   };
+}
+
+#endif // MESYTEC_COMPRESSED_RUN_H
@@ -3,9 +3,13 @@
 
 #include <vector>
 #include <string>
+#include <utility>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <array>
+#include <functional>
 #include <cassert>
 #include "mesytec_experimental_setup.h"
 
@@ -31,7 +35,7 @@ namespace mesytec
       channel_data()=default;
       ~channel_data()=default;
       channel_data(uint32_t _dw)
-         : data_word{std::move(_dw)}
+         : data_word{std::move(_dw)}, data{0}, bus_number{0}, channel{0}, data_type{module::unknown}
       {}
       channel_data(module::datatype_t _type, uint8_t _chan, uint16_t _data, uint32_t _dw)
          : data_type{_type}, data_word{_dw}, data{_data}, bus_number{0}, channel{_chan}
@@ -53,6 +57,11 @@ namespace mesytec
       {
          buf.push_back(data_word);
       }
+      uint32_t* add_data_to_buffer(uint32_t* buf) const
+      {
+         *buf = data_word;
+         return buf+1;
+      }
 
       /**
          @return the full 32-bit data word read from the datastream corresponding to this data item
@@ -74,6 +83,14 @@ namespace mesytec
          @return the type of data associated with this data item
        */
       module::datatype_t get_data_type() const { return data_type; }
+      /**
+         change the data and the corresponding data word (e.g. after pedestal subtraction)
+       */
+      void set_data(uint16_t _data, uint32_t _dw)
+      {
+         data = _data;
+         data_word = _dw;
+      }
    };
 
    /**
@@ -172,6 +189,21 @@ namespace mesytec
       module_data(const module_data&) = delete;
       module_data& operator=(const module_data&) = delete;
       module_data& operator=(module_data&&)=default;
+      /**
+         explicit copy of the data of another module (copy constructor & assignment are deleted to avoid
+         accidental copies): the capacity of this object is reused
+       */
+      void copy_from(const module_data& other)
+      {
+         data.clear();
+         for(auto& d : other.data)
+            data.emplace_back(d.get_data_type(), d.get_bus_number(), d.get_channel_number(), d.get_data(), d.get_data_word());
+         event_counter = other.event_counter;
+         header_word = other.header_word;
+         eoe_word = other.eoe_word;
+         data_words = other.data_words;
+         module_id = other.module_id;
+      }
       void add_data(module::datatype_t type, uint8_t channel, uint16_t datum, uint32_t data_word)
       {
          data.emplace_back(type,channel,datum,data_word);
@@ -218,6 +250,20 @@ namespace mesytec
             for(auto& v: data) v.add_data_to_buffer(buf);
          }
       }
+      uint32_t* add_data_to_buffer(uint32_t* buf) const
+      {
+         // same as add_data_to_buffer(std::vector<uint32_t>&) but writing directly to memory,
+         // which must be large enough to hold size_of_buffer() words.
+         //
+         // returns pointer to the word following the last one written
+
+         if(data.size())
+         {
+            *buf++ = header_word;
+            for(auto& v: data) buf = v.add_data_to_buffer(buf);
+         }
+         return buf;
+      }
       size_t size_of_buffer() const
       {
          // returns size (in 4-byte words) of buffer required to hold all data for this module
@@ -227,6 +273,38 @@ namespace mesytec
          return data.size() ? data.size()+1 : 0;
       }
       bool has_data() const { return data.size()>0; }
+      /**
+         remove all data items for which P(channel_data&) returns true (P may modify the items it keeps),
+         and reduce the data length in the header word accordingly, so that the header stays consistent
+         with the data written by add_data_to_buffer().
+
+         @param P predicate called once for each data item, in order
+         @param firmware firmware of module (determines position of length in header word)
+         @return number of data items removed
+       */
+      template<typename Predicate>
+      size_t remove_data_if(Predicate P, firmware_t firmware)
+      {
+         size_t kept = 0;
+         for(size_t i = 0; i < data.size(); ++i)
+         {
+            if(P(data[i])) continue;
+            if(kept != i) data[kept] = std::move(data[i]);
+            ++kept;
+         }
+         size_t removed = data.size() - kept;
+         data.resize(kept);
+
+         uint32_t length_mask = 0;
+         if(firmware == VMMR) length_mask = data_flags::vmmr_data_length_mask;
+         else if(firmware == MDPP_QDC || firmware == MDPP_SCP || firmware == MDPP_CSI) length_mask = data_flags::mdpp_data_length_mask;
+         if(removed && length_mask)
+         {
+            data_words = data_words > removed ? data_words - removed : 0;
+            header_word = (header_word & ~length_mask) | (data_words & length_mask);
+         }
+         return removed;
+      }
    };
 
    /**
@@ -253,11 +331,13 @@ namespace mesytec
    class event
    {
       friend class buffer_reader;
+      friend class mvlc_parser_buffer_reader;
+      friend class zero_suppression;
 
       std::vector<module_data> modules;
-      uint32_t event_counter;
+      uint32_t event_counter{0};
    public:
-      uint16_t tgv_ts_lo,tgv_ts_mid,tgv_ts_hi;
+      uint16_t tgv_ts_lo{0},tgv_ts_mid{0},tgv_ts_hi{0};
       /**
          @return the least significant 16-bit word of the TGV timestamp data (bits 0-15)
        */
@@ -284,10 +364,59 @@ namespace mesytec
       {
          modules.clear();
       }
+      /**
+         exchange contents (module data, event counter and TGV timestamp) with another event, without copying
+         or allocating anything
+       */
+      void swap(event& other) noexcept
+      {
+         modules.swap(other.modules);
+         std::swap(event_counter, other.event_counter);
+         std::swap(tgv_ts_lo, other.tgv_ts_lo);
+         std::swap(tgv_ts_mid, other.tgv_ts_mid);
+         std::swap(tgv_ts_hi, other.tgv_ts_hi);
+      }
+      /**
+         explicit copy of another event (e.g. to modify it when the original is shared between the sinks of an
+         event_fanout): the capacity of this event and of its module data is reused
+       */
+      void copy_from(const event& other)
+      {
+         modules.resize(other.modules.size());
+         for(size_t i = 0; i < modules.size(); ++i) modules[i].copy_from(other.modules[i]);
+         copy_counter_and_timestamp(other);
+      }
+      /**
+         copy event counter and TGV timestamp (but not module data) from another event.
+
+         The MVLC parser only updates these for events containing an EOE or TGV data: after swap() with an
+         empty event, this restores the values which the parser expects to find for the next event.
+       */
+      void copy_counter_and_timestamp(const event& other)
+      {
+         event_counter = other.event_counter;
+         tgv_ts_lo = other.tgv_ts_lo;
+         tgv_ts_mid = other.tgv_ts_mid;
+         tgv_ts_hi = other.tgv_ts_hi;
+      }
       /**
         @return reference to the collection of module_data objects
        */
       const std::vector<module_data>& get_module_data() const { return modules; }
+      /**
+         remove modules which have no data left (e.g. after zero suppression)
+       */
+      void remove_empty_modules()
+      {
+         size_t kept = 0;
+         for(size_t i = 0; i < modules.size(); ++i)
+         {
+            if(!modules[i].has_data()) continue;
+            if(kept != i) modules[kept] = std::move(modules[i]);
+            ++kept;
+         }
+         modules.resize(kept);
+      }
 
       void add_module_data(module_data& d){ modules.push_back(std::move(d)); }
       bool is_full(unsigned int number_of_modules) const
@@ -315,7 +444,121 @@ namespace mesytec
          for(auto& m : modules) m.add_data_to_buffer(buf);
          return buf;
       }
+      void write_output_buffer(uint32_t* buf) const
+      {
+         // write full representation of all data for event directly to memory,
+         // which must be large enough to hold size_of_buffer() words
+
+         for(auto& m : modules) buf = m.add_data_to_buffer(buf);
+      }
       bool has_data() const { return modules.size()>0; }
    };
+
+   /**
+      @struct resync_counters
+      @brief what was skipped by a buffer reader in resync mode to carry on after corrupted data
+
+      See buffer_reader::set_resync() and mvlc_parser_buffer_reader::set_resync().
+    */
+   struct resync_counters
+   {
+      uint64_t resyncs{0};             ///< number of times a search for the next valid header was needed
+      uint64_t modules_quarantined{0}; ///< module data blocks skipped (unknown module id, or data which cannot be decoded)
+      uint64_t frames_quarantined{0};  ///< frames skipped (MFM frames which cannot be decoded, or MVLC frames rejected by the readout parser)
+      uint64_t events_quarantined{0};  ///< events lost (partially assembled when resynchronising, or callback threw an exception)
+      uint64_t bytes_skipped{0};       ///< bytes skipped while searching for the next valid header
+
+      void clear() { *this = resync_counters(); }
+      bool empty() const { return !(resyncs || modules_quarantined || frames_quarantined || events_quarantined || bytes_skipped); }
+      void print(std::ostream& out) const
+      {
+         out << resyncs << " resyncs, " << bytes_skipped << " bytes skipped, quarantined: " << modules_quarantined
+             << " module blocks, " << frames_quarantined << " frames, " << events_quarantined << " events";
+      }
+   };
+
+   /**
+      @enum parse_status
+      @brief result of decoding data, used instead of exceptions on the decoding path
+
+      See buffer_reader::try_decode_event() and the error counters and callback of the buffer readers.
+    */
+   enum class parse_status : uint8_t
+   {
+      ok,
+      unknown_module,            ///< module header with an id which is not in the crate map
+      data_before_module_header, ///< data words before the first module header of a frame
+      bad_module_data,           ///< module data which cannot be decoded (e.g. wrong size of MVLC scaler or TGV data)
+      unknown_frame_revision,    ///< MFM frame revision which is not handled
+      bad_frame_header,          ///< invalid MFM or MVLC frame header
+      number_of_statuses
+   };
+
+   inline const char* parse_status_name(parse_status s)
+   {
+      switch(s)
+      {
+      case parse_status::ok: return "ok";
+      case parse_status::unknown_module: return "unknown module";
+      case parse_status::data_before_module_header: return "data before module header";
+      case parse_status::bad_module_data: return "bad module data";
+      case parse_status::unknown_frame_revision: return "unknown MFM frame revision";
+      case parse_status::bad_frame_header: return "bad frame header";
+      default: return "unknown status";
+      }
+   }
+
+   /**
+      @struct parse_error
+      @brief context of an error found when decoding data, given to the error callback of the buffer readers
+    */
+   struct parse_error
+   {
+      parse_status status{parse_status::ok};
+      uint32_t word{0};      ///< data word (or frame header) where the error was found
+      uint8_t module_id{0};  ///< id of the module concerned (0 if none)
+      size_t offset{0};      ///< position in bytes in the frame or buffer being decoded (MVLC module data: index of module in readout stack)
+
+      std::string describe() const
+      {
+         std::ostringstream out;
+         out << parse_status_name(status) << " (word=0x" << std::hex << word << ", module id=0x" << (int)module_id
+             << std::dec << ", offset=" << offset << ")";
+         return out.str();
+      }
+   };
+
+   using parse_error_callback = std::function<void(const parse_error&)>;
+
+   /**
+      @struct parse_error_counters
+      @brief number of errors of each type found by a buffer reader
+    */
+   struct parse_error_counters
+   {
+      std::array<uint64_t, static_cast<size_t>(parse_status::number_of_statuses)> counts{};
+
+      void count(parse_status s) { ++counts[static_cast<size_t>(s)]; }
+      uint64_t get(parse_status s) const { return counts[static_cast<size_t>(s)]; }
+      uint64_t total() const
+      {
+         uint64_t n = 0;
+         for(size_t i = 1; i < counts.size(); ++i) n += counts[i];
+         return n;
+      }
+      void clear() { counts.fill(0); }
+      bool empty() const { return !total(); }
+      void print(std::ostream& out) const
+      {
+         bool first = true;
+         for(size_t i = 1; i < counts.size(); ++i)
+         {
+            if(!counts[i]) continue;
+            if(!first) out << ", ";
+            out << counts[i] << " " << parse_status_name(static_cast<parse_status>(i));
+            first = false;
+         }
+      }
+   };
 }
 #endif // READ_LISTFILE_H
@@ -0,0 +1,51 @@
+#include "mesytec_data_selection.h"
+#include <stdexcept>
+
+namespace mesytec
+{
+   void data_selection::add_module(uint8_t mod_id)
+   {
+      /// \param[in] mod_id address of module all of whose data is to be decoded
+
+      modules[mod_id] = all_data;
+      channels[mod_id].clear();
+   }
+
+   void data_selection::add_channels(uint8_t mod_id, uint8_t bus, uint8_t first_channel, uint8_t last_channel,
+                                     const std::vector<module::datatype_t> &data_types)
+   {
+      /// \param[in] mod_id address of module
+      /// \param[in] bus bus number (VMMR modules; always 0 for MDPP modules)
+      /// \param[in] first_channel first channel of range to decode
+      /// \param[in] last_channel last channel of range to decode (included, must be <128)
+      /// \param[in] data_types types of data to decode for these channels (all types if empty)
+      ///
+      /// Note that for VMMR modules TDC data is given for each bus with channel number 0.
+      /// If all data of the module has already been selected with add_module(), this does nothing.
+
+      if(last_channel < first_channel || last_channel > 127)
+         throw std::invalid_argument("data_selection: invalid channel range for module " + std::to_string(mod_id));
+      if(modules[mod_id] == all_data) return;
+
+      uint8_t type_mask = 0;
+      for(auto t : data_types) type_mask |= (1 << t);
+      if(data_types.empty()) type_mask = all_data_types;
+
+      auto& c = channels[mod_id];
+      if(c.size() < (bus+1)*128u) c.resize((bus+1)*128, 0);
+      for(int chan = first_channel; chan <= last_channel; ++chan) c[bus*128 + chan] |= type_mask;
+      modules[mod_id] = some_data;
+   }
+
+   void data_selection::clear()
+   {
+      modules.fill(none);
+      for(auto& c : channels) c.clear();
+   }
+
+   bool data_selection::empty() const
+   {
+      for(auto m : modules) if(m != none) return false;
+      return true;
+   }
+}
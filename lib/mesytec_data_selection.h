@@ -0,0 +1,82 @@
+#ifndef MESYTEC_DATA_SELECTION_H
+#define MESYTEC_DATA_SELECTION_H
+
+#include "mesytec_module.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class data_selection
+      @brief modules, buses, channels and data types to be decoded by a parser (projection pushdown)
+
+      When a selection is given to mesytec::buffer_reader or mesytec::mvlc_parser_buffer_reader, the data of
+      modules which are not selected is skipped without being decoded, and for selected modules only
+      the data words corresponding to selected buses/channels/data types are decoded and stored in the event:
+      analyses which only look at a few detectors do not pay for building channel_data for the rest.
+
+      Modules which have no selected data in an event are not added to the event.
+
+      ~~~~{.cpp}
+      mesytec::data_selection sel;
+      sel.add_module(0x10);                                  \// all data of module 0x10
+      sel.add_channels(0x20, 0, 0, 15, {mesytec::module::ADC}); \// ADC of channels 0-15 of module 0x20
+      sel.add_channels(0x30, 3, 0, 127);                     \// all data of bus 3 of VMMR 0x30
+      reader.set_data_selection(sel);
+      ~~~~
+    */
+   class data_selection
+   {
+   public:
+      enum module_selection : uint8_t { none, all_data, some_data };
+      static const uint8_t all_data_types = 0xff;
+
+   private:
+      std::array<module_selection, 256> modules;
+      // for each module with some_data: bitmask of selected data types for each bus*128+channel
+      std::array<std::vector<uint8_t>, 256> channels;
+
+   public:
+      data_selection() { modules.fill(none); }
+
+      void add_module(uint8_t mod_id);
+      void add_channels(uint8_t mod_id, uint8_t bus, uint8_t first_channel, uint8_t last_channel,
+                        const std::vector<module::datatype_t>& data_types = {});
+      void clear();
+
+      /**
+         @return true if nothing was selected
+       */
+      bool empty() const;
+      /**
+         @return true if any data of the module is selected
+       */
+      bool has_module(uint8_t mod_id) const { return modules[mod_id] != none; }
+      /**
+         @return true if all data of the module is selected, i.e. no need to test individual data words
+       */
+      bool has_all_data(uint8_t mod_id) const { return modules[mod_id] == all_data; }
+      /**
+         @return true if data of given type from given bus/channel of module is selected
+       */
+      bool accept(uint8_t mod_id, uint8_t bus, uint8_t channel, module::datatype_t type) const
+      {
+         switch(modules[mod_id])
+         {
+            case all_data:
+               return true;
+            case none:
+               return false;
+            case some_data:
+               break;
+         }
+         auto& c = channels[mod_id];
+         size_t index = bus*128 + channel;
+         return index < c.size() && (c[index] & (1 << type));
+      }
+   };
+}
+
+#endif // MESYTEC_DATA_SELECTION_H
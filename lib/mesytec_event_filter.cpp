@@ -0,0 +1,359 @@
+#include "mesytec_event_filter.h"
+#include "mesytec_histogrammer.h"
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+#include <fnmatch.h>
+
+namespace mesytec
+{
+   event_filter::event_filter(const std::string &_expression, const experimental_setup &_setup)
+      : setup{&_setup}, expression{_expression}
+   {
+      /// \param[in] _expression filter rules (see class description)
+      /// \param[in] _setup description of crate & detectors used to resolve module addresses & detector names
+      ///
+      /// Throws std::invalid_argument if the expression cannot be compiled.
+
+      scaler_module.fill(false);
+      setup->for_each_module([&](module& mod){ if(mod.is_mvlc_scaler()) scaler_module[mod.id] = true; });
+
+      tokenize(expression);
+      if(tokens.empty()) syntax_error("empty filter");
+
+      // rules are and-ed: stop at first rule which is false
+      std::vector<size_t> jumps_to_end;
+      while(1)
+      {
+         compile_or();
+         if(peek().empty()) break;
+         expect(";");
+         if(peek().empty()) break; // allow trailing ';'
+         jumps_to_end.push_back(program.size());
+         program.push_back({instruction::jump_if_false, 0});
+      }
+      for(auto j : jumps_to_end) program[j].argument = program.size();
+      tokens.clear();
+   }
+
+   bool event_filter::accept(const event &ev)
+   {
+      /// \param[in] ev event to test
+      /// \returns true if event satisfies all rules of the filter
+
+      events_tested.store(events_tested.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      bool result = false;
+      size_t pc = 0;
+      auto end = program.size();
+      while(pc < end)
+      {
+         auto& i = program[pc];
+         switch(i.opcode)
+         {
+            case instruction::test:
+               result = evaluate(predicates[i.argument], ev);
+               break;
+            case instruction::negate:
+               result = !result;
+               break;
+            case instruction::jump_if_false:
+               if(!result) { pc = i.argument; continue; }
+               break;
+            case instruction::jump_if_true:
+               if(result) { pc = i.argument; continue; }
+               break;
+         }
+         ++pc;
+      }
+      if(result) events_accepted.store(events_accepted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return result;
+   }
+
+   bool event_filter::compare(int64_t x, predicate::comparison_t c, int64_t value)
+   {
+      switch(c)
+      {
+         case predicate::lt: return x < value;
+         case predicate::le: return x <= value;
+         case predicate::gt: return x > value;
+         case predicate::ge: return x >= value;
+         case predicate::eq: return x == value;
+         case predicate::ne: return x != value;
+      }
+      return false;
+   }
+
+   bool event_filter::evaluate(predicate &p, const event &ev)
+   {
+      switch(p.kind)
+      {
+         case predicate::always:
+            return true;
+         case predicate::prescale:
+            return (p.counter++ % p.value) == 0;
+         case predicate::scaler_event:
+            for(auto& mod : ev.get_module_data())
+               if(scaler_module[mod.get_module_id()]) return true;
+            return false;
+         case predicate::module_hits:
+         {
+            int64_t hits = 0;
+            for(auto& mod : ev.get_module_data())
+               if(mod.get_module_id() == p.module_id) hits += mod.get_channel_data().size();
+            return compare(hits, p.comparison, p.value);
+         }
+         case predicate::detector_value:
+         case predicate::detector_hits:
+         {
+            auto& set = detector_sets[p.detector_set];
+            int64_t hits = 0;
+            for(auto& md : ev.get_module_data())
+            {
+               auto& channels = set.channels[md.get_module_id()];
+               if(channels.empty()) continue;
+               // decode from the data words: readers which only store the words (e.g. mvlc_parser_buffer_reader)
+               // do not fill bus, channel, type and data of channel_data
+               auto mod = setup->find_module(md.get_module_id());
+               if(!mod || !mod->is_mesytec_module()) continue;
+               bool vmmr = mod->is_vmmr_module();
+               for(auto& d : md.get_channel_data())
+               {
+                  auto w = d.get_data_word();
+                  if(vmmr ? !is_vmmr_data(w) : !is_mdpp_data(w)) continue;
+                  size_t index = mod->get_bus_number(w)*128 + mod->get_channel_number(w);
+                  if(index >= channels.size() || !channels[index]) continue;
+                  if(p.kind == predicate::detector_hits) ++hits;
+                  else if(mod->get_data_type(w) == p.data_type && compare(mod->get_channel_data(w), p.comparison, p.value)) return true;
+               }
+            }
+            return p.kind == predicate::detector_hits && compare(hits, p.comparison, p.value);
+         }
+      }
+      return false;
+   }
+
+   void event_filter::tokenize(const std::string &expr)
+   {
+      // tokens are: words (names, patterns, numbers), comparison operators, '(', ')' and ';'
+      size_t i = 0;
+      while(i < expr.size())
+      {
+         char c = expr[i];
+         if(isspace((unsigned char)c)) { ++i; continue; }
+         if(c == '(' || c == ')' || c == ';')
+         {
+            tokens.emplace_back(1, c);
+            ++i;
+         }
+         else if(c == '<' || c == '>' || c == '=' || c == '!')
+         {
+            size_t n = (i+1 < expr.size() && expr[i+1] == '=') ? 2 : 1;
+            tokens.push_back(expr.substr(i, n));
+            i += n;
+         }
+         else
+         {
+            size_t j = i;
+            while(j < expr.size() && !isspace((unsigned char)expr[j]) && !strchr("()<>=!;", expr[j])) ++j;
+            tokens.push_back(expr.substr(i, j-i));
+            i = j;
+         }
+      }
+   }
+
+   const std::string &event_filter::peek() const
+   {
+      static const std::string end_of_expression;
+      return next_token < tokens.size() ? tokens[next_token] : end_of_expression;
+   }
+
+   std::string event_filter::take()
+   {
+      if(next_token == tokens.size()) syntax_error("unexpected end of filter");
+      return tokens[next_token++];
+   }
+
+   void event_filter::expect(const std::string &token)
+   {
+      if(peek() != token) syntax_error("expected '" + token + "'");
+      ++next_token;
+   }
+
+   void event_filter::syntax_error(const std::string &what) const
+   {
+      std::string where = next_token < tokens.size() ? " at '" + tokens[next_token] + "'" : " at end";
+      throw std::invalid_argument("event_filter: " + what + where + " in \"" + expression + "\"");
+   }
+
+   void event_filter::compile_or()
+   {
+      std::vector<size_t> jumps;
+      compile_and();
+      while(peek() == "or")
+      {
+         take();
+         jumps.push_back(program.size());
+         program.push_back({instruction::jump_if_true, 0});
+         compile_and();
+      }
+      for(auto j : jumps) program[j].argument = program.size();
+   }
+
+   void event_filter::compile_and()
+   {
+      std::vector<size_t> jumps;
+      compile_unary();
+      while(peek() == "and")
+      {
+         take();
+         jumps.push_back(program.size());
+         program.push_back({instruction::jump_if_false, 0});
+         compile_unary();
+      }
+      for(auto j : jumps) program[j].argument = program.size();
+   }
+
+   void event_filter::compile_unary()
+   {
+      if(peek() == "not")
+      {
+         take();
+         compile_unary();
+         program.push_back({instruction::negate, 0});
+      }
+      else if(peek() == "(")
+      {
+         take();
+         compile_or();
+         expect(")");
+      }
+      else
+         compile_predicate();
+   }
+
+   void event_filter::emit_test(const predicate &p)
+   {
+      program.push_back({instruction::test, (uint32_t)predicates.size()});
+      predicates.push_back(p);
+   }
+
+   event_filter::predicate::comparison_t event_filter::parse_comparison()
+   {
+      auto op = take();
+      if(op == "<") return predicate::lt;
+      if(op == "<=") return predicate::le;
+      if(op == ">") return predicate::gt;
+      if(op == ">=") return predicate::ge;
+      if(op == "==" || op == "=") return predicate::eq;
+      if(op == "!=") return predicate::ne;
+      --next_token;
+      syntax_error("expected comparison operator");
+   }
+
+   int64_t event_filter::parse_integer()
+   {
+      auto& t = peek();
+      size_t n = 0;
+      int64_t value = 0;
+      try { value = std::stoll(t, &n, 0); } catch(...) {}
+      if(!n || n != t.size()) syntax_error("expected integer");
+      ++next_token;
+      return value;
+   }
+
+   int event_filter::make_detector_set(const std::string &pattern)
+   {
+      detector_set set;
+      bool found = false;
+      setup->for_each_module([&](module& mod){
+         auto nbus = mod.get_number_of_buses();
+         for(int b = 0; b < nbus; ++b)
+         {
+            auto nchan = mod[b].get_number_of_channels();
+            for(size_t c = 0; c < nchan; ++c)
+            {
+               if(!mod[b].has_detector(c) || fnmatch(pattern.c_str(), mod[b][c].c_str(), 0)) continue;
+               auto& channels = set.channels[mod.id];
+               if(channels.empty()) channels.resize(nbus*128);
+               channels[b*128 + c] = true;
+               found = true;
+            }
+         }
+      });
+      if(!found)
+      {
+         --next_token;
+         syntax_error("no detector matches pattern");
+      }
+      detector_sets.push_back(std::move(set));
+      return detector_sets.size() - 1;
+   }
+
+   void event_filter::compile_predicate()
+   {
+      auto word = take();
+      predicate p{};
+      if(word == "true")
+      {
+         p.kind = predicate::always;
+         emit_test(p);
+      }
+      else if(word == "scaler" || word == "physics")
+      {
+         p.kind = predicate::scaler_event;
+         emit_test(p);
+         if(word == "physics") program.push_back({instruction::negate, 0});
+      }
+      else if(word == "prescale")
+      {
+         std::string event_class;
+         if(peek() == "scaler" || peek() == "physics") event_class = take();
+         p.kind = predicate::prescale;
+         p.value = parse_integer();
+         if(p.value < 1) { --next_token; syntax_error("prescale factor must be >= 1"); }
+         if(event_class.empty())
+         {
+            emit_test(p);
+            return;
+         }
+         // 'prescale scaler N' = 'physics or prescale N', 'prescale physics N' = 'scaler or prescale N'
+         emit_test(predicate{predicate::scaler_event});
+         if(event_class == "scaler") program.push_back({instruction::negate, 0});
+         auto jump = program.size();
+         program.push_back({instruction::jump_if_true, 0});
+         emit_test(p);
+         program[jump].argument = program.size();
+      }
+      else if(word == "module")
+      {
+         auto id = parse_integer();
+         if(id < 0 || id > 255 || !setup->has_module(id)) { --next_token; syntax_error("unknown module"); }
+         p.kind = predicate::module_hits;
+         p.module_id = id;
+         expect("hits");
+         p.comparison = parse_comparison();
+         p.value = parse_integer();
+         emit_test(p);
+      }
+      else if(word == "detector")
+      {
+         p.detector_set = make_detector_set(take());
+         auto what = take();
+         if(what == "hits") p.kind = predicate::detector_hits;
+         else
+         {
+            p.kind = predicate::detector_value;
+            p.data_type = histogrammer::data_type_from_name(what);
+            if(p.data_type == module::unknown) { --next_token; syntax_error("unknown data type (expected hits, adc, tdc, qdc_long, qdc_short or trig)"); }
+         }
+         p.comparison = parse_comparison();
+         p.value = parse_integer();
+         emit_test(p);
+      }
+      else
+      {
+         --next_token;
+         syntax_error("expected predicate (module, detector, scaler, physics, prescale, true), 'not' or '('");
+      }
+   }
+}
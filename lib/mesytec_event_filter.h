@@ -0,0 +1,113 @@
+#ifndef MESYTEC_EVENT_FILTER_H
+#define MESYTEC_EVENT_FILTER_H
+
+#include "mesytec_data.h"
+#include "mesytec_experimental_setup.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class event_filter
+      @brief select events with predicates written in a small expression language
+
+      The filter is a list of rules separated by ';'. An event is accepted if all rules are true for it.
+      Each rule is a logical expression of predicates combined with `and`, `or`, `not` and parentheses:
+
+      | predicate | true if |
+      |-----------|---------|
+      | `module 0x20 hits >= 2` | event contains at least 2 data items from module with address 0x20 |
+      | `detector PISTA_E_* adc > 300` | any detector matching the (shell-style) pattern has adc data > 300 |
+      | `detector PISTA_DE_* hits >= 4` | there are at least 4 data items from detectors matching the pattern |
+      | `scaler` | event contains MVLC scaler data |
+      | `physics` | event does not contain MVLC scaler data |
+      | `prescale 100` | for 1 in every 100 evaluations of the predicate |
+      | `true` | always |
+
+      Comparisons can be `<`, `<=`, `>`, `>=`, `==` or `!=`; data types are those of the histogrammer
+      (adc, tdc, qdc_long, qdc_short, trig). Evaluation stops as soon as the result of an expression is known
+      (`a and b` does not evaluate b if a is false), so that `scaler and prescale 100` counts only scaler events.
+      The rule `prescale scaler 100` is a shortcut for `physics or prescale 100` (`prescale physics N` likewise).
+
+      The rules are compiled once, when the filter is constructed, into a flat program of predicate evaluations
+      and conditional jumps; module addresses and detector patterns are resolved to lookup tables using the
+      experimental setup, so that no names are handled when events are filtered.
+
+      ~~~~{.cpp}
+      mesytec::event_filter filter("prescale scaler 100; scaler or detector PISTA_E_* adc > 300", setup);
+      if(filter.accept(event)) { \// publish event }
+      ~~~~
+    */
+   class event_filter
+   {
+      struct predicate
+      {
+         enum kind_t : uint8_t { module_hits, detector_value, detector_hits, scaler_event, prescale, always } kind;
+         enum comparison_t : uint8_t { lt, le, gt, ge, eq, ne } comparison{ge};
+         module::datatype_t data_type{module::unknown};
+         uint8_t module_id{0};
+         int64_t value{0};
+         uint64_t counter{0};
+         int detector_set{-1}; // index in detector_sets
+      };
+      struct instruction
+      {
+         enum opcode_t : uint8_t { test, negate, jump_if_false, jump_if_true } opcode;
+         uint32_t argument; // index of predicate (test) or of instruction to jump to
+      };
+      // channels of detectors matched by a pattern: for each module address, bitmap of bus*128+channel
+      struct detector_set
+      {
+         std::array<std::vector<bool>, 256> channels;
+      };
+
+      const experimental_setup* setup;
+      std::array<bool, 256> scaler_module;
+      std::vector<predicate> predicates;
+      std::vector<detector_set> detector_sets;
+      std::vector<instruction> program;
+      std::string expression;
+      // only updated by the thread calling accept(), but may be read by others
+      std::atomic<uint64_t> events_tested{0};
+      std::atomic<uint64_t> events_accepted{0};
+
+      // compiler
+      std::vector<std::string> tokens;
+      size_t next_token{0};
+      void tokenize(const std::string& expr);
+      const std::string& peek() const;
+      std::string take();
+      void expect(const std::string& token);
+      [[noreturn]] void syntax_error(const std::string& what) const;
+      void compile_or();
+      void compile_and();
+      void compile_unary();
+      void compile_predicate();
+      void emit_test(const predicate& p);
+      predicate::comparison_t parse_comparison();
+      int64_t parse_integer();
+      int make_detector_set(const std::string& pattern);
+
+      bool evaluate(predicate& p, const event& ev);
+      static bool compare(int64_t x, predicate::comparison_t c, int64_t value);
+
+   public:
+      event_filter(const std::string& expression, const experimental_setup& setup);
+
+      bool accept(const event& ev);
+
+      const std::string& get_expression() const { return expression; }
+      uint64_t get_events_tested() const { return events_tested.load(std::memory_order_relaxed); }
+      uint64_t get_events_accepted() const { return events_accepted.load(std::memory_order_relaxed); }
+      /**
+         @return number of instructions in compiled program
+       */
+      size_t get_program_size() const { return program.size(); }
+   };
+}
+
+#endif // MESYTEC_EVENT_FILTER_H
@@ -0,0 +1,89 @@
+#include "mesytec_event_pool.h"
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace mesytec
+{
+   event_pool::event_pool(size_t number_of_events)
+      : capacity{(uint32_t)number_of_events}
+   {
+      /// \param[in] number_of_events number of events in the pool, i.e. maximum number of events in use at any time
+
+      if(!number_of_events || number_of_events >= no_slot)
+         throw std::invalid_argument("event_pool: bad number of events " + std::to_string(number_of_events));
+      slots.reset(new slot[capacity]);
+      for(uint32_t i = 0; i < capacity; ++i)
+      {
+         slots[i].pool = this;
+         slots[i].next.store(i + 1 < capacity ? i + 1 : no_slot, std::memory_order_relaxed);
+      }
+      free_head.store(0, std::memory_order_release);
+   }
+
+   event_pool::~event_pool()
+   {
+      // handles must not outlive the pool
+      assert(in_use.load() == 0);
+   }
+
+   void event_pool::push(slot *s)
+   {
+      // put slot back on top of the free stack
+      uint32_t index = s - slots.get();
+      uint64_t head = free_head.load(std::memory_order_relaxed);
+      uint64_t new_head;
+      do
+      {
+         s->next.store(head & no_slot, std::memory_order_relaxed);
+         new_head = (((head >> 32) + 1) << 32) | index;
+      }
+      while(!free_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+   }
+
+   void event_pool::release(slot *s)
+   {
+      // called by the thread which drops the last handle to the event
+      s->ev.clear();
+      push(s);
+      in_use.fetch_sub(1, std::memory_order_relaxed);
+   }
+
+   event_pool::handle event_pool::try_acquire()
+   {
+      /// \returns handle to a free event of the pool, or an empty handle if all events are in use
+      ///
+      /// The event is empty (no module data).
+
+      uint64_t head = free_head.load(std::memory_order_acquire);
+      uint64_t new_head;
+      uint32_t index;
+      do
+      {
+         index = head & no_slot;
+         if(index == no_slot) return handle{};
+         // the counter in the upper bits changes with every push/pop, so that the exchange fails if the slot
+         // was taken and given back by other threads since head was read (even if it is on top of the stack again)
+         new_head = (((head >> 32) + 1) << 32) | slots[index].next.load(std::memory_order_relaxed);
+      }
+      while(!free_head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire));
+      in_use.fetch_add(1, std::memory_order_relaxed);
+      auto s = &slots[index];
+      s->refs.store(1, std::memory_order_relaxed);
+      return handle{s};
+   }
+
+   event_pool::handle event_pool::acquire()
+   {
+      /// \returns handle to a free event of the pool
+      ///
+      /// If all events are in use, waits (yielding the CPU) for one to be returned by another thread.
+
+      for(;;)
+      {
+         if(auto h = try_acquire()) return h;
+         std::this_thread::yield();
+      }
+   }
+}
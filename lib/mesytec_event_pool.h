@@ -0,0 +1,130 @@
+#ifndef MESYTEC_EVENT_POOL_H
+#define MESYTEC_EVENT_POOL_H
+
+#include "mesytec_data.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace mesytec
+{
+   /**
+      @class event_pool
+      @brief fixed number of preallocated events shared between threads through reference-counted handles
+
+      Events given to buffer_reader callbacks only live for the duration of the call, and as event, module_data
+      and channel_data can only be moved, handing them to other threads means moving every module's data into
+      newly allocated events. Instead, a thread can take an event from the pool, fill it (buffer_reader::decode_event()
+      decodes directly into it, or event::swap() exchanges it with the event of a callback) and pass copies of the
+      handle to as many other threads as required. The event goes back to the pool when the last handle is destroyed,
+      whichever thread it is in.
+
+      The free events are kept in a lock-free stack (index of first free event and ABA counter in a single 64-bit
+      atomic), so that taking and returning events never blocks or allocates. Events are cleared when they are
+      returned: the storage of the list of modules is kept for the next use.
+
+      ~~~~{.cpp}
+      mesytec::event_pool pool(1024);
+      \// parser thread
+      auto ev = pool.acquire();
+      reader.decode_event(blob, blob_size, *ev, frame_revision);
+      writer_queue.push(ev);
+      histogram_queue.push(std::move(ev));
+      \// writer & histogram threads: event is returned to the pool when both have dropped their handle
+      ~~~~
+
+      Handles only give shared access to the event: once it has been passed to several threads, it should not be
+      modified any more. The pool must outlive all of its handles.
+    */
+   class event_pool
+   {
+      static const uint32_t no_slot = 0xffffffff;
+
+      struct slot
+      {
+         event ev;
+         std::atomic<uint32_t> refs{0};
+         std::atomic<uint32_t> next{no_slot};   ///< index of next free slot
+         event_pool* pool{nullptr};
+      };
+
+      std::unique_ptr<slot[]> slots;
+      uint32_t capacity;
+      std::atomic<uint64_t> free_head;             ///< index of first free slot (bits 0-31) + ABA counter (bits 32-63)
+      std::atomic<uint32_t> in_use{0};
+
+      void push(slot* s);
+      void release(slot* s);
+   public:
+      /**
+         @class handle
+         @brief intrusive reference-counted pointer to an event of an event_pool
+
+         Copying a handle increments the reference count of the event, destroying it decrements it.
+         An empty (default-constructed or moved-from) handle converts to false.
+       */
+      class handle
+      {
+         friend class event_pool;
+         slot* s{nullptr};
+
+         explicit handle(slot* _s) : s{_s} {}
+      public:
+         handle() = default;
+         handle(const handle& other) : s{other.s}
+         {
+            if(s) s->refs.fetch_add(1, std::memory_order_relaxed);
+         }
+         handle(handle&& other) noexcept : s{other.s}
+         {
+            other.s = nullptr;
+         }
+         handle& operator=(const handle& other)
+         {
+            handle(other).swap(*this);
+            return *this;
+         }
+         handle& operator=(handle&& other) noexcept
+         {
+            handle(std::move(other)).swap(*this);
+            return *this;
+         }
+         ~handle() { reset(); }
+
+         void swap(handle& other) noexcept { std::swap(s, other.s); }
+         /**
+            drop the reference to the event (which is returned to the pool if this was the last one)
+          */
+         void reset()
+         {
+            if(s && s->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) s->pool->release(s);
+            s = nullptr;
+         }
+         explicit operator bool() const { return s != nullptr; }
+         event& operator*() const { return s->ev; }
+         event* operator->() const { return &s->ev; }
+         event* get() const { return s ? &s->ev : nullptr; }
+         /**
+            @return number of handles to the event (0 for an empty handle)
+          */
+         uint32_t use_count() const { return s ? s->refs.load(std::memory_order_relaxed) : 0; }
+      };
+
+      explicit event_pool(size_t number_of_events);
+      ~event_pool();
+      event_pool(const event_pool&) = delete;
+      event_pool& operator=(const event_pool&) = delete;
+
+      handle try_acquire();
+      handle acquire();
+
+      size_t get_capacity() const { return capacity; }
+      /**
+         @return number of events currently held by handles
+       */
+      size_t get_number_in_use() const { return in_use.load(std::memory_order_relaxed); }
+   };
+}
+
+#endif // MESYTEC_EVENT_POOL_H
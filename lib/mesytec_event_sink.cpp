@@ -0,0 +1,255 @@
+#include "mesytec_event_sink.h"
+#include "mesytec_low_latency.h"
+#include "mesytec_mfm_frame.h"
+#include <iostream>
+#include <stdexcept>
+
+namespace mesytec
+{
+   event_fanout::event_fanout(const experimental_setup &_setup)
+      : setup{_setup}
+   {
+      /// \param[in] _setup description of crate given to sinks with each event (must outlive the fan-out)
+   }
+
+   event_fanout::~event_fanout()
+   {
+      stop();
+   }
+
+   void event_fanout::add_sink(std::unique_ptr<event_sink> sink, size_t queue_size, policy queue_policy)
+   {
+      /// \param[in] sink sink which will be given each event in its own thread
+      /// \param[in] queue_size maximum number of events waiting to be processed by the sink
+      /// \param[in] queue_policy what to do with a new event when the queue is full (see event_fanout)
+      ///
+      /// Sinks must be added before start().
+
+      if(running) throw std::logic_error("event_fanout: sinks must be added before start()");
+      if(!queue_size) throw std::invalid_argument("event_fanout: queue size must be > 0");
+      std::unique_ptr<sink_thread> s(new sink_thread);
+      s->sink = std::move(sink);
+      s->queue_policy = queue_policy;
+      s->queue.resize(queue_size);
+      sinks.push_back(std::move(s));
+   }
+
+   void event_fanout::start()
+   {
+      /// Start the thread of each sink. The event pool is large enough for all queues to be full while each sink
+      /// processes an event and the parser dispatches one more, so that dispatch() never waits for a free event.
+
+      if(running) return;
+      size_t pool_size = 1;
+      for(auto& s : sinks) pool_size += s->queue.size() + 1;
+      pool.reset(new event_pool(pool_size));
+      running = true;
+      for(auto& s : sinks)
+      {
+         s->stopping = false;
+         auto sp = s.get();
+         s->thread = std::thread([this, sp]{ run(*sp); });
+      }
+   }
+
+   void event_fanout::push(sink_thread &s, const event_pool::handle &ev)
+   {
+      std::unique_lock<std::mutex> lock(s.mutex);
+      if(s.count == s.queue.size())
+      {
+         switch(s.queue_policy)
+         {
+         case policy::block:
+            s.not_full.wait(lock, [&]{ return s.count < s.queue.size(); });
+            break;
+         case policy::drop_newest:
+            s.events_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+         case policy::drop_oldest:
+            s.queue[s.head].reset();
+            s.head = (s.head + 1) % s.queue.size();
+            --s.count;
+            s.events_dropped.fetch_add(1, std::memory_order_relaxed);
+            break;
+         }
+      }
+      s.queue[(s.head + s.count) % s.queue.size()] = ev;
+      ++s.count;
+      if(s.count > s.max_count) s.max_count = s.count;
+      lock.unlock();
+      s.not_empty.notify_one();
+   }
+
+   void event_fanout::dispatch(event &ev)
+   {
+      /// \param[in] ev event to give to all sinks
+      ///
+      /// The contents of the event are swapped with those of an (empty) event from the pool: after the call ev
+      /// has no module data. Its event counter and TGV timestamp are kept (as the MVLC parser only updates them for
+      /// events with an EOE or TGV data), so that every event published carries the same values as without fan-out.
+      ///
+      /// Only one thread must call dispatch().
+
+      if(!running) throw std::logic_error("event_fanout: dispatch() called before start()");
+      auto h = pool->acquire();
+      h->swap(ev);
+      ev.copy_counter_and_timestamp(*h);
+      for(auto& s : sinks) push(*s, h);
+   }
+
+   void event_fanout::run(sink_thread &s)
+   {
+      event_pool::handle ev;
+      while(1)
+      {
+         {
+            std::unique_lock<std::mutex> lock(s.mutex);
+            s.not_empty.wait(lock, [&]{ return s.stopping || s.count; });
+            // events still in the queue are processed before stopping
+            if(!s.count) break;
+            ev = std::move(s.queue[s.head]);
+            s.head = (s.head + 1) % s.queue.size();
+            --s.count;
+         }
+         s.not_full.notify_one();
+         try
+         {
+            s.sink->process(*ev, setup);
+         }
+         catch (std::exception& e)
+         {
+            if(!s.errors.fetch_add(1, std::memory_order_relaxed))
+               std::cerr << "event_fanout: sink " << s.sink->name() << " : " << e.what() << std::endl;
+         }
+         s.events_processed.fetch_add(1, std::memory_order_relaxed);
+         ev.reset();
+      }
+      try
+      {
+         s.sink->finish();
+      }
+      catch (std::exception& e)
+      {
+         std::cerr << "event_fanout: sink " << s.sink->name() << " : " << e.what() << std::endl;
+      }
+   }
+
+   void event_fanout::stop()
+   {
+      /// Wait for each sink to process the events in its queue, then stop the sink threads.
+
+      if(!running) return;
+      for(auto& s : sinks)
+      {
+         {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->stopping = true;
+         }
+         s->not_empty.notify_all();
+      }
+      for(auto& s : sinks) s->thread.join();
+      running = false;
+   }
+
+   bool event_fanout::set_sink_affinity(size_t i, int cpu)
+   {
+      /// \param[in] i index of sink (order of add_sink())
+      /// \param[in] cpu number of CPU on which the thread of the sink must run
+      /// \returns false if fan-out is not started or the affinity could not be set
+
+      if(!running || i >= sinks.size()) return false;
+      return set_thread_affinity(sinks[i]->thread, cpu);
+   }
+
+   size_t event_fanout::get_max_queue_depth(size_t i)
+   {
+      /// \returns largest number of events which were waiting in the queue of sink i
+
+      std::lock_guard<std::mutex> lock(sinks[i]->mutex);
+      return sinks[i]->max_count;
+   }
+
+   void event_fanout::print_statistics() const
+   {
+      for(auto& s : sinks)
+      {
+         std::cout << "[MESYTEC] : sink " << s->sink->name() << " (" << policy_name(s->queue_policy) << ") : "
+                   << s->events_processed.load(std::memory_order_relaxed) << " events processed, "
+                   << s->events_dropped.load(std::memory_order_relaxed) << " dropped";
+         if(auto errors = s->errors.load(std::memory_order_relaxed)) std::cout << ", " << errors << " errors";
+         std::cout << std::endl;
+      }
+   }
+
+   event_fanout::policy event_fanout::policy_from_string(const std::string &name)
+   {
+      /// \param[in] name "block", "drop_newest" or "drop_oldest"
+
+      if(name == "block") return policy::block;
+      if(name == "drop_newest") return policy::drop_newest;
+      if(name == "drop_oldest") return policy::drop_oldest;
+      throw std::invalid_argument("event_fanout: unknown queue policy '" + name + "' (use block, drop_newest or drop_oldest)");
+   }
+
+   std::string event_fanout::policy_name(policy p)
+   {
+      switch(p)
+      {
+      case policy::block:
+         return "block";
+      case policy::drop_newest:
+         return "drop_newest";
+      case policy::drop_oldest:
+         return "drop_oldest";
+      }
+      return "unknown";
+   }
+
+   void run_file_sink::process(const event &ev, const experimental_setup &)
+   {
+      const event* out = &ev;
+      if(suppression)
+      {
+         suppressed.copy_from(ev);
+         suppression->apply(suppressed);
+         if(!suppressed.has_data()) return;
+         out = &suppressed;
+      }
+      frame.resize(mfm_frame_size(*out));
+      auto size = write_mfm_frame(*out, frame.data());
+      writer.write(frame.data(), size);
+   }
+
+   stats_sink::stats_sink()
+   {
+      for(auto& w : module_words) w.store(0, std::memory_order_relaxed);
+      for(auto& e : module_events) e.store(0, std::memory_order_relaxed);
+   }
+
+   void stats_sink::process(const event &ev, const experimental_setup &)
+   {
+      // single writer: no need for atomic read-modify-write
+      events.store(events.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      for(auto& mod : ev.get_module_data())
+      {
+         auto id = mod.get_module_id();
+         module_events[id].store(module_events[id].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+         module_words[id].store(module_words[id].load(std::memory_order_relaxed) + mod.get_channel_data().size(),
+                                std::memory_order_relaxed);
+      }
+   }
+
+   void stats_sink::print(const experimental_setup &setup) const
+   {
+      auto n = get_events();
+      std::cout << "[MESYTEC] : " << n << " events";
+      setup.for_each_module([&](module& mod)
+      {
+         auto words = get_module_words(mod.id);
+         if(!words) return;
+         std::cout << ", " << mod.name << " " << 100.*get_module_events(mod.id)/n << "% ("
+                   << (double)words/get_module_events(mod.id) << " words)";
+      });
+      std::cout << std::endl;
+   }
+}
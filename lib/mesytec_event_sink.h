@@ -0,0 +1,199 @@
+#ifndef MESYTEC_EVENT_SINK_H
+#define MESYTEC_EVENT_SINK_H
+
+#include "mesytec_data.h"
+#include "mesytec_event_pool.h"
+#include "mesytec_experimental_setup.h"
+#include "mesytec_histogrammer.h"
+#include "mesytec_run_files.h"
+#include "mesytec_zero_suppression.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class event_sink
+      @brief consumer of parsed events running in its own thread (see event_fanout)
+    */
+   class event_sink
+   {
+   public:
+      virtual ~event_sink() = default;
+      /**
+         @return name of sink (used in statistics)
+       */
+      virtual std::string name() const = 0;
+      /**
+         called in the sink's thread for each event. The event is shared with the other sinks: it must not be
+         modified, and no reference to it must be kept after the call.
+       */
+      virtual void process(const event& ev, const experimental_setup& setup) = 0;
+      /**
+         called in the sink's thread after the last event (e.g. to flush files)
+       */
+      virtual void finish() {}
+   };
+
+   /**
+      @class event_fanout
+      @brief hand each parsed event to several sinks, each in its own thread
+
+      dispatch() is called by the parser thread with each event: the event's data is swapped into an event of an
+      event_pool (without copying or allocating), and a handle to it is pushed onto the queue of each sink. Each sink
+      thread takes events from its own queue, so that a slow sink does not hold back the others or the parser,
+      depending on the policy chosen for it when its queue is full:
+
+      | policy      | when queue is full |
+      |-------------|--------------------|
+      | block       | parser waits for room in the queue (no events lost, e.g. for writing run files) |
+      | drop_newest | new event is not given to the sink |
+      | drop_oldest | oldest event in the queue is dropped to make room for the new one (e.g. for online spectra) |
+
+      ~~~~{.cpp}
+      mesytec::event_fanout fanout(reader.get_setup());
+      fanout.add_sink(std::unique_ptr<mesytec::event_sink>(new mesytec::histogram_sink(histos)), 4096,
+                      mesytec::event_fanout::policy::drop_oldest);
+      fanout.add_sink(std::unique_ptr<mesytec::event_sink>(new mesytec::run_file_sink("run_12.dat")), 65536,
+                      mesytec::event_fanout::policy::block);
+      fanout.start();
+      reader.read_buffer_collate_events(buf, size, [&](mesytec::event& ev, mesytec::experimental_setup&){ fanout.dispatch(ev); });
+      fanout.stop();
+      ~~~~
+    */
+   class event_fanout
+   {
+   public:
+      enum class policy { block, drop_newest, drop_oldest };
+
+   private:
+      struct sink_thread
+      {
+         std::unique_ptr<event_sink> sink;
+         policy queue_policy;
+         std::vector<event_pool::handle> queue; // ring of queue.size() handles
+         size_t head{0};
+         size_t count{0};
+         size_t max_count{0};
+         bool stopping{false};
+         std::mutex mutex;
+         std::condition_variable not_empty;
+         std::condition_variable not_full;
+         std::atomic<uint64_t> events_processed{0};
+         std::atomic<uint64_t> events_dropped{0};
+         std::atomic<uint64_t> errors{0};
+         std::thread thread;
+      };
+
+      const experimental_setup& setup;
+      std::vector<std::unique_ptr<sink_thread>> sinks;
+      std::unique_ptr<event_pool> pool;
+      bool running{false};
+
+      void push(sink_thread& s, const event_pool::handle& ev);
+      void run(sink_thread& s);
+   public:
+      event_fanout(const experimental_setup& setup);
+      ~event_fanout();
+      event_fanout(const event_fanout&)=delete;
+      event_fanout& operator=(const event_fanout&)=delete;
+
+      void add_sink(std::unique_ptr<event_sink> sink, size_t queue_size = 1024, policy queue_policy = policy::drop_newest);
+      void start();
+      void dispatch(event& ev);
+      void stop();
+      bool set_sink_affinity(size_t i, int cpu);
+
+      size_t number_of_sinks() const { return sinks.size(); }
+      std::string get_sink_name(size_t i) const { return sinks[i]->sink->name(); }
+      policy get_sink_policy(size_t i) const { return sinks[i]->queue_policy; }
+      uint64_t get_events_processed(size_t i) const { return sinks[i]->events_processed.load(std::memory_order_relaxed); }
+      /**
+         @return number of events not given to the sink because its queue was full
+       */
+      uint64_t get_events_dropped(size_t i) const { return sinks[i]->events_dropped.load(std::memory_order_relaxed); }
+      /**
+         @return number of events for which the sink threw an exception
+       */
+      uint64_t get_errors(size_t i) const { return sinks[i]->errors.load(std::memory_order_relaxed); }
+      size_t get_queue_size(size_t i) const { return sinks[i]->queue.size(); }
+      size_t get_max_queue_depth(size_t i);
+
+      void print_statistics() const;
+
+      static policy policy_from_string(const std::string& name);
+      static std::string policy_name(policy p);
+   };
+
+   /**
+      @class histogram_sink
+      @brief fill online spectra in a sink thread
+    */
+   class histogram_sink : public event_sink
+   {
+      histogrammer& histos;
+   public:
+      histogram_sink(histogrammer& h) : histos{h} {}
+      std::string name() const override { return "histograms"; }
+      void process(const event& ev, const experimental_setup&) override { histos.fill(ev); }
+   };
+
+   /**
+      @class run_file_sink
+      @brief write events as MFM frames (revision 1) in the files of a run, like zmq_receiver does
+
+      The last frames are written when the sink is destroyed (i.e. with the event_fanout).
+
+      If zero suppression is set, it is applied to a copy of each event before writing it (the shared event is
+      not modified, so other sinks such as histogram_sink still see all data), and events left without data
+      are not written.
+    */
+   class run_file_sink : public event_sink
+   {
+      mfm_run_writer writer;
+      std::vector<uint8_t> frame;
+      std::unique_ptr<zero_suppression> suppression;
+      event suppressed;
+   public:
+      run_file_sink(const std::string& first_file, uint64_t max_file_size = 1024*1024*1024)
+         : writer(first_file, max_file_size)
+      {}
+      /**
+         @param zs zero suppression to apply before writing: a copy is kept, so that its counters are only
+                   updated by the thread of this sink
+       */
+      void set_zero_suppression(const zero_suppression& zs) { suppression.reset(new zero_suppression(zs)); }
+      std::string name() const override { return "run_file"; }
+      void process(const event& ev, const experimental_setup&) override;
+   };
+
+   /**
+      @class stats_sink
+      @brief count events, and data words for each module
+
+      print() can be called from another thread: counters are read with relaxed atomic loads.
+    */
+   class stats_sink : public event_sink
+   {
+      std::atomic<uint64_t> events{0};
+      std::array<std::atomic<uint64_t>, 256> module_words;
+      std::array<std::atomic<uint64_t>, 256> module_events;
+   public:
+      stats_sink();
+      std::string name() const override { return "stats"; }
+      void process(const event& ev, const experimental_setup&) override;
+      uint64_t get_events() const { return events.load(std::memory_order_relaxed); }
+      uint64_t get_module_words(uint8_t mod_id) const { return module_words[mod_id].load(std::memory_order_relaxed); }
+      uint64_t get_module_events(uint8_t mod_id) const { return module_events[mod_id].load(std::memory_order_relaxed); }
+      void print(const experimental_setup& setup) const;
+   };
+}
+
+#endif // MESYTEC_EVENT_SINK_H
@@ -0,0 +1,64 @@
+#include "mesytec_event_topic.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace mesytec
+{
+   event_topic::event_topic(const experimental_setup &setup)
+   {
+      /// \param[in] setup crate map used to number modules in presence mask & identify scaler modules
+
+      module_bit.fill(-1);
+      scaler_module.fill(false);
+      int bit = 0;
+      setup.for_each_module([&](module& mod){
+         if(mod.is_mvlc_scaler()) scaler_module[mod.id] = true;
+         if(mod.is_tgv_module() || bit == max_modules) return;
+         module_bit[mod.id] = bit++;
+      });
+   }
+
+   size_t event_topic::encode(const event &ev, uint8_t *topic) const
+   {
+      /// \param[in] ev event to describe
+      /// \param[out] topic must hold at least event_topic::size bytes
+      /// \returns size of topic in bytes
+
+      memset(topic, 0, size);
+      uint8_t cls = physics;
+      for(auto& mod : ev.get_module_data())
+      {
+         auto id = mod.get_module_id();
+         if(scaler_module[id]) cls = scaler;
+         auto b = module_bit[id];
+         if(b >= 0) topic[1 + b/8] |= 1 << (b%8);
+      }
+      topic[0] = cls;
+      return size;
+   }
+
+   std::string event_topic::subscription(const std::string &spec)
+   {
+      /// \param[in] spec "physics", "scaler", "all" (or empty), or the bytes of a topic prefix in hexadecimal (e.g. "0x5003")
+      /// \returns topic prefix to subscribe to
+      ///
+      /// Throws std::invalid_argument for any other spec.
+
+      if(spec.empty() || spec == "all") return "";
+      if(spec == "physics") return std::string(1, (char)physics);
+      if(spec == "scaler") return std::string(1, (char)scaler);
+      if(spec.size() > 2 && spec.size() % 2 == 0 && spec.compare(0, 2, "0x") == 0)
+      {
+         std::string prefix;
+         for(size_t i = 2; i < spec.size(); i += 2)
+         {
+            size_t n;
+            auto byte = std::stoi(spec.substr(i, 2), &n, 16);
+            if(n != 2) break;
+            prefix.push_back((char)byte);
+         }
+         if(prefix.size() == (spec.size() - 2)/2 && prefix.size() <= size) return prefix;
+      }
+      throw std::invalid_argument("event_topic: bad subscription '" + spec + "' (use physics, scaler, all or hexadecimal topic bytes 0x...)");
+   }
+}
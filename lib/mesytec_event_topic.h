@@ -0,0 +1,74 @@
+#ifndef MESYTEC_EVENT_TOPIC_H
+#define MESYTEC_EVENT_TOPIC_H
+
+#include "mesytec_data.h"
+#include "mesytec_experimental_setup.h"
+#include <array>
+#include <cstdint>
+#include <string>
+
+namespace mesytec
+{
+   /**
+      @class event_topic
+      @brief compact binary topic describing an event, for subscription filtering by ZMQ publishers
+
+      When the transmitter is run with `--topics`, each MFM frame is published as a 2-part message
+      [topic][frame], and subscribers which subscribe to a topic prefix only receive (and the publisher only
+      sends them) the matching events. The topic has event_topic::size bytes:
+
+      | byte | content |
+      |------|---------|
+      | 0    | event class: 'P' (physics) or 'S' (scaler: event contains MVLC scaler data) |
+      | 1-8  | module presence mask: bit i of byte 1+i/8 is set if the event contains data from module i |
+
+      Modules are numbered in the order in which they appear in the crate map, up to max_modules (TGV modules,
+      whose data is not stored as module data, are not numbered).
+
+      Subscriptions are prefixes: subscribing to "P" gives all physics events, "S" all scaler events,
+      "" everything. As the mask only follows the class byte, subscribing to a mask only selects events with
+      exactly the given modules (in the bytes of the mask given in the subscription). Consumers can also test the
+      mask of each received topic with has_module(), without decoding the frame.
+
+      ~~~~{.cpp}
+      mesytec::event_topic topics(setup);
+      uint8_t topic[mesytec::event_topic::size];
+      topics.encode(event, topic);
+
+      \// subscriber
+      socket.set(zmq::sockopt::subscribe, mesytec::event_topic::subscription("physics"));
+      ~~~~
+    */
+   class event_topic
+   {
+   public:
+      enum event_class : uint8_t { physics = 'P', scaler = 'S' };
+      static const size_t size = 9;
+      static const int max_modules = 64;
+
+   private:
+      std::array<int8_t, 256> module_bit;    // -1 for modules not in mask
+      std::array<bool, 256> scaler_module;
+
+   public:
+      event_topic(const experimental_setup& setup);
+
+      size_t encode(const event& ev, uint8_t* topic) const;
+      /**
+         @return index of module with given address in the presence mask (-1 if not in mask)
+       */
+      int get_module_bit(uint8_t mod_id) const { return module_bit[mod_id]; }
+
+      static event_class get_class(const uint8_t* topic) { return (event_class)topic[0]; }
+      /**
+         @return true if presence mask of topic has bit for module number mod_bit (see get_module_bit())
+       */
+      static bool has_module(const uint8_t* topic, int mod_bit)
+      {
+         return mod_bit >= 0 && mod_bit < max_modules && (topic[1 + mod_bit/8] & (1 << (mod_bit%8)));
+      }
+      static std::string subscription(const std::string& spec);
+   };
+}
+
+#endif // MESYTEC_EVENT_TOPIC_H
@@ -62,6 +62,14 @@ namespace mesytec
        */
       module& get_module(uint8_t mod_id) const { return crate_map[mod_id]; }
 
+      /**
+         @brief find_module
+         @param mod_id HW address of module in crate
+         @return pointer to module with given HW address, or nullptr if there is none (no exception is thrown,
+                 for use when decoding data which may be corrupted)
+       */
+      module* find_module(uint8_t mod_id) const { return crate_map.find_object(mod_id); }
+
       /**
          @brief number_of_modules
          @return total number of modules in crate (including dummy modules corresponding to `MVLC_SCALER` data)
@@ -83,7 +91,7 @@ namespace mesytec
        */
       void set_detector_module_channel(uint8_t modid, uint8_t nchan, const std::string& detname)
       {
-         get_module(modid)[0][nchan]=detname;
+         get_module(modid)[0].set_detector(nchan,detname);
       }
 
       /**
@@ -99,7 +107,7 @@ namespace mesytec
        */
       void set_detector_module_bus_channel(uint8_t modid, uint8_t nbus, uint8_t nchan, const std::string& detname)
       {
-         get_module(modid)[nbus][nchan]=detname;
+         get_module(modid)[nbus].set_detector(nchan,detname);
       }
 
       /**
@@ -123,6 +131,26 @@ namespace mesytec
       {
          return get_module(modid)[nbus][nchan];
       }
+      /**
+         @brief has_detector
+         @param modid HW address of module in crate
+         @param nbus bus number (0 for MDPP modules)
+         @param nchan channel number
+         @return true if a detector was associated with module, bus & channel number
+       */
+      bool has_detector(uint8_t modid, uint8_t nbus, uint8_t nchan) const
+      {
+         return has_module(modid) && nbus<get_module(modid).get_number_of_buses() && get_module(modid)[nbus].has_detector(nchan);
+      }
+      /**
+         @brief for_each_module
+         @param F function to call for each module in the crate, with signature `void F(mesytec::module&)`
+       */
+      template<typename Function>
+      void for_each_module(Function F) const
+      {
+         for(auto& mod : crate_map) F(mod);
+      }
       void print();
    };
 }
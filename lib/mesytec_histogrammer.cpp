@@ -0,0 +1,429 @@
+#include "mesytec_histogrammer.h"
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mesytec
+{
+   namespace
+   {
+      const char histogram_file_magic[8] = {'M','E','S','Y','H','I','S','T'};
+      const uint32_t histogram_file_version = 1;
+
+      uint32_t round_up_power_of_two(uint32_t n)
+      {
+         uint32_t p=1;
+         while(p<n) p<<=1;
+         return p;
+      }
+      uint8_t number_of_bits(uint32_t n)
+      {
+         // n is a power of 2
+         uint8_t b=0;
+         while(n>1) { n>>=1; ++b; }
+         return b;
+      }
+      uint8_t range_in_bits(const module& mod, module::datatype_t type)
+      {
+         // VMMR ADC values are 12 bits, all others 16 bits
+         return (mod.is_vmmr_module() && type==module::ADC) ? 12 : 16;
+      }
+      uint8_t shift_for_bins(uint8_t range_bits, uint32_t nbins)
+      {
+         auto b = number_of_bits(nbins);
+         return range_bits>b ? range_bits-b : 0;
+      }
+   }
+
+   histogrammer::histogrammer(const experimental_setup &_setup, uint32_t nbins)
+      : setup{&_setup}, nbins_1d{round_up_power_of_two(nbins)}
+   {
+      /// \param[in] _setup description of crate & detectors. must remain valid for the lifetime of the histogrammer.
+      /// \param[in] nbins number of bins for 1D spectra (rounded up to a power of 2)
+      ///
+      /// Creates one 1D spectrum for each detector in the setup & for each type of data it can produce.
+
+      module_base.fill(-1);
+      module_buses.fill(0);
+      module_channels.fill(0);
+      module_is_vmmr.fill(false);
+
+      setup->for_each_module([&](module& mod)
+      {
+         std::vector<module::datatype_t> types;
+         if(mod.firmware==MDPP_QDC)
+            types = {module::QDC_long, module::QDC_short, module::TDC, module::Trigger_time};
+         else if(mod.firmware==MDPP_SCP || mod.firmware==MDPP_CSI)
+            types = {module::ADC, module::TDC, module::Trigger_time};
+         else if(mod.is_vmmr_module())
+            types = {module::ADC};
+         else
+            return; // no spectra for TGV, MVLC scalers, etc.
+
+         auto nbus = mod.get_number_of_buses();
+         auto nchan = mod[0].get_number_of_channels();
+         module_base[mod.id] = spectrum_lut.size();
+         module_buses[mod.id] = nbus;
+         module_channels[mod.id] = nchan;
+         module_is_vmmr[mod.id] = mod.is_vmmr_module();
+         spectrum_lut.resize(spectrum_lut.size() + nbus*nchan*number_of_data_types, -1);
+
+         for(int b=0; b<nbus; ++b)
+         {
+            bool bus_has_detector=false;
+            for(size_t c=0; c<nchan; ++c)
+            {
+               if(!mod[b].has_detector(c)) continue;
+               bus_has_detector=true;
+               for(auto t : types) add_spectrum(mod[b][c], mod, b, c, t);
+            }
+            // VMMR TDC data has no subaddress: one spectrum per bus
+            if(mod.is_vmmr_module() && bus_has_detector)
+               add_spectrum(mod.name + "_bus_" + std::to_string(b), mod, b, 0, module::TDC);
+         }
+      });
+      slot_of_spectrum.assign(spectra.size(), -1);
+      allocate_bins();
+   }
+
+   histogrammer::~histogrammer()
+   {
+      close_snapshot_file();
+   }
+
+   void histogrammer::add_spectrum(const std::string &name, const module &mod, uint8_t bus, uint8_t chan, module::datatype_t type)
+   {
+      histogram_descriptor d;
+      memset(&d, 0, sizeof(d));
+      std::string full_name = name + "_" + mod.get_data_type_name(type);
+      strncpy(d.name, full_name.c_str(), sizeof(d.name)-1);
+      d.module_id = mod.id;
+      d.bus = bus;
+      d.channel = chan;
+      d.dimension = 1;
+      d.data_type_x = type;
+      d.shift_x = shift_for_bins(range_in_bits(mod,type), nbins_1d);
+      d.nbins_x = nbins_1d;
+      d.nbins_y = 1;
+
+      spectrum_lut[module_base[mod.id] + (bus*module_channels[mod.id] + chan)*number_of_data_types + type] = spectra.size();
+      spectra.push_back(d);
+   }
+
+   void histogrammer::allocate_bins()
+   {
+      // (re)allocate storage for all bins, keeping any existing contents
+
+      std::vector<size_t> new_first_bin;
+      size_t n=0;
+      for(auto& d : spectra)
+      {
+         new_first_bin.push_back(n);
+         n += d.nbins_x*d.nbins_y;
+      }
+      std::unique_ptr<std::atomic<uint32_t>[]> new_bins{new std::atomic<uint32_t>[n]};
+      for(size_t i=0; i<n; ++i) new_bins[i].store(0, std::memory_order_relaxed);
+      for(size_t s=0; s<first_bin.size(); ++s)
+      {
+         auto nb = spectra[s].nbins_x*spectra[s].nbins_y;
+         for(size_t i=0; i<nb; ++i)
+            new_bins[new_first_bin[s]+i].store(bins[first_bin[s]+i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      }
+      bins = std::move(new_bins);
+      first_bin = std::move(new_first_bin);
+      total_bins = n;
+      // any previously mapped snapshot file no longer has the right layout
+      close_snapshot_file();
+   }
+
+   void histogrammer::add_2d(const std::string &det_x, module::datatype_t type_x, const std::string &det_y, module::datatype_t type_y, uint32_t nbins)
+   {
+      /// \param[in] det_x,type_x detector name & type of data for x-axis
+      /// \param[in] det_y,type_y detector name & type of data for y-axis
+      /// \param[in] nbins number of bins on each axis (rounded up to a power of 2)
+      ///
+      /// Add a 2D spectrum of the correlation between two detectors in the same event.
+      /// For VMMR TDC data, the detector name is `[module name]_bus_[bus number]`.
+      ///
+      /// \warning must not be called while other threads are calling fill()
+      ///
+      /// Throws std::runtime_error if either detector/type has no 1D spectrum.
+
+      auto sx = find_spectrum(det_x, type_x);
+      auto sy = find_spectrum(det_y, type_y);
+      if(sx<0 || sy<0)
+         throw std::runtime_error("histogrammer::add_2d : no spectrum for " + (sx<0 ? det_x : det_y));
+
+      nbins = round_up_power_of_two(nbins);
+      auto nbits_x = number_of_bits(spectra[sx].nbins_x) + spectra[sx].shift_x;
+      auto nbits_y = number_of_bits(spectra[sy].nbins_x) + spectra[sy].shift_x;
+
+      histogram_descriptor d;
+      memset(&d, 0, sizeof(d));
+      std::string full_name = std::string(spectra[sx].name) + "_vs_" + spectra[sy].name;
+      strncpy(d.name, full_name.c_str(), sizeof(d.name)-1);
+      d.module_id = spectra[sx].module_id;
+      d.bus = spectra[sx].bus;
+      d.channel = spectra[sx].channel;
+      d.dimension = 2;
+      d.data_type_x = type_x;
+      d.data_type_y = type_y;
+      d.shift_x = shift_for_bins(nbits_x, nbins);
+      d.shift_y = shift_for_bins(nbits_y, nbins);
+      d.nbins_x = nbins;
+      d.nbins_y = nbins;
+
+      for(auto s : {sx, sy})
+         if(slot_of_spectrum[s]<0) slot_of_spectrum[s] = number_of_slots++;
+      pairs.push_back({slot_of_spectrum[sx], slot_of_spectrum[sy], spectra.size()});
+      spectra.push_back(d);
+      slot_of_spectrum.push_back(-1);
+      allocate_bins();
+   }
+
+   void histogrammer::fill(const event &ev)
+   {
+      /// Increment spectra with all data in event. Thread-safe.
+
+      static thread_local std::vector<int32_t> values_2d;
+      if(number_of_slots) values_2d.assign(number_of_slots, -1);
+
+      for(auto& md : ev.get_module_data())
+      {
+         auto id = md.get_module_id();
+         auto base = module_base[id];
+         if(base<0) continue;
+         auto& mod = setup->get_module(id);
+         auto nbus = module_buses[id];
+         auto nchan = module_channels[id];
+         bool vmmr = module_is_vmmr[id];
+         for(auto& cd : md.get_channel_data())
+         {
+            auto w = cd.get_data_word();
+            if(vmmr ? !is_vmmr_data(w) : !is_mdpp_data(w)) continue;
+            auto b = mod.get_bus_number(w);
+            auto c = mod.get_channel_number(w);
+            if(b>=nbus || c>=nchan) continue;
+            auto s = spectrum_lut[base + (b*nchan + c)*number_of_data_types + mod.get_data_type(w)];
+            if(s<0) continue;
+            auto v = mod.get_channel_data(w);
+            bins[first_bin[s] + (v >> spectra[s].shift_x)].fetch_add(1, std::memory_order_relaxed);
+            if(number_of_slots && slot_of_spectrum[s]>-1) values_2d[slot_of_spectrum[s]] = v;
+         }
+      }
+      for(auto& p : pairs)
+      {
+         auto vx = values_2d[p.slot_x];
+         auto vy = values_2d[p.slot_y];
+         if(vx<0 || vy<0) continue;
+         auto& d = spectra[p.spectrum];
+         bins[first_bin[p.spectrum] + (vy >> d.shift_y)*d.nbins_x + (vx >> d.shift_x)].fetch_add(1, std::memory_order_relaxed);
+      }
+      events_filled.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   void histogrammer::reset()
+   {
+      /// Set all bins of all spectra to zero
+      for(size_t i=0; i<total_bins; ++i) bins[i].store(0, std::memory_order_relaxed);
+      events_filled.store(0, std::memory_order_relaxed);
+   }
+
+   int histogrammer::find_spectrum(const std::string &name) const
+   {
+      /// \returns index of spectrum with given full name (e.g. "PISTA_E_4_adc"), or -1 if not found
+      for(size_t s=0; s<spectra.size(); ++s)
+         if(name == spectra[s].name) return s;
+      return -1;
+   }
+
+   int histogrammer::find_spectrum(const std::string &detector, module::datatype_t type) const
+   {
+      /// \returns index of 1D spectrum for given detector & data type, or -1 if not found
+      for(size_t s=0; s<spectra.size(); ++s)
+      {
+         auto& d = spectra[s];
+         if(d.dimension!=1 || d.data_type_x!=type) continue;
+         auto& mod = setup->get_module(d.module_id);
+         std::string det = (mod.is_vmmr_module() && type==module::TDC)
+               ? mod.name + "_bus_" + std::to_string(d.bus) : mod[d.bus][d.channel];
+         if(det == detector) return s;
+      }
+      return -1;
+   }
+
+   module::datatype_t histogrammer::data_type_from_name(const std::string &name)
+   {
+      /// \returns data type corresponding to one of the names "adc", "tdc", "trig", "qdc_long", "qdc_short"
+      /// (or any aliases defined with module::set_data_type_alias()). Returns module::unknown for anything else.
+      module any_module;
+      for(auto t : {module::ADC, module::TDC, module::QDC_long, module::QDC_short, module::Trigger_time})
+         if(name == any_module.get_data_type_name(t)) return t;
+      static const std::map<std::string,module::datatype_t> defaults
+            = {{"adc",module::ADC},{"tdc",module::TDC},{"trig",module::Trigger_time},
+               {"qdc_long",module::QDC_long},{"qdc_short",module::QDC_short}};
+      auto it = defaults.find(name);
+      return it==defaults.end() ? module::unknown : it->second;
+   }
+
+   void histogrammer::open_snapshot_file(const std::string &filename)
+   {
+      close_snapshot_file();
+
+      size_t header_size = sizeof(histogram_file_header) + spectra.size()*sizeof(histogram_descriptor);
+      // align bins on 8 bytes
+      header_size = (header_size+7) & ~size_t(7);
+      snapshot_bins_offset = header_size;
+      snapshot_size = header_size + total_bins*sizeof(uint32_t);
+
+      snapshot_fd = ::open(filename.c_str(), O_RDWR|O_CREAT, 0644);
+      if(snapshot_fd<0)
+         throw std::runtime_error("histogrammer::snapshot : failed to open " + filename + " : " + strerror(errno));
+      if(ftruncate(snapshot_fd, snapshot_size)<0)
+      {
+         std::string err = strerror(errno);
+         close_snapshot_file();
+         throw std::runtime_error("histogrammer::snapshot : failed to resize " + filename + " : " + err);
+      }
+      void* m = mmap(nullptr, snapshot_size, PROT_READ|PROT_WRITE, MAP_SHARED, snapshot_fd, 0);
+      if(m==MAP_FAILED)
+      {
+         std::string err = strerror(errno);
+         close_snapshot_file();
+         throw std::runtime_error("histogrammer::snapshot : failed to map " + filename + " : " + err);
+      }
+      snapshot_map = reinterpret_cast<uint8_t*>(m);
+      snapshot_file = filename;
+
+      auto hdr = reinterpret_cast<histogram_file_header*>(snapshot_map);
+      memcpy(hdr->magic, histogram_file_magic, sizeof(hdr->magic));
+      hdr->version = histogram_file_version;
+      hdr->number_of_spectra = spectra.size();
+      hdr->snapshot_time = 0;
+      hdr->events_filled = 0;
+      __atomic_store_n(&hdr->sequence, 0, __ATOMIC_RELEASE);
+
+      auto desc = reinterpret_cast<histogram_descriptor*>(snapshot_map + sizeof(histogram_file_header));
+      for(size_t s=0; s<spectra.size(); ++s)
+      {
+         desc[s] = spectra[s];
+         desc[s].offset = header_size + first_bin[s]*sizeof(uint32_t);
+      }
+   }
+
+   void histogrammer::close_snapshot_file()
+   {
+      if(snapshot_map) munmap(snapshot_map, snapshot_size);
+      if(snapshot_fd>-1) ::close(snapshot_fd);
+      snapshot_map = nullptr;
+      snapshot_fd = -1;
+      snapshot_size = 0;
+      snapshot_file.clear();
+   }
+
+   void histogrammer::snapshot(const std::string &filename)
+   {
+      /// \param[in] filename path to snapshot file, e.g. in `/dev/shm`
+      ///
+      /// Copy current contents of all spectra into the memory-mapped file. The file is created
+      /// (or resized) on first call and kept mapped for subsequent calls. Can be called while
+      /// other threads are calling fill().
+      ///
+      /// Throws std::runtime_error if the file cannot be created/mapped.
+
+      if(!snapshot_map || filename!=snapshot_file) open_snapshot_file(filename);
+
+      auto hdr = reinterpret_cast<histogram_file_header*>(snapshot_map);
+      auto seq = __atomic_load_n(&hdr->sequence, __ATOMIC_RELAXED);
+      __atomic_store_n(&hdr->sequence, seq+1, __ATOMIC_RELAXED); // odd: snapshot in progress
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+
+      auto dest = reinterpret_cast<uint32_t*>(snapshot_map + snapshot_bins_offset);
+      for(size_t i=0; i<total_bins; ++i) dest[i] = bins[i].load(std::memory_order_relaxed);
+
+      hdr->events_filled = events_filled.load(std::memory_order_relaxed);
+      hdr->snapshot_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+      __atomic_store_n(&hdr->sequence, seq+2, __ATOMIC_RELEASE);   // even: snapshot complete
+   }
+
+   histogram_snapshot_reader::histogram_snapshot_reader(const std::string &filename)
+   {
+      /// Throws std::runtime_error if the file cannot be opened or is not a histogrammer snapshot (including if
+      /// the descriptors of the spectra do not fit in the file, e.g. truncated file)
+
+      fd = ::open(filename.c_str(), O_RDONLY);
+      if(fd<0)
+         throw std::runtime_error("histogram_snapshot_reader : failed to open " + filename + " : " + strerror(errno));
+      struct stat st;
+      fstat(fd, &st);
+      map_size = st.st_size;
+      if(map_size<sizeof(histogram_file_header))
+      {
+         ::close(fd);
+         throw std::runtime_error("histogram_snapshot_reader : " + filename + " is not a snapshot file");
+      }
+      void* m = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(m==MAP_FAILED)
+      {
+         ::close(fd);
+         throw std::runtime_error("histogram_snapshot_reader : failed to map " + filename + " : " + strerror(errno));
+      }
+      map = reinterpret_cast<const uint8_t*>(m);
+      bool ok = !memcmp(header()->magic, histogram_file_magic, sizeof(histogram_file_magic)) && header()->version==histogram_file_version
+            && header()->number_of_spectra <= (map_size - sizeof(histogram_file_header))/sizeof(histogram_descriptor);
+      for(size_t s=0; ok && s<number_of_spectra(); ++s)
+      {
+         // bins and (null-terminated) name of each spectrum must be inside the file
+         auto& d = get_descriptor(s);
+         uint64_t nbins = (uint64_t)d.nbins_x*d.nbins_y;
+         ok = memchr(d.name, 0, sizeof(d.name)) && d.offset <= map_size && nbins <= (map_size - d.offset)/sizeof(uint32_t);
+      }
+      if(!ok)
+      {
+         munmap(const_cast<uint8_t*>(map), map_size);
+         ::close(fd);
+         throw std::runtime_error("histogram_snapshot_reader : " + filename + " is not a snapshot file");
+      }
+   }
+
+   histogram_snapshot_reader::~histogram_snapshot_reader()
+   {
+      munmap(const_cast<uint8_t*>(map), map_size);
+      ::close(fd);
+   }
+
+   int histogram_snapshot_reader::find_spectrum(const std::string &name) const
+   {
+      /// \returns index of spectrum with given full name, or -1 if not found
+      for(size_t s=0; s<number_of_spectra(); ++s)
+         if(name == get_descriptor(s).name) return s;
+      return -1;
+   }
+
+   bool histogram_snapshot_reader::read(size_t spectrum, std::vector<uint32_t> &bins, int max_tries) const
+   {
+      /// Copy bin contents of spectrum into vector.
+      ///
+      /// \returns false if no consistent copy could be made after max_tries attempts
+      /// (i.e. snapshots are being written continuously)
+
+      auto& d = get_descriptor(spectrum);
+      size_t nbins = (size_t)d.nbins_x*d.nbins_y;
+      bins.resize(nbins);
+      auto src = reinterpret_cast<const uint32_t*>(map + d.offset);
+      while(max_tries--)
+      {
+         auto seq = __atomic_load_n(&header()->sequence, __ATOMIC_ACQUIRE);
+         if(seq & 1) continue;
+         memcpy(bins.data(), src, nbins*sizeof(uint32_t));
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         if(__atomic_load_n(&header()->sequence, __ATOMIC_RELAXED)==seq) return true;
+      }
+      return false;
+   }
+}
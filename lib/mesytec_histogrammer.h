@@ -0,0 +1,194 @@
+#ifndef MESYTEC_HISTOGRAMMER_H
+#define MESYTEC_HISTOGRAMMER_H
+
+#include "mesytec_data.h"
+#include "mesytec_experimental_setup.h"
+#include <atomic>
+#include <memory>
+#include <array>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @struct histogram_file_header
+      @brief layout of the beginning of a snapshot file written by histogrammer::snapshot()
+
+      The file contains (in this order):
+        + one histogram_file_header
+        + number_of_spectra x histogram_descriptor
+        + the bin contents (uint32_t) of all spectra, at the offsets given in each descriptor
+
+      The `sequence` counter is odd while a snapshot is being written and even once it is complete.
+      Readers copy the bins they need and retry if `sequence` was odd or changed during the copy
+      (see histogram_snapshot_reader), so the file can be read at any time without stopping acquisition.
+    */
+   struct histogram_file_header
+   {
+      char magic[8];             ///< "MESYHIST"
+      uint32_t version;
+      uint32_t number_of_spectra;
+      uint64_t sequence;         ///< odd while snapshot in progress
+      uint64_t snapshot_time;    ///< unix time of last snapshot [ns]
+      uint64_t events_filled;    ///< total number of events filled at time of snapshot
+   };
+
+   /**
+      @struct histogram_descriptor
+      @brief description of one spectrum in a snapshot file
+
+      For 1D spectra, bin content for value `v` is at `bins[v >> shift_x]`.
+      For 2D spectra, `(vx,vy)` is at `bins[(vy >> shift_y)*nbins_x + (vx >> shift_x)]`.
+    */
+   struct histogram_descriptor
+   {
+      char name[64];
+      uint8_t module_id;
+      uint8_t bus;
+      uint8_t channel;
+      uint8_t dimension;         ///< 1 or 2
+      uint8_t data_type_x;       ///< module::datatype_t of x-axis
+      uint8_t data_type_y;       ///< module::datatype_t of y-axis (2D only)
+      uint8_t shift_x;
+      uint8_t shift_y;
+      uint32_t nbins_x;
+      uint32_t nbins_y;          ///< 1 for 1D spectra
+      uint64_t offset;           ///< offset in bytes of first bin from beginning of file
+   };
+
+   /**
+      @class histogrammer
+      @brief online spectra for all detectors of an experimental_setup
+
+      One 1D spectrum is created for each detector declared with experimental_setup::read_detector_correspondence()
+      and for each type of data the module firmware can produce (ADC, TDC, QDC_long, QDC_short, Trigger_time).
+      For VMMR modules, TDC data has no subaddress: one TDC spectrum per bus is created for each bus with at least
+      one detector. 2D spectra for pairs of detectors can be added with add_2d() before filling begins.
+
+      fill() can be called concurrently from several parser threads: bins are incremented with relaxed atomic
+      operations. Spectra are regularly copied with snapshot() into a memory-mapped file which monitoring
+      programs can read (see histogram_snapshot_reader) without disturbing acquisition.
+
+      ~~~~{.cpp}
+      mesytec::histogrammer histos(reader.get_setup());
+      histos.add_2d("PISTA_DE_2_1", mesytec::module::ADC, "PISTA_E_4", mesytec::module::ADC);
+      reader.read_event_in_buffer(buf, nbytes,
+                                  [&](mesytec::event& ev, mesytec::experimental_setup&){ histos.fill(ev); });
+      histos.snapshot("/dev/shm/mesytec_spectra");
+      ~~~~
+    */
+   class histogrammer
+   {
+      static const int number_of_data_types = module::Trigger_time+1;
+
+      struct pair_2d
+      {
+         int slot_x, slot_y;
+         size_t spectrum;
+      };
+
+      const experimental_setup* setup;
+      uint32_t nbins_1d;
+      std::vector<histogram_descriptor> spectra;
+      std::vector<size_t> first_bin;
+      std::unique_ptr<std::atomic<uint32_t>[]> bins;
+      size_t total_bins{0};
+      std::atomic<uint64_t> events_filled{0};
+
+      // lookup of spectrum index for (module, bus, channel, data type)
+      std::array<int32_t,256> module_base;
+      std::array<uint16_t,256> module_buses;
+      std::array<uint16_t,256> module_channels;
+      std::array<bool,256> module_is_vmmr;
+      std::vector<int32_t> spectrum_lut;
+
+      // 2D spectra
+      std::vector<int32_t> slot_of_spectrum;
+      int number_of_slots{0};
+      std::vector<pair_2d> pairs;
+
+      // snapshot file
+      std::string snapshot_file;
+      int snapshot_fd{-1};
+      uint8_t* snapshot_map{nullptr};
+      size_t snapshot_size{0};
+      size_t snapshot_bins_offset{0};
+
+      void add_spectrum(const std::string& name, const module& mod, uint8_t bus, uint8_t chan, module::datatype_t type);
+      void allocate_bins();
+      void open_snapshot_file(const std::string& filename);
+      void close_snapshot_file();
+
+   public:
+      histogrammer(const experimental_setup& setup, uint32_t nbins=1024);
+      ~histogrammer();
+      histogrammer(const histogrammer&)=delete;
+      histogrammer& operator=(const histogrammer&)=delete;
+
+      void add_2d(const std::string& det_x, module::datatype_t type_x,
+                  const std::string& det_y, module::datatype_t type_y, uint32_t nbins=256);
+      void fill(const event& ev);
+      void reset();
+      void snapshot(const std::string& filename);
+
+      /**
+         @return total number of (1D and 2D) spectra
+       */
+      size_t number_of_spectra() const { return spectra.size(); }
+      /**
+         @return description of spectrum with given index
+       */
+      const histogram_descriptor& get_descriptor(size_t spectrum) const { return spectra[spectrum]; }
+      /**
+         @return current content of bin of given spectrum
+       */
+      uint32_t get_bin(size_t spectrum, uint32_t binx, uint32_t biny=0) const
+      {
+         return bins[first_bin[spectrum] + biny*spectra[spectrum].nbins_x + binx].load(std::memory_order_relaxed);
+      }
+      /**
+         @return number of events filled since construction or last reset()
+       */
+      uint64_t get_events_filled() const { return events_filled.load(std::memory_order_relaxed); }
+      int find_spectrum(const std::string& name) const;
+      int find_spectrum(const std::string& detector, module::datatype_t type) const;
+
+      static module::datatype_t data_type_from_name(const std::string& name);
+   };
+
+   /**
+      @class histogram_snapshot_reader
+      @brief read-only access to a snapshot file written by histogrammer::snapshot()
+
+      ~~~~{.cpp}
+      mesytec::histogram_snapshot_reader spectra("/dev/shm/mesytec_spectra");
+      std::vector<uint32_t> bins;
+      int i = spectra.find_spectrum("PISTA_E_4_adc");
+      if(i>-1 && spectra.read(i, bins)) { \// draw bins }
+      ~~~~
+    */
+   class histogram_snapshot_reader
+   {
+      int fd{-1};
+      const uint8_t* map{nullptr};
+      size_t map_size{0};
+
+      const histogram_file_header* header() const { return reinterpret_cast<const histogram_file_header*>(map); }
+   public:
+      histogram_snapshot_reader(const std::string& filename);
+      ~histogram_snapshot_reader();
+      histogram_snapshot_reader(const histogram_snapshot_reader&)=delete;
+      histogram_snapshot_reader& operator=(const histogram_snapshot_reader&)=delete;
+
+      size_t number_of_spectra() const { return header()->number_of_spectra; }
+      const histogram_descriptor& get_descriptor(size_t spectrum) const
+      {
+         return reinterpret_cast<const histogram_descriptor*>(map + sizeof(histogram_file_header))[spectrum];
+      }
+      int find_spectrum(const std::string& name) const;
+      bool read(size_t spectrum, std::vector<uint32_t>& bins, int max_tries=100) const;
+   };
+}
+
+#endif // MESYTEC_HISTOGRAMMER_H
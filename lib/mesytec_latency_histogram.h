@@ -0,0 +1,142 @@
+#ifndef MESYTEC_LATENCY_HISTOGRAM_H
+#define MESYTEC_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace mesytec
+{
+   /**
+      @return current value of monotonic clock in nanoseconds, for timestamping pipeline stages
+    */
+   inline uint64_t latency_timestamp()
+   {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+   }
+
+   /**
+      @class latency_histogram
+      @brief low-overhead histogram of latencies in nanoseconds
+
+      Values are recorded in log-linear buckets (as in HDR histograms): each power of 2 is divided into
+      32 sub-buckets, so percentiles are given with a relative precision of about 3% over the whole
+      range 1ns to >100 years, using a fixed amount of memory and no allocation.
+
+      Recording a value is a few integer operations and a relaxed atomic increment, so record() can
+      be called from one thread while another one calls print() or percentile().
+
+      ~~~~{.cpp}
+      mesytec::latency_histogram parse_latency;
+      auto t0 = mesytec::latency_timestamp();
+      \// ... parse buffer ...
+      parse_latency.record(mesytec::latency_timestamp()-t0);
+      parse_latency.print("parse");
+      ~~~~
+    */
+   class latency_histogram
+   {
+      static const int sub_bucket_bits = 5;
+      static const uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+      static const int number_of_buckets = (64-sub_bucket_bits+1)*sub_bucket_count;
+
+      std::array<std::atomic<uint64_t>,number_of_buckets> counts;
+      std::atomic<uint64_t> total_count;
+      std::atomic<uint64_t> total_sum;
+      std::atomic<uint64_t> max_value;
+
+      static int most_significant_bit(uint64_t v)
+      {
+         return 63 - __builtin_clzll(v);
+      }
+      static int bucket_index(uint64_t v)
+      {
+         if(v < sub_bucket_count) return v;
+         int e = most_significant_bit(v);
+         return (e-sub_bucket_bits+1)*sub_bucket_count + ((v >> (e-sub_bucket_bits)) & (sub_bucket_count-1));
+      }
+      static uint64_t bucket_upper_edge(int index)
+      {
+         if(index < (int)sub_bucket_count) return index;
+         int e = index/sub_bucket_count + sub_bucket_bits - 1;
+         uint64_t sub = index%sub_bucket_count;
+         return ((sub_bucket_count+sub+1) << (e-sub_bucket_bits)) - 1;
+      }
+   public:
+      latency_histogram()
+      {
+         reset();
+      }
+      latency_histogram(const latency_histogram&)=delete;
+      latency_histogram& operator=(const latency_histogram&)=delete;
+
+      /**
+         @param ns latency in nanoseconds
+       */
+      void record(uint64_t ns)
+      {
+         counts[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+         total_count.fetch_add(1, std::memory_order_relaxed);
+         total_sum.fetch_add(ns, std::memory_order_relaxed);
+         auto m = max_value.load(std::memory_order_relaxed);
+         while(ns > m && !max_value.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+      }
+      void reset()
+      {
+         for(auto& c : counts) c.store(0, std::memory_order_relaxed);
+         total_count.store(0, std::memory_order_relaxed);
+         total_sum.store(0, std::memory_order_relaxed);
+         max_value.store(0, std::memory_order_relaxed);
+      }
+      /**
+         @return number of values recorded
+       */
+      uint64_t get_count() const { return total_count.load(std::memory_order_relaxed); }
+      /**
+         @return largest value recorded [ns]
+       */
+      uint64_t get_max() const { return max_value.load(std::memory_order_relaxed); }
+      /**
+         @return mean of values recorded [ns]
+       */
+      double get_mean() const
+      {
+         auto n = get_count();
+         return n ? (double)total_sum.load(std::memory_order_relaxed)/n : 0.;
+      }
+      /**
+         @param p percentile (0-100), e.g. 99.9
+         @return value [ns] below which p% of the recorded values lie (within bucket precision)
+       */
+      uint64_t percentile(double p) const
+      {
+         auto n = get_count();
+         if(!n) return 0;
+         uint64_t target = (uint64_t)(p/100.*n + 0.5);
+         if(target < 1) target = 1;
+         uint64_t seen = 0;
+         for(int i=0; i<number_of_buckets; ++i)
+         {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if(seen >= target) return std::min(bucket_upper_edge(i), get_max());
+         }
+         return get_max();
+      }
+      /**
+         print one-line summary (count, mean, p50, p99, p99.9, max in microseconds) to stdout
+       */
+      void print(const std::string& name) const
+      {
+         printf("%-24s n=%-10llu mean=%10.1fus p50=%10.1fus p99=%10.1fus p99.9=%10.1fus max=%10.1fus\n",
+                name.c_str(), (unsigned long long)get_count(), get_mean()/1.e3,
+                percentile(50)/1.e3, percentile(99)/1.e3, percentile(99.9)/1.e3, get_max()/1.e3);
+      }
+   };
+}
+
+#endif // MESYTEC_LATENCY_HISTOGRAM_H
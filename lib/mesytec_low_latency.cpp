@@ -0,0 +1,101 @@
+#include "mesytec_low_latency.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+namespace mesytec
+{
+   namespace
+   {
+      const size_t huge_page_size = 2*1024*1024;
+      const size_t page_size = 4096;
+
+      bool set_affinity(pthread_t thread, int cpu)
+      {
+         if(cpu < 0 || cpu >= CPU_SETSIZE) return false;
+         cpu_set_t cpus;
+         CPU_ZERO(&cpus);
+         CPU_SET(cpu, &cpus);
+         return pthread_setaffinity_np(thread, sizeof(cpus), &cpus) == 0;
+      }
+   }
+
+   locked_buffer::locked_buffer(size_t size)
+      : buffer_size{size}
+   {
+      /// \param[in] size size of buffer in bytes
+      ///
+      /// Throws std::runtime_error if the memory cannot be allocated at all.
+
+      mapped_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+      void* m = MAP_FAILED;
+#ifdef MAP_HUGETLB
+      m = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      huge_pages = (m != MAP_FAILED);
+#endif
+      if(m == MAP_FAILED)
+      {
+         // no huge pages reserved by the kernel (vm.nr_hugepages): normal pages, transparent huge pages if enabled
+         mapped_size = (size + page_size - 1) & ~(page_size - 1);
+         m = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+         if(m == MAP_FAILED)
+            throw std::runtime_error("locked_buffer: cannot allocate " + std::to_string(size) + " bytes : " + strerror(errno));
+#ifdef MADV_HUGEPAGE
+         transparent_huge_pages = (madvise(m, mapped_size, MADV_HUGEPAGE) == 0);
+#endif
+      }
+      buffer = static_cast<uint8_t*>(m);
+      // pre-fault every page now rather than on first use in the data path
+      memset(buffer, 0, mapped_size);
+      locked = (mlock(buffer, mapped_size) == 0);
+   }
+
+   locked_buffer::~locked_buffer()
+   {
+      if(locked) munlock(buffer, mapped_size);
+      munmap(buffer, mapped_size);
+   }
+
+   std::string locked_buffer::describe() const
+   {
+      /// \returns summary of buffer configuration, e.g. "4096 kB, 2 MB huge pages, locked"
+
+      std::string d = std::to_string(buffer_size/1024) + " kB, ";
+      if(huge_pages) d += "2 MB huge pages";
+      else if(transparent_huge_pages) d += "transparent huge pages requested";
+      else d += "normal pages";
+      d += locked ? ", locked" : ", NOT locked (check ulimit -l)";
+      return d;
+   }
+
+   bool set_thread_affinity(std::thread &thread, int cpu)
+   {
+      /// \param[in] thread running thread
+      /// \param[in] cpu number of CPU on which the thread must run
+      /// \returns false if the affinity could not be set (e.g. no such CPU)
+
+      return set_affinity(thread.native_handle(), cpu);
+   }
+
+   bool set_current_thread_affinity(int cpu)
+   {
+      /// \param[in] cpu number of CPU on which the calling thread must run
+      /// \returns false if the affinity could not be set (e.g. no such CPU)
+
+      return set_affinity(pthread_self(), cpu);
+   }
+
+   bool lock_all_memory()
+   {
+      /// Fault in and lock all memory currently used by the process in RAM (mlockall), so that the data path is not
+      /// delayed by page faults or swapping. Call it once all buffers are allocated. Future allocations are not locked
+      /// (with MCL_FUTURE, they would fail once RLIMIT_MEMLOCK is reached).
+      ///
+      /// \returns false if memory could not be locked (e.g. RLIMIT_MEMLOCK too small, see ulimit -l)
+
+      return mlockall(MCL_CURRENT) == 0;
+   }
+}
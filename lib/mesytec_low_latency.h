@@ -0,0 +1,54 @@
+#ifndef MESYTEC_LOW_LATENCY_H
+#define MESYTEC_LOW_LATENCY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace mesytec
+{
+   /**
+      @class locked_buffer
+      @brief memory buffer which never causes page faults once allocated
+
+      The buffer is allocated with huge pages if possible (explicit huge pages from the kernel pool, else transparent huge
+      pages are requested), every page is written once (pre-faulted), and the buffer is locked in RAM with mlock(), so that
+      writing to it in the data path never waits for the kernel. Failure to use huge pages or to lock the memory (e.g.
+      because of RLIMIT_MEMLOCK) is not an error: use describe() to report what was achieved.
+
+      ~~~~{.cpp}
+      mesytec::locked_buffer buf(4*1024*1024);
+      std::cout << buf.describe() << std::endl; \// e.g. "4096 kB, 2 MB huge pages, locked"
+      ~~~~
+    */
+   class locked_buffer
+   {
+      uint8_t* buffer{nullptr};
+      size_t buffer_size{0};
+      size_t mapped_size{0};
+      bool huge_pages{false};
+      bool transparent_huge_pages{false};
+      bool locked{false};
+   public:
+      locked_buffer(size_t size);
+      ~locked_buffer();
+      locked_buffer(const locked_buffer&)=delete;
+      locked_buffer& operator=(const locked_buffer&)=delete;
+
+      uint8_t* data() const { return buffer; }
+      size_t size() const { return buffer_size; }
+      /**
+         @return true if buffer is backed by explicit (hugetlbfs) huge pages
+       */
+      bool uses_huge_pages() const { return huge_pages; }
+      bool is_locked() const { return locked; }
+      std::string describe() const;
+   };
+
+   bool set_thread_affinity(std::thread& thread, int cpu);
+   bool set_current_thread_affinity(int cpu);
+   bool lock_all_memory();
+}
+
+#endif // MESYTEC_LOW_LATENCY_H
@@ -0,0 +1,148 @@
+#ifndef MESYTEC_MFM_FRAME_H
+#define MESYTEC_MFM_FRAME_H
+
+#include "mesytec_data.h"
+#include <cstring>
+
+namespace mesytec
+{
+   /// size in bytes of the header of MFM frames containing Mesytec data
+   const size_t mfm_header_size = 24;
+
+   /**
+      @param ev event to encapsulate
+      @return size in bytes of the MFM frame needed to hold all data of event
+    */
+   inline size_t mfm_frame_size(const event& ev)
+   {
+      return mfm_header_size + ev.size_of_buffer()*4;
+   }
+
+   /**
+      @param frame possible start of an MFM frame
+      @param available number of bytes available from frame
+      @return true if the bytes look like the header of an MFM frame with Mesytec data (see write_mfm_frame()):
+              first byte, frame type, revision (0 or 1), and consistent frame & blob sizes
+    */
+   inline bool is_mfm_frame_header(const uint8_t* frame, size_t available)
+   {
+      if(available < mfm_header_size || frame[0] != 0xc1 || frame[7] > 1) return false;
+      uint16_t type;
+      memcpy(&type, &frame[5], 2);
+      if(type != mfm_frame_type) return false;
+      size_t frame_size = 2*((size_t)frame[1] | ((size_t)frame[2] << 8) | ((size_t)frame[3] << 16));
+      uint32_t blob_size;
+      memcpy(&blob_size, &frame[20], 4);
+      return frame_size >= mfm_header_size && mfm_header_size + (size_t)blob_size <= frame_size && !(blob_size & 1);
+   }
+
+   /**
+      @brief search for the next MFM frame header in a buffer, e.g. after corrupted data
+
+      Candidates are found with memchr() on the first byte of the header (0xc1), then checked with
+      is_mfm_frame_header(). A candidate too close to the end of the buffer to be checked is returned as is.
+
+      @param buf buffer
+      @param nbytes size of buffer in bytes
+      @param from offset at which to start the search
+      @return offset of next frame header, or nbytes if none found
+    */
+   inline size_t find_mfm_frame_header(const uint8_t* buf, size_t nbytes, size_t from)
+   {
+      while(from < nbytes)
+      {
+         auto p = static_cast<const uint8_t*>(memchr(buf + from, 0xc1, nbytes - from));
+         if(!p) return nbytes;
+         size_t pos = p - buf;
+         if(nbytes - pos < mfm_header_size || is_mfm_frame_header(p, nbytes - pos)) return pos;
+         from = pos + 1;
+      }
+      return nbytes;
+   }
+
+   /**
+      @brief encapsulate event in an MFM frame
+
+      Layout of the frame (little-endian):
+
+      | bytes   | contents |
+      |---------|----------|
+      | 0       | 0xc1 : little-endian, blob frame, unit block size 2 bytes |
+      | 1-3     | frame size in unit block size |
+      | 4       | data source (shard number when sharded, see set_mfm_frame_shard()) |
+      | 5-6     | frame type (mesytec::mfm_frame_type) |
+      | 7       | frame revision |
+      | 8-13    | TGV timestamp (lo, mid, hi 16-bit words) |
+      | 14-17   | event number (event counter from mesytec EOE) |
+      | 18-19   | sequence number of frame in its shard (0 when not sharded) |
+      | 20-23   | number of bytes in mesytec data blob |
+      | 24-...  | mesytec data blob (see event::get_output_buffer()) |
+
+      @param ev event to encapsulate
+      @param frame memory where frame is written, must be at least mfm_frame_size(ev) bytes
+      @param revision frame revision number
+      @return size of frame in bytes
+    */
+   inline size_t write_mfm_frame(const event& ev, uint8_t* frame, uint8_t revision=1)
+   {
+      size_t blob_size = ev.size_of_buffer()*4;
+      size_t frame_size = mfm_header_size + blob_size;
+
+      frame[0] = 0xc1;
+      uint32_t size_in_blocks = (uint32_t)frame_size/2;
+      memcpy(&frame[1], &size_in_blocks, 4); // byte 4 overwritten just after
+      frame[4] = 0x0;
+      memcpy(&frame[5], &mfm_frame_type, 2);
+      frame[7] = revision;
+
+      uint16_t ts[3] = {ev.get_tgv_ts_lo(), ev.get_tgv_ts_mid(), ev.get_tgv_ts_hi()};
+      memcpy(&frame[8], ts, 6);
+      uint32_t evnum = ev.get_event_counter();
+      memcpy(&frame[14], &evnum, 4);
+      frame[18] = frame[19] = 0;
+      uint32_t blob = (uint32_t)blob_size;
+      memcpy(&frame[20], &blob, 4);
+
+      ev.write_output_buffer(reinterpret_cast<uint32_t*>(frame + mfm_header_size));
+      return frame_size;
+   }
+
+   /// flag set in data source byte of frames published by a sharded transmitter
+   const uint8_t mfm_shard_flag = 0x80;
+
+   /**
+      @brief mark frame as belonging to a shard of a sharded stream
+
+      The data source byte (4) is set to mfm_shard_flag | shard, and bytes 18-19 hold the (16-bit, wrapping)
+      sequence number of the frame in its shard, so that consumers can detect lost frames (see shard_sequence_checker).
+
+      @param frame MFM frame written by write_mfm_frame()
+      @param shard shard number (0-127)
+      @param sequence sequence number of frame in shard
+    */
+   inline void set_mfm_frame_shard(uint8_t* frame, uint8_t shard, uint16_t sequence)
+   {
+      frame[4] = mfm_shard_flag | shard;
+      memcpy(&frame[18], &sequence, 2);
+   }
+
+   /**
+      @return true if frame belongs to a sharded stream (see set_mfm_frame_shard())
+    */
+   inline bool is_mfm_frame_sharded(const uint8_t* frame) { return frame[4] & mfm_shard_flag; }
+   /**
+      @return shard number of frame (see set_mfm_frame_shard())
+    */
+   inline uint8_t get_mfm_frame_shard(const uint8_t* frame) { return frame[4] & ~mfm_shard_flag; }
+   /**
+      @return sequence number of frame in its shard (see set_mfm_frame_shard())
+    */
+   inline uint16_t get_mfm_frame_sequence(const uint8_t* frame)
+   {
+      uint16_t sequence;
+      memcpy(&sequence, &frame[18], 2);
+      return sequence;
+   }
+}
+
+#endif // MESYTEC_MFM_FRAME_H
@@ -307,6 +307,7 @@ namespace mesytec
    class bus
    {
       std::vector<std::string> channel_name;
+      std::vector<bool> channel_has_detector;
       uint8_t id;
 public:
       /**
@@ -321,6 +322,7 @@ public:
          while(chan<n_channels) {
             std::string name = "bus_" + std::to_string(id) + "_chan_" + std::to_string(chan);
             channel_name.push_back(name);
+            channel_has_detector.push_back(false);
             ++chan;
          }
       }
@@ -344,6 +346,27 @@ public:
       {
          return channel_name[channel];
       }
+      /**
+         @param channel channel number
+         @param name name of detector connected to channel
+       */
+      void set_detector(uint8_t channel, const std::string& name)
+      {
+         channel_name[channel] = name;
+         channel_has_detector[channel] = true;
+      }
+      /**
+         @param channel channel number
+         @return true if a detector was associated with the channel with set_detector()
+       */
+      bool has_detector(uint8_t channel) const
+      {
+         return channel < channel_has_detector.size() && channel_has_detector[channel];
+      }
+      /**
+         @return number of channels (subaddresses) in bus
+       */
+      size_t get_number_of_channels() const { return channel_name.size(); }
    };
 
    inline bool is_vmmr_tdc_data(uint32_t DATA)
@@ -402,13 +425,13 @@ public:
             bus_map.push_back({b,nchan});
          }
       }
-      uint8_t channel_flags() const
+      uint8_t channel_flags(uint32_t data) const
       {
          // =0 : data is ADC or QDC_long
          // =1 : data is TDC
          // =3 : data is QDC_short
          // =2 : data is trigger time
-         return (DATA & channel_flag_mask)/channel_flag_div;
+         return (data & channel_flag_mask)/channel_flag_div;
       }
       static std::unordered_map<std::string,std::string> data_type_aliases;
 
@@ -495,33 +518,51 @@ public:
          \note call after set_data_word()
          @return channel number (for MDPP) or bus subaddress (for VMMR - only for ADC data) for current data word
        */
-      uint8_t get_channel_number() const
-      {        
-         if(firmware==VMMR && !is_vmmr_adc_data(DATA)) return 0;
-         return (DATA & channel_mask) / channel_div;
+      uint8_t get_channel_number() const { return get_channel_number(DATA); }
+      /**
+         @param data 32-bit data word from data stream
+         @return channel number (for MDPP) or bus subaddress (for VMMR - only for ADC data) for given data word
+
+         Unlike get_channel_number(), does not depend on (or modify) the current data word of the module,
+         so can be used from several threads at once.
+       */
+      uint8_t get_channel_number(uint32_t data) const
+      {
+         if(firmware==VMMR && !is_vmmr_adc_data(data)) return 0;
+         return (data & channel_mask) / channel_div;
       }
       /**
          \note call after set_data_word()
          @return  bus number for current data word (only for VMMR modules). For MDPP modules bus number is always 0.
        */
-      uint8_t get_bus_number() const
+      uint8_t get_bus_number() const { return get_bus_number(DATA); }
+      /**
+         @param data 32-bit data word from data stream
+         @return  bus number for given data word (only for VMMR modules). For MDPP modules bus number is always 0.
+       */
+      uint8_t get_bus_number(uint32_t data) const
       {
          if(firmware==VMMR)
-            return (DATA & data_flags::vmmr_bus_mask) / data_flags::vmmr_bus_div;
+            return (data & data_flags::vmmr_bus_mask) / data_flags::vmmr_bus_div;
          return 0;
       }
       /**
          \note call after set_data_word()
          @return the actual data (adc, tdc, or other) associated with the current data word
        */
-      unsigned int get_channel_data() const
+      unsigned int get_channel_data() const { return get_channel_data(DATA); }
+      /**
+         @param data 32-bit data word from data stream
+         @return the actual data (adc, tdc, or other) associated with the given data word
+       */
+      unsigned int get_channel_data(uint32_t data) const
       {
          if(firmware==VMMR)
          {
-            if(is_vmmr_adc_data(DATA)) return (DATA & data_flags::vmmr_adc_mask);
-            if(is_vmmr_tdc_data(DATA)) return (DATA & data_flags::vmmr_tdc_mask);
+            if(is_vmmr_adc_data(data)) return (data & data_flags::vmmr_adc_mask);
+            if(is_vmmr_tdc_data(data)) return (data & data_flags::vmmr_tdc_mask);
          }
-         return (DATA & data_flags::data_mask);
+         return (data & data_flags::data_mask);
       }
       void print_data() const
       {
@@ -569,14 +610,19 @@ public:
          \note call after set_data_word()
          @return type of data contained in current data word. see datatype_t enum for values.
        */
-      datatype_t get_data_type() const
+      datatype_t get_data_type() const { return get_data_type(DATA); }
+      /**
+         @param data 32-bit data word from data stream
+         @return type of data contained in given data word. see datatype_t enum for values.
+       */
+      datatype_t get_data_type(uint32_t data) const
       {
          if(firmware==VMMR)
          {
-            if(is_vmmr_adc_data(DATA)) return ADC;
+            if(is_vmmr_adc_data(data)) return ADC;
             else return TDC;
          }
-         switch(channel_flags())
+         switch(channel_flags(data))
          {
          case 0:
             return firmware==MDPP_QDC ? QDC_long : ADC;
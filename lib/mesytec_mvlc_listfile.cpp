@@ -0,0 +1,160 @@
+#include "mesytec_mvlc_listfile.h"
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mesytec
+{
+   mvlc_listfile_reader::mvlc_listfile_reader(const std::string &filename)
+   {
+      fd = open(filename.c_str(), O_RDONLY);
+      if(fd < 0) throw std::runtime_error("mvlc_listfile_reader: cannot open " + filename);
+      struct stat st;
+      if(fstat(fd, &st) || st.st_size < 8)
+      {
+         close(fd);
+         throw std::runtime_error("mvlc_listfile_reader: " + filename + " is not an MVLC listfile");
+      }
+      map_size = st.st_size;
+      auto m = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(m == MAP_FAILED)
+      {
+         close(fd);
+         throw std::runtime_error("mvlc_listfile_reader: cannot map " + filename);
+      }
+      map = (const uint8_t*)m;
+      madvise(m, map_size, MADV_SEQUENTIAL);
+
+      if(!memcmp(map, "MVLC_USB", 8)) connection = connection_type::usb;
+      else if(!memcmp(map, "MVLC_ETH", 8)) connection = connection_type::eth;
+      else
+      {
+         munmap(m, map_size);
+         close(fd);
+         throw std::runtime_error("mvlc_listfile_reader: " + filename + " is not an MVLC listfile (no MVLC_USB/MVLC_ETH magic)."
+                                  " Listfiles in zip archives must be extracted first.");
+      }
+
+      // the crate configuration is written in system events right after the magic, before any readout data
+      auto pos = first_word();
+      while(pos < end_word() && get_frame_type(*pos) == frame_headers::SystemEvent)
+      {
+         uint8_t subtype;
+         pos = read_system_event(pos, subtype);
+         if(subtype == system_event::subtype::MVLCCrateConfig)
+         {
+            crate_config.assign((const char*)system_event_payload.data(), system_event_payload.size()*4);
+            // remove padding
+            auto last = crate_config.find_last_not_of(std::string(" \0", 2));
+            crate_config.erase(last == std::string::npos ? 0 : last+1);
+            break;
+         }
+      }
+   }
+
+   mvlc_listfile_reader::~mvlc_listfile_reader()
+   {
+      munmap((void*)map, map_size);
+      close(fd);
+   }
+
+   const uint32_t *mvlc_listfile_reader::read_system_event(const uint32_t *pos, uint8_t &subtype)
+   {
+      // reassemble payload of system event beginning at pos (continuation parts have the continue bit set,
+      // except the last one) into system_event_payload.
+      // returns position of next word after the system event.
+
+      system_event_payload.clear();
+      subtype = system_event::extract_subtype(*pos);
+      while(pos < end_word())
+      {
+         auto header = *pos++;
+         size_t len = (header >> system_event::LengthShift) & system_event::LengthMask;
+         if(pos + len > end_word()) len = end_word() - pos; // truncated file
+         system_event_payload.insert(system_event_payload.end(), pos, pos + len);
+         pos += len;
+         if(!((header >> system_event::ContinueShift) & system_event::ContinueMask)) break;
+         if(pos >= end_word() || get_frame_type(*pos) != frame_headers::SystemEvent) break;
+      }
+      return pos;
+   }
+
+   size_t mvlc_listfile_reader::readout_unit_size(const uint32_t *pos, const uint32_t *end) const
+   {
+      // size in words of the frame (USB) or packet (ETH) beginning at pos, 0 if not a valid header,
+      // or if it extends beyond end of file
+
+      size_t size = 0;
+      if(connection == connection_type::usb)
+      {
+         switch(get_frame_type(*pos))
+         {
+            case frame_headers::StackFrame:
+            case frame_headers::StackContinuation:
+            case frame_headers::StackError:
+               size = 1 + ((*pos >> frame_headers::LengthShift) & frame_headers::LengthMask);
+               break;
+            default:
+               return 0;
+         }
+      }
+      else
+      {
+         // ETH packet: header0 = channel[29:28] packet number[27:16] controller id[15:13] data words[12:0],
+         // header1 = timestamp & next header pointer
+         if(*pos >> 30) return 0;
+         size = 2 + (*pos & 0x1fff);
+      }
+      return (pos + size <= end) ? size : 0;
+   }
+
+   void mvlc_listfile_reader::read(readout_callback readout, system_event_callback system_event, size_t max_chunk_words)
+   {
+      /// \param[in] readout called with chunks of readout data (whole USB frames or ETH packets) of at most
+      ///            max_chunk_words words (unless a single frame/packet is larger)
+      /// \param[in] system_event called with the subtype and reassembled payload of each system event
+      /// \param[in] max_chunk_words maximum size of chunks of data passed to readout callback
+
+      skipped_words = 0;
+      auto pos = first_word();
+      auto end = end_word();
+      const uint32_t* chunk = pos;
+
+      auto flush = [&](){
+         if(pos > chunk) readout(chunk, pos - chunk);
+      };
+
+      while(pos < end)
+      {
+         if(get_frame_type(*pos) == frame_headers::SystemEvent)
+         {
+            flush();
+            uint8_t subtype;
+            pos = read_system_event(pos, subtype);
+            if(system_event) system_event(subtype, system_event_payload);
+            chunk = pos;
+            if(subtype == system_event::subtype::EndOfFile) break;
+            continue;
+         }
+         auto size = readout_unit_size(pos, end);
+         if(!size)
+         {
+            // not a valid frame/packet header: skip word
+            flush();
+            ++skipped_words;
+            chunk = ++pos;
+            continue;
+         }
+         if(pos + size - chunk > (ptrdiff_t)max_chunk_words && pos > chunk)
+         {
+            flush();
+            chunk = pos;
+         }
+         pos += size;
+      }
+      flush();
+   }
+}
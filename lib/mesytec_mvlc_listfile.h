@@ -0,0 +1,80 @@
+#ifndef MESYTEC_MVLC_LISTFILE_H
+#define MESYTEC_MVLC_LISTFILE_H
+
+#include "mesytec_module.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class mvlc_listfile_reader
+      @brief read MVLC listfiles written by mvme / mesytec-mvlc (uncompressed, i.e. extracted from the zip archive)
+
+      The file is memory-mapped and walked without copying the data:
+
+        + the file begins with the magic "MVLC_USB" or "MVLC_ETH" giving the framing of the readout data
+        + system events (frame type 0xFA, possibly split in several parts with the continue bit set) are
+          reassembled and passed to the system event callback. The MVLCCrateConfig system event, which contains
+          the YAML crate configuration used for the run, is read when the file is opened (see get_crate_config())
+        + readout data (USB: 0xF3/0xF9/0xF7 frames, ETH: packets with 2 header words) between system events is
+          passed to the readout callback in chunks of whole frames/packets, ready for
+          mvlc_parser_buffer_reader::read_buffer_collate_events()
+
+      ~~~~{.cpp}
+      mesytec::mvlc_listfile_reader listfile("run001.mvlclst");
+      reader.read_mvlc_crateconfig_from_yaml(listfile.get_crate_config());
+      reader.initialise_readout();
+      listfile.read([&](const uint32_t* data, size_t nwords){
+                       reader.read_buffer_collate_events((const uint8_t*)data, nwords*4, callback);
+                    },
+                    [](uint8_t subtype, const std::vector<uint32_t>& payload){});
+      ~~~~
+    */
+   class mvlc_listfile_reader
+   {
+   public:
+      enum class connection_type { usb, eth };
+      using readout_callback = std::function<void (const uint32_t* data, size_t nwords)>;
+      using system_event_callback = std::function<void (uint8_t subtype, const std::vector<uint32_t>& payload)>;
+
+   private:
+      int fd{-1};
+      const uint8_t* map{nullptr};
+      size_t map_size{0};
+      connection_type connection;
+      std::string crate_config;
+      std::vector<uint32_t> system_event_payload;
+      uint64_t skipped_words{0};
+
+      const uint32_t* first_word() const { return reinterpret_cast<const uint32_t*>(map + 8); }
+      const uint32_t* end_word() const { return reinterpret_cast<const uint32_t*>(map + 8 + ((map_size-8) & ~size_t(3))); }
+      const uint32_t* read_system_event(const uint32_t* pos, uint8_t& subtype);
+      size_t readout_unit_size(const uint32_t* pos, const uint32_t* end) const;
+
+   public:
+      mvlc_listfile_reader(const std::string& filename);
+      ~mvlc_listfile_reader();
+      mvlc_listfile_reader(const mvlc_listfile_reader&)=delete;
+      mvlc_listfile_reader& operator=(const mvlc_listfile_reader&)=delete;
+
+      connection_type get_connection_type() const { return connection; }
+      /**
+         @return YAML crate configuration stored in the listfile (empty if none was found)
+       */
+      const std::string& get_crate_config() const { return crate_config; }
+      /**
+         @return size of listfile in bytes
+       */
+      size_t get_file_size() const { return map_size; }
+      /**
+         @return number of words which could not be interpreted as frames/packets during last read()
+       */
+      uint64_t get_skipped_words() const { return skipped_words; }
+
+      void read(readout_callback readout, system_event_callback system_event = nullptr, size_t max_chunk_words = 1<<18);
+   };
+}
+
+#endif // MESYTEC_MVLC_LISTFILE_H
@@ -0,0 +1,193 @@
+#include "mesytec_raw_recorder.h"
+#include "mesytec_low_latency.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace mesytec
+{
+   raw_recorder::raw_recorder(const std::string &_first_file, size_t _file_size, int _number_of_files, size_t _ring_size)
+      : first_file{_first_file}, file_size{_file_size}, number_of_files{_number_of_files},
+        ring{new uint8_t[_ring_size]}, ring_size{_ring_size}
+   {
+      /// \param[in] _first_file name of first file of recording
+      /// \param[in] _file_size maximum size of each file in bytes
+      /// \param[in] _number_of_files number of files in ring (recording overwrites the oldest file when all are full)
+      /// \param[in] _ring_size size in bytes of in-memory buffer between record() and writer thread
+
+      if(number_of_files < 1) throw std::invalid_argument("raw_recorder: number_of_files must be > 0");
+      if(file_size < sizeof(raw_recording_file_header) + 2*sizeof(raw_buffer_header))
+         throw std::invalid_argument("raw_recorder: file_size too small");
+      open_file(0);
+      writer = std::thread(&raw_recorder::run_writer, this);
+   }
+
+   raw_recorder::~raw_recorder()
+   {
+      // write all remaining buffers before closing
+      stop = true;
+      wakeup.notify_one();
+      writer.join();
+      close_file();
+   }
+
+   bool raw_recorder::set_writer_affinity(int cpu)
+   {
+      /// \param[in] cpu number of CPU on which the writer thread must run
+      /// \returns false if the affinity could not be set
+
+      return set_thread_affinity(writer, cpu);
+   }
+
+   bool raw_recorder::record(const void *data, size_t nbytes, uint64_t timestamp)
+   {
+      /// \param[in] data buffer to record
+      /// \param[in] nbytes size of buffer in bytes
+      /// \param[in] timestamp time at which buffer was received [ns], e.g. from mesytec::latency_timestamp()
+      /// \returns false if buffer could not be recorded (in-memory ring full, or buffer too large for one file)
+      ///
+      /// Never blocks: called from the thread receiving the data.
+
+      raw_buffer_header header{(uint32_t)nbytes, 0, sequence++, timestamp};
+      size_t record_size = sizeof(header) + nbytes;
+      auto h = head.load(std::memory_order_relaxed);
+      if(h + record_size - tail.load(std::memory_order_acquire) > ring_size
+            || record_size + sizeof(raw_buffer_header) > file_size - sizeof(raw_recording_file_header))
+      {
+         buffers_dropped.fetch_add(1, std::memory_order_relaxed);
+         return false;
+      }
+      copy_to_ring(h, &header, sizeof(header));
+      copy_to_ring(h + sizeof(header), data, nbytes);
+      head.store(h + record_size, std::memory_order_release);
+      wakeup.notify_one();
+      return true;
+   }
+
+   void raw_recorder::copy_to_ring(uint64_t pos, const void *src, size_t nbytes)
+   {
+      auto offset = pos % ring_size;
+      auto first = std::min(nbytes, ring_size - offset);
+      memcpy(&ring[offset], src, first);
+      if(first < nbytes) memcpy(&ring[0], (const uint8_t*)src + first, nbytes - first);
+   }
+
+   void raw_recorder::copy_from_ring(uint64_t pos, void *dest, size_t nbytes) const
+   {
+      auto offset = pos % ring_size;
+      auto first = std::min(nbytes, ring_size - offset);
+      memcpy(dest, &ring[offset], first);
+      if(first < nbytes) memcpy((uint8_t*)dest + first, &ring[0], nbytes - first);
+   }
+
+   void raw_recorder::open_file(int index)
+   {
+      // (re)create file, preallocate it (reading stops at the first zero buffer size), & write file header
+
+      file_index = index;
+      file_used = 0;
+      auto name = run_file_name(first_file, file_index);
+      fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if(fd < 0) throw std::runtime_error("raw_recorder: cannot open " + name + " : " + strerror(errno));
+      if(posix_fallocate(fd, 0, file_size))
+         std::cout << "[MESYTEC] : raw_recorder: could not preallocate " << name << std::endl;
+
+      raw_recording_file_header header;
+      memcpy(header.magic, raw_recording_magic, 8);
+      header.version = raw_recording_version;
+      header.header_size = sizeof(header);
+      header.start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+      write_to_file(&header, sizeof(header));
+   }
+
+   void raw_recorder::close_file()
+   {
+      if(fd < 0) return;
+      // end-of-data marker, in case file could not be preallocated
+      raw_buffer_header end{0, 0, 0, 0};
+      write_to_file(&end, sizeof(end));
+      close(fd);
+      fd = -1;
+   }
+
+   void raw_recorder::write_to_file(const void *src, size_t nbytes)
+   {
+      auto p = (const uint8_t*)src;
+      while(nbytes)
+      {
+         auto n = pwrite(fd, p, nbytes, file_used);
+         if(n < 0)
+         {
+            if(errno == EINTR) continue;
+            write_errors.fetch_add(1, std::memory_order_relaxed);
+            return;
+         }
+         p += n;
+         nbytes -= n;
+         file_used += n;
+         bytes_written.fetch_add(n, std::memory_order_relaxed);
+      }
+   }
+
+   void raw_recorder::write_ring(uint64_t pos, size_t nbytes)
+   {
+      // write bytes [pos, pos+nbytes) of ring to file (in 2 parts if they wrap around end of ring)
+      auto offset = pos % ring_size;
+      auto first = std::min(nbytes, ring_size - offset);
+      write_to_file(&ring[offset], first);
+      if(first < nbytes) write_to_file(&ring[0], nbytes - first);
+   }
+
+   void raw_recorder::run_writer()
+   {
+      while(1)
+      {
+         auto t = tail.load(std::memory_order_relaxed);
+         auto h = head.load(std::memory_order_acquire);
+         if(t == h)
+         {
+            if(stop) return;
+            std::unique_lock<std::mutex> lock(wakeup_mutex);
+            wakeup.wait_for(lock, std::chrono::milliseconds(10));
+            continue;
+         }
+         // write as many whole buffers as fit in current file in one go
+         uint64_t end = t;
+         uint64_t nbuffers = 0;
+         while(end < h)
+         {
+            raw_buffer_header header;
+            copy_from_ring(end, &header, sizeof(header));
+            size_t record_size = sizeof(header) + header.size;
+            // keep room for end-of-data marker
+            if(file_used + (end - t) + record_size + sizeof(raw_buffer_header) > file_size) break;
+            end += record_size;
+            ++nbuffers;
+         }
+         if(end == t)
+         {
+            // current file is full: continue in next file of ring
+            close_file();
+            try
+            {
+               open_file((file_index + 1) % number_of_files);
+            }
+            catch (std::exception& e)
+            {
+               // further writes will fail & be counted as errors
+               std::cout << "[MESYTEC] : " << e.what() << std::endl;
+            }
+            continue;
+         }
+         write_ring(t, end - t);
+         buffers_recorded.fetch_add(nbuffers, std::memory_order_relaxed);
+         tail.store(end, std::memory_order_release);
+      }
+   }
+}
@@ -0,0 +1,90 @@
+#ifndef MESYTEC_RAW_RECORDER_H
+#define MESYTEC_RAW_RECORDER_H
+
+#include "mesytec_run_files.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace mesytec
+{
+   /**
+      @class raw_recorder
+      @brief asynchronous recording of raw buffers (as received from mvme) in a ring of preallocated files
+
+      record() copies each buffer with a raw_buffer_header into an in-memory ring, from which a writer thread
+      writes them to disk: the calling thread never waits for disk I/O. If the in-memory ring is full (disk too
+      slow) the buffer is not recorded and counted as dropped; the gap in the sequence numbers of the recording
+      shows where buffers are missing.
+
+      Files are named as in run_file_name() (`first_file`, `first_file.1`, ...) and are preallocated to their
+      maximum size when opened. When the last file of the ring is full, recording continues in the first one,
+      so that the most recent data is kept in a fixed amount of disk space (after wrapping around, files are no
+      longer in chronological order: use the sequence numbers). Recordings are read with raw_recording_reader
+      (e.g. mfm_replay --raw).
+
+      ~~~~{.cpp}
+      mesytec::raw_recorder recorder("/data/raw/run_12.raw", 1024*1024*1024, 10);
+      \// for each buffer received:
+      recorder.record(msg.data(), msg.size(), mesytec::latency_timestamp());
+      ~~~~
+    */
+   class raw_recorder
+   {
+      std::string first_file;
+      size_t file_size;
+      int number_of_files;
+
+      // single producer (record) / single consumer (writer thread) byte ring
+      std::unique_ptr<uint8_t[]> ring;
+      size_t ring_size;
+      std::atomic<uint64_t> head{0}; // written by producer
+      std::atomic<uint64_t> tail{0}; // written by writer thread
+      uint64_t sequence{0};
+
+      std::atomic<bool> stop{false};
+      std::mutex wakeup_mutex;
+      std::condition_variable wakeup;
+      std::thread writer;
+
+      int fd{-1};
+      int file_index{0};
+      size_t file_used{0};
+
+      std::atomic<uint64_t> buffers_recorded{0};
+      std::atomic<uint64_t> buffers_dropped{0};
+      std::atomic<uint64_t> bytes_written{0};
+      std::atomic<uint64_t> write_errors{0};
+
+      void copy_to_ring(uint64_t pos, const void* src, size_t nbytes);
+      void copy_from_ring(uint64_t pos, void* dest, size_t nbytes) const;
+      void open_file(int index);
+      void close_file();
+      void write_ring(uint64_t pos, size_t nbytes);
+      void write_to_file(const void* src, size_t nbytes);
+      void run_writer();
+
+   public:
+      raw_recorder(const std::string& first_file, size_t file_size, int number_of_files, size_t ring_size = 256*1024*1024);
+      ~raw_recorder();
+      raw_recorder(const raw_recorder&)=delete;
+      raw_recorder& operator=(const raw_recorder&)=delete;
+
+      bool record(const void* data, size_t nbytes, uint64_t timestamp);
+      bool set_writer_affinity(int cpu);
+
+      /**
+         @return sequence number given to last buffer passed to record()
+       */
+      uint64_t get_sequence() const { return sequence ? sequence-1 : 0; }
+      uint64_t get_buffers_recorded() const { return buffers_recorded.load(std::memory_order_relaxed); }
+      uint64_t get_buffers_dropped() const { return buffers_dropped.load(std::memory_order_relaxed); }
+      uint64_t get_bytes_written() const { return bytes_written.load(std::memory_order_relaxed); }
+      uint64_t get_write_errors() const { return write_errors.load(std::memory_order_relaxed); }
+   };
+}
+
+#endif // MESYTEC_RAW_RECORDER_H
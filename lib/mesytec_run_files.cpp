@@ -0,0 +1,150 @@
+#include "mesytec_run_files.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace mesytec
+{
+   const char raw_recording_magic[8] = {'M','E','S','Y','R','A','W','1'};
+
+   bool run_file_sequence::open_next_file()
+   {
+      // open next file of run. returns false if it does not exist (end of run).
+      // throws if the first file of the run cannot be opened.
+
+      file.close();
+      file.clear();
+      auto name = run_file_name(first_file, next_index);
+      file.open(name, std::ios_base::in | std::ios_base::binary);
+      if(!file.is_open())
+      {
+         if(!next_index) throw std::runtime_error("run_file_sequence: cannot open " + name);
+         return false;
+      }
+      ++next_index;
+      file_opened();
+      return true;
+   }
+
+   bool run_file_sequence::read(void *dest, size_t nbytes)
+   {
+      // read nbytes from current file, going to next file of run if the current one is finished.
+      // returns false at end of run. throws if file ends in the middle of the data.
+
+      while(1)
+      {
+         if(!file.is_open() && !open_next_file()) return false;
+         file.read((char*)dest, nbytes);
+         auto n = file.gcount();
+         if((size_t)n == nbytes) return true;
+         if(n) throw std::runtime_error("run_file_sequence: truncated data at end of " + current_file());
+         file.close();
+      }
+   }
+
+   void run_file_sequence::skip_to_next_file()
+   {
+      file.close();
+   }
+
+   void run_file_sequence::rewind()
+   {
+      file.close();
+      next_index = 0;
+   }
+
+   bool mfm_run_reader::next(std::vector<uint8_t> &frame)
+   {
+      /// \param[out] frame resized to contain the next MFM frame of the run
+      /// \returns false at end of run
+
+      if(frame.size()<24) frame.resize(24);
+      if(!read(frame.data(), 24)) return false;
+      auto size = frame_size(frame.data());
+      if(size < 24) throw std::runtime_error("mfm_run_reader: bad MFM frame header in " + current_file());
+      frame.resize(size);
+      if(size > 24 && !read(frame.data()+24, size-24))
+         throw std::runtime_error("mfm_run_reader: truncated MFM frame in " + current_file());
+      return true;
+   }
+
+   mfm_run_writer::mfm_run_writer(const std::string &_first_file, uint64_t _max_file_size)
+      : first_file{_first_file}, max_file_size{_max_file_size}, buffer(1024*1024)
+   {
+      file.open(first_file, std::ios_base::out | std::ios_base::binary);
+      if(!file.is_open()) throw std::runtime_error("mfm_run_writer: cannot open " + first_file);
+   }
+
+   mfm_run_writer::~mfm_run_writer()
+   {
+      try
+      {
+         flush();
+      }
+      catch (std::exception& e)
+      {
+         std::cerr << e.what() << std::endl;
+      }
+   }
+
+   void mfm_run_writer::flush()
+   {
+      if(!buffer_used) return;
+      if(file_used && file_used + buffer_used > max_file_size)
+      {
+         // current file full - close and open new file
+         file.close();
+         ++file_index;
+         file_used = 0;
+         file.clear();
+         file.open(run_file_name(first_file, file_index), std::ios_base::out | std::ios_base::binary);
+         if(!file.is_open()) throw std::runtime_error("mfm_run_writer: cannot open " + run_file_name(first_file, file_index));
+      }
+      file.write((const char*)buffer.data(), buffer_used);
+      file_used += buffer_used;
+      buffer_used = 0;
+   }
+
+   void mfm_run_writer::write(const uint8_t *frame, size_t size)
+   {
+      if(buffer_used + size > buffer.size())
+      {
+         flush();
+         if(size > buffer.size()) buffer.resize(size);
+      }
+      memcpy(buffer.data() + buffer_used, frame, size);
+      buffer_used += size;
+      ++frames_written;
+   }
+
+   void raw_recording_reader::file_opened()
+   {
+      raw_recording_file_header header;
+      current_stream().read((char*)&header, sizeof(header));
+      if(current_stream().gcount() != sizeof(header) || memcmp(header.magic, raw_recording_magic, 8))
+         throw std::runtime_error("raw_recording_reader: " + current_file() + " is not a raw recording");
+      if(header.version > raw_recording_version)
+         throw std::runtime_error("raw_recording_reader: unknown version of raw recording in " + current_file());
+      // skip any extra header fields written by later versions
+      current_stream().seekg(header.header_size);
+   }
+
+   bool raw_recording_reader::next(std::vector<uint8_t> &buffer, raw_buffer_header &header)
+   {
+      /// \param[out] buffer resized to contain the next buffer of the recording
+      /// \param[out] header header of the buffer
+      /// \returns false at end of recording
+
+      while(1)
+      {
+         if(!read(&header, sizeof(header))) return false;
+         if(header.size) break;
+         // end of data in (preallocated) file
+         skip_to_next_file();
+      }
+      buffer.resize(header.size);
+      if(!read(buffer.data(), header.size))
+         throw std::runtime_error("raw_recording_reader: truncated buffer in " + current_file());
+      return true;
+   }
+}
@@ -0,0 +1,164 @@
+#ifndef MESYTEC_RUN_FILES_H
+#define MESYTEC_RUN_FILES_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @return name of file with given index of a run written in several files, i.e. for index=0,1,2,...
+      `first_file`, `first_file.1`, `first_file.2`, ... (this is how zmq_receiver names the files of a run)
+    */
+   inline std::string run_file_name(const std::string& first_file, int index)
+   {
+      return index ? first_file + "." + std::to_string(index) : first_file;
+   }
+
+   /**
+      @struct raw_recording_file_header
+      @brief header at the beginning of each file of a raw recording
+
+      A raw recording contains buffers exactly as they were received from mvme (i.e. MVLC readout buffers),
+      each preceded by a raw_buffer_header. A buffer header with size=0 marks the end of the data in a file
+      (files may be preallocated: data can be followed by zeroes). Like MFM run files, a recording can
+      be split over several files named as in run_file_name().
+    */
+   struct raw_recording_file_header
+   {
+      char magic[8];             ///< "MESYRAW1"
+      uint32_t version;
+      uint32_t header_size;      ///< sizeof(raw_recording_file_header)
+      uint64_t start_time;       ///< unix time at which the recording started [ns]
+   };
+
+   /**
+      @struct raw_buffer_header
+      @brief header in front of each buffer of a raw recording
+    */
+   struct raw_buffer_header
+   {
+      uint32_t size;             ///< size of buffer in bytes (not including this header)
+      uint32_t flags;            ///< reserved, 0
+      uint64_t sequence;         ///< number of buffer since start of recording (gaps = buffers lost by recorder)
+      uint64_t timestamp;        ///< time at which buffer was received [ns] (monotonic clock)
+   };
+
+   extern const char raw_recording_magic[8];
+   const uint32_t raw_recording_version = 1;
+
+   /**
+      @class run_file_sequence
+      @brief read the successive files of a run as one stream
+    */
+   class run_file_sequence
+   {
+      std::string first_file;
+      int next_index{0};
+      std::ifstream file;
+
+      bool open_next_file();
+
+   protected:
+      bool read(void* dest, size_t nbytes);
+      void skip_to_next_file();
+      /**
+         called each time a new file is opened, before any data is read from it
+       */
+      virtual void file_opened() {}
+      std::ifstream& current_stream() { return file; }
+
+   public:
+      run_file_sequence(const std::string& _first_file) : first_file{_first_file} {}
+      virtual ~run_file_sequence() = default;
+      /**
+         @return name of file currently being read
+       */
+      std::string current_file() const { return run_file_name(first_file, next_index ? next_index-1 : 0); }
+      void rewind();
+   };
+
+   /**
+      @class mfm_run_reader
+      @brief read MFM frames from the files of a run written by zmq_receiver
+
+      ~~~~{.cpp}
+      mesytec::mfm_run_reader run("mesytec_run_12.dat");
+      std::vector<uint8_t> frame;
+      while(run.next(frame))
+      {
+         auto ts = mesytec::mfm_run_reader::tgv_timestamp(frame.data());
+         \// ...
+      }
+      ~~~~
+    */
+   class mfm_run_reader : public run_file_sequence
+   {
+   public:
+      mfm_run_reader(const std::string& first_file) : run_file_sequence(first_file) {}
+      bool next(std::vector<uint8_t>& frame);
+
+      /**
+         @return size in bytes of MFM frame beginning at given address (bytes 1-3 of header are size/2)
+       */
+      static size_t frame_size(const uint8_t* frame)
+      {
+         return 2*((size_t)frame[1] | ((size_t)frame[2] << 8) | ((size_t)frame[3] << 16));
+      }
+      /**
+         @return 48-bit TGV timestamp of MFM frame beginning at given address
+       */
+      static uint64_t tgv_timestamp(const uint8_t* frame)
+      {
+         uint64_t ts = 0;
+         for(int i=5; i>=0; --i) ts = (ts << 8) | frame[8+i];
+         return ts;
+      }
+   };
+
+   /**
+      @class mfm_run_writer
+      @brief write MFM frames in the files of a run, in the same way as zmq_receiver
+
+      Frames are accumulated in a 1 MB buffer which is written to disk when full. When the current file would
+      exceed the maximum file size, a new one is opened (`first_file`, `first_file.1`, ...).
+    */
+   class mfm_run_writer
+   {
+      std::string first_file;
+      uint64_t max_file_size;
+      int file_index{0};
+      uint64_t file_used{0};
+      std::ofstream file;
+      std::vector<uint8_t> buffer;
+      size_t buffer_used{0};
+      uint64_t frames_written{0};
+
+      void flush();
+   public:
+      mfm_run_writer(const std::string& first_file, uint64_t max_file_size = 1024*1024*1024);
+      ~mfm_run_writer();
+      mfm_run_writer(const mfm_run_writer&)=delete;
+      mfm_run_writer& operator=(const mfm_run_writer&)=delete;
+
+      void write(const uint8_t* frame, size_t size);
+      uint64_t get_frames_written() const { return frames_written; }
+   };
+
+   /**
+      @class raw_recording_reader
+      @brief read buffers from the files of a raw recording (see raw_recording_file_header)
+    */
+   class raw_recording_reader : public run_file_sequence
+   {
+   protected:
+      void file_opened() override;
+   public:
+      raw_recording_reader(const std::string& first_file) : run_file_sequence(first_file) {}
+      bool next(std::vector<uint8_t>& buffer, raw_buffer_header& header);
+   };
+}
+
+#endif // MESYTEC_RUN_FILES_H
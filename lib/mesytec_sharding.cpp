@@ -0,0 +1,68 @@
+#include "mesytec_sharding.h"
+#include "mesytec_mfm_frame.h"
+#include <iostream>
+#include <stdexcept>
+
+namespace mesytec
+{
+   shard_selector::shard_selector(unsigned int _number_of_shards, policy p, uint64_t _tgv_slice_width)
+      : number_of_shards{_number_of_shards}, shard_policy{p}, tgv_slice_width{_tgv_slice_width}
+   {
+      /// \param[in] _number_of_shards number of shards (1-128)
+      /// \param[in] p policy used to choose shard of each event
+      /// \param[in] _tgv_slice_width width of TGV time slices (policy::tgv_slice) in TGV timestamp ticks
+
+      if(number_of_shards < 1 || number_of_shards > max_shards)
+         throw std::invalid_argument("shard_selector: number of shards must be between 1 and " + std::to_string(max_shards));
+      if(!tgv_slice_width) throw std::invalid_argument("shard_selector: TGV slice width must be > 0");
+   }
+
+   shard_selector::policy shard_selector::policy_from_string(const std::string &name)
+   {
+      /// \param[in] name "event" (event counter), "round_robin" or "tgv" (TGV time slice)
+
+      if(name == "event") return policy::event_counter;
+      if(name == "round_robin") return policy::round_robin;
+      if(name == "tgv") return policy::tgv_slice;
+      throw std::invalid_argument("shard_selector: unknown sharding policy '" + name + "' (use event, round_robin or tgv)");
+   }
+
+   shard_sequence_checker::shard_sequence_checker()
+      : expected(shard_selector::max_shards), seen(shard_selector::max_shards),
+        received(shard_selector::max_shards), lost(shard_selector::max_shards)
+   {}
+
+   uint64_t shard_sequence_checker::check(const uint8_t *frame)
+   {
+      /// \param[in] frame MFM frame
+      /// \returns number of frames lost in the shard of this frame since the previous frame of the same shard
+
+      if(!is_mfm_frame_sharded(frame)) return 0;
+      auto shard = get_mfm_frame_shard(frame);
+      auto sequence = get_mfm_frame_sequence(frame);
+      ++received[shard];
+      uint16_t gap = 0;
+      if(seen[shard]) gap = sequence - expected[shard]; // 16-bit arithmetic handles wrap-around
+      else seen[shard] = true;
+      expected[shard] = sequence + 1;
+      lost[shard] += gap;
+      return gap;
+   }
+
+   uint64_t shard_sequence_checker::get_frames_lost() const
+   {
+      uint64_t total = 0;
+      for(auto l : lost) total += l;
+      return total;
+   }
+
+   void shard_sequence_checker::print() const
+   {
+      for(int shard = 0; shard < shard_selector::max_shards; ++shard)
+      {
+         if(!seen[shard]) continue;
+         std::cout << "[MESYTEC] : shard " << shard << " : " << received[shard] << " frames received, "
+                   << lost[shard] << " frames lost\n";
+      }
+   }
+}
@@ -0,0 +1,96 @@
+#ifndef MESYTEC_SHARDING_H
+#define MESYTEC_SHARDING_H
+
+#include "mesytec_data.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class shard_selector
+      @brief choose which shard of a sharded stream each event is published in
+
+      Policies:
+        + event_counter : shard = event counter % number of shards (all modules of an event always go to the same
+          consumer, and consumers can re-merge shards in event order)
+        + round_robin : events are distributed in turn to each shard (most even load)
+        + tgv_slice : shard = (TGV timestamp / slice width) % number of shards, i.e. each consumer receives
+          all events of successive time slices (for analyses needing time-correlated events)
+
+      ~~~~{.cpp}
+      mesytec::shard_selector shards(4, mesytec::shard_selector::policy_from_string("tgv"), 1000000);
+      auto shard = shards.select(event);
+      ~~~~
+    */
+   class shard_selector
+   {
+   public:
+      enum class policy { event_counter, round_robin, tgv_slice };
+      static const int max_shards = 128;
+
+   private:
+      unsigned int number_of_shards;
+      policy shard_policy;
+      uint64_t tgv_slice_width;
+      unsigned int next_shard{0};
+
+   public:
+      shard_selector(unsigned int number_of_shards, policy p = policy::event_counter, uint64_t tgv_slice_width = 1);
+
+      unsigned int select(const event& ev)
+      {
+         // returns shard number for event
+         switch(shard_policy)
+         {
+            case policy::event_counter:
+               return ev.get_event_counter() % number_of_shards;
+            case policy::round_robin:
+               if(next_shard == number_of_shards) next_shard = 0;
+               return next_shard++;
+            case policy::tgv_slice:
+               break;
+         }
+         uint64_t ts = ((uint64_t)ev.get_tgv_ts_hi() << 32) | ((uint64_t)ev.get_tgv_ts_mid() << 16) | ev.get_tgv_ts_lo();
+         return (ts / tgv_slice_width) % number_of_shards;
+      }
+      unsigned int get_number_of_shards() const { return number_of_shards; }
+
+      static policy policy_from_string(const std::string& name);
+   };
+
+   /**
+      @class shard_sequence_checker
+      @brief detect frames lost from the shards of a sharded stream
+
+      Call check() with each MFM frame received: the sequence numbers written in the frames by the transmitter
+      (see set_mfm_frame_shard()) are followed for each shard, and any gap is counted as lost frames.
+      Frames which are not sharded are ignored.
+    */
+   class shard_sequence_checker
+   {
+      std::vector<uint16_t> expected;
+      std::vector<bool> seen;
+      std::vector<uint64_t> received, lost;
+
+   public:
+      shard_sequence_checker();
+
+      uint64_t check(const uint8_t* frame);
+
+      /**
+         @return total number of frames lost in all shards
+       */
+      uint64_t get_frames_lost() const;
+      uint64_t get_frames_lost(int shard) const { return lost[shard]; }
+      uint64_t get_frames_received(int shard) const { return received[shard]; }
+      /**
+         @return true if frames have been received for given shard
+       */
+      bool has_shard(int shard) const { return seen[shard]; }
+      void print() const;
+   };
+}
+
+#endif // MESYTEC_SHARDING_H
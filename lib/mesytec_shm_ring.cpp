@@ -0,0 +1,362 @@
+#include "mesytec_shm_ring.h"
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mesytec
+{
+   namespace
+   {
+      const char shm_ring_magic[8] = {'M','E','S','Y','S','H','M','R'};
+      const uint32_t shm_ring_version = 1;
+      const size_t shm_ring_header_size = 4096; // data area is page-aligned
+
+      uint64_t record_size(size_t message_size)
+      {
+         return (sizeof(shm_ring_record) + message_size + 7) & ~uint64_t(7);
+      }
+
+      // futexes are used between processes: no FUTEX_PRIVATE_FLAG
+      void futex_wait(std::atomic<uint32_t>& f, uint32_t value, int timeout_ms)
+      {
+         struct timespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+         syscall(SYS_futex, reinterpret_cast<uint32_t*>(&f), FUTEX_WAIT, value, &ts, nullptr, 0);
+      }
+      void futex_wake(std::atomic<uint32_t>& f)
+      {
+         syscall(SYS_futex, reinterpret_cast<uint32_t*>(&f), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+      }
+   }
+
+   shm_ring_producer::shm_ring_producer(const std::string &name, size_t _capacity, bool _blocking)
+      : path{"/dev/shm/" + name}, blocking{_blocking}
+   {
+      /// \param[in] name name of ring (file in /dev/shm), used by consumers to connect to it
+      /// \param[in] _capacity size in bytes of data area (rounded up to a power of 2). Messages larger than half
+      ///            of the capacity cannot be written.
+      /// \param[in] _blocking if true, reserve() waits for lossless consumers to free space instead of dropping messages
+      ///
+      /// Any existing ring with the same name is replaced: consumers still connected to it see producer_closed().
+
+      capacity = 4096;
+      while(capacity < _capacity) capacity <<= 1;
+      map_size = shm_ring_header_size + capacity;
+
+      unlink(path.c_str());
+      int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+      if(fd < 0) throw std::runtime_error("shm_ring_producer: cannot create " + path + " : " + strerror(errno));
+      fchmod(fd, 0666); // not restricted by umask: consumers may run as other users
+      if(ftruncate(fd, map_size))
+      {
+         close(fd);
+         unlink(path.c_str());
+         throw std::runtime_error("shm_ring_producer: cannot allocate " + std::to_string(map_size) + " bytes for " + path);
+      }
+      auto m = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if(m == MAP_FAILED)
+      {
+         unlink(path.c_str());
+         throw std::runtime_error("shm_ring_producer: cannot map " + path);
+      }
+      // new file is zero-filled: all counters & consumer slots are initialised
+      header = static_cast<shm_ring_header*>(m);
+      data = static_cast<uint8_t*>(m) + shm_ring_header_size;
+      header->version = shm_ring_version;
+      header->header_size = shm_ring_header_size;
+      header->capacity = capacity;
+      std::atomic_thread_fence(std::memory_order_release);
+      // consumers only accept the ring once the magic is written
+      memcpy(header->magic, shm_ring_magic, 8);
+   }
+
+   shm_ring_producer::~shm_ring_producer()
+   {
+      header->closed.store(1, std::memory_order_seq_cst);
+      header->data_futex.fetch_add(1, std::memory_order_release);
+      futex_wake(header->data_futex);
+      munmap(header, map_size);
+      unlink(path.c_str());
+   }
+
+   uint64_t shm_ring_producer::lossless_read_position() const
+   {
+      // position of oldest message not yet released by a lossless consumer
+      // (= write position if there are none)
+
+      auto min = header->write_position.load(std::memory_order_relaxed);
+      for(auto& c : header->consumers)
+      {
+         if(c.in_use.load(std::memory_order_seq_cst) != 1 || c.lossy) continue;
+         auto r = c.read_position.load(std::memory_order_acquire);
+         if(r < min) min = r;
+      }
+      return min;
+   }
+
+   bool shm_ring_producer::remove_dead_consumers()
+   {
+      // free slots of lossless consumers whose process no longer exists (crashed without releasing their slot),
+      // which would otherwise hold back the producer forever. returns true if any were removed.
+
+      bool removed = false;
+      for(auto& c : header->consumers)
+      {
+         if(c.in_use.load(std::memory_order_acquire) != 1 || c.lossy) continue;
+         if(kill(c.pid, 0) && errno == ESRCH)
+         {
+            c.in_use.store(0, std::memory_order_release);
+            removed = true;
+         }
+      }
+      return removed;
+   }
+
+   uint8_t *shm_ring_producer::reserve(size_t size)
+   {
+      /// \param[in] size size of message in bytes
+      /// \returns pointer to space for the message in the ring, or nullptr if there is no room for it
+      ///          (message is counted as dropped)
+      ///
+      /// The message is published by calling commit() once it has been written.
+
+      auto rec = record_size(size);
+      if(rec > capacity/2)
+      {
+         header->messages_dropped.fetch_add(1, std::memory_order_relaxed);
+         return nullptr;
+      }
+      auto w = header->write_position.load(std::memory_order_relaxed);
+      auto contiguous = capacity - (w & (capacity-1));
+      // messages are never split: if it does not fit before the end of the data area, skip to the beginning
+      uint64_t need = rec + (contiguous < rec ? contiguous : 0);
+
+      while(w + need - lossless_read_position() > capacity)
+      {
+         // ring is full. from time to time, check that it is not full because a consumer died.
+         if((full_count++ % 4096) == 0 && remove_dead_consumers()) continue;
+         if(!blocking || header->closed.load(std::memory_order_relaxed))
+         {
+            header->messages_dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+         }
+         auto v = header->space_futex.load(std::memory_order_acquire);
+         header->producer_waiting.store(1, std::memory_order_seq_cst);
+         if(w + need - lossless_read_position() > capacity) futex_wait(header->space_futex, v, 10);
+         header->producer_waiting.store(0, std::memory_order_relaxed);
+      }
+
+      // lossy consumers check reserve_end after reading a message to know if it was overwritten
+      header->reserve_end.store(w + need, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      if(contiguous < rec)
+      {
+         reinterpret_cast<shm_ring_record*>(data + (w & (capacity-1)))->size = shm_ring_record::wrap_marker;
+         w += contiguous;
+      }
+      reserved_position = w;
+      return data + (w & (capacity-1)) + sizeof(shm_ring_record);
+   }
+
+   void shm_ring_producer::commit(size_t size)
+   {
+      /// \param[in] size size of message in bytes (not larger than the size given to the preceding reserve())
+
+      auto record = reinterpret_cast<shm_ring_record*>(data + (reserved_position & (capacity-1)));
+      record->size = size;
+      record->reserved = 0;
+      header->write_position.store(reserved_position + record_size(size), std::memory_order_seq_cst);
+      header->messages_written.fetch_add(1, std::memory_order_relaxed);
+      header->data_futex.fetch_add(1, std::memory_order_release);
+      if(header->consumers_waiting.load(std::memory_order_seq_cst)) futex_wake(header->data_futex);
+   }
+
+   bool shm_ring_producer::write(const void *message, size_t size)
+   {
+      /// \param[in] message data to copy into ring
+      /// \param[in] size size of message in bytes
+      /// \returns false if message was dropped (no room in ring)
+
+      auto dest = reserve(size);
+      if(!dest) return false;
+      memcpy(dest, message, size);
+      commit(size);
+      return true;
+   }
+
+   shm_ring_consumer::shm_ring_consumer(const std::string &name, bool _lossy)
+      : path{"/dev/shm/" + name}, lossy{_lossy}
+   {
+      /// \param[in] name name of ring given to shm_ring_producer
+      /// \param[in] _lossy if true, consumer never holds back the producer and may lose messages if it is too slow
+
+      int fd = open(path.c_str(), O_RDWR);
+      if(fd < 0) throw std::runtime_error("shm_ring_consumer: cannot open " + path + " : " + strerror(errno));
+      struct stat st;
+      if(fstat(fd, &st) || (size_t)st.st_size < shm_ring_header_size)
+      {
+         close(fd);
+         throw std::runtime_error("shm_ring_consumer: " + path + " is not a shared memory ring");
+      }
+      inode = st.st_ino;
+      map_size = st.st_size;
+      auto m = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if(m == MAP_FAILED) throw std::runtime_error("shm_ring_consumer: cannot map " + path);
+      header = static_cast<shm_ring_header*>(m);
+      if(memcmp(header->magic, shm_ring_magic, 8) || header->version != shm_ring_version
+            || header->header_size + header->capacity != map_size)
+      {
+         munmap(m, map_size);
+         throw std::runtime_error("shm_ring_consumer: " + path + " is not a shared memory ring (or is being created)");
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      data = static_cast<uint8_t*>(m) + header->header_size;
+      capacity = header->capacity;
+
+      for(int i = 0; i < shm_ring_header::max_consumers; ++i)
+      {
+         uint32_t free_slot = 0;
+         if(header->consumers[i].in_use.compare_exchange_strong(free_slot, 2))
+         {
+            slot = i;
+            break;
+         }
+      }
+      if(slot < 0)
+      {
+         munmap(m, map_size);
+         throw std::runtime_error("shm_ring_consumer: too many consumers for " + path);
+      }
+      auto& c = my_slot();
+      c.lossy = lossy;
+      c.pid = getpid();
+      c.overruns.store(0, std::memory_order_relaxed);
+      c.read_position.store(header->write_position.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+      c.in_use.store(1, std::memory_order_seq_cst);
+      // start reading with the next message published after the producer can see this consumer
+      position = next_position = header->write_position.load(std::memory_order_seq_cst);
+      c.read_position.store(next_position, std::memory_order_release);
+   }
+
+   shm_ring_consumer::~shm_ring_consumer()
+   {
+      my_slot().in_use.store(0, std::memory_order_release);
+      if(header->producer_waiting.load(std::memory_order_seq_cst))
+      {
+         header->space_futex.fetch_add(1, std::memory_order_release);
+         futex_wake(header->space_futex);
+      }
+      munmap(header, map_size);
+   }
+
+   bool shm_ring_consumer::overwritten(uint64_t begin) const
+   {
+      // true if producer has started to write over data at position begin
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return header->reserve_end.load(std::memory_order_relaxed) > begin + capacity;
+   }
+
+   const uint8_t *shm_ring_consumer::next(uint32_t &size, int timeout_ms)
+   {
+      /// \param[out] size size of message in bytes
+      /// \param[in] timeout_ms maximum time to wait for a message [ms] (<0: wait forever)
+      /// \returns pointer to message in ring, or nullptr if there was none before the timeout (or producer closed)
+      ///
+      /// The message stays valid until release() is called, which must be done before calling next() again.
+
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+      while(1)
+      {
+         auto w = header->write_position.load(std::memory_order_acquire);
+         if(next_position != w)
+         {
+            auto s = reinterpret_cast<const shm_ring_record*>(data + (next_position & (capacity-1)))->size;
+            if(lossy && overwritten(next_position))
+            {
+               // overtaken by producer: continue with the latest message
+               my_slot().overruns.fetch_add(1, std::memory_order_relaxed);
+               next_position = w;
+               continue;
+            }
+            if(s == shm_ring_record::wrap_marker)
+            {
+               next_position += capacity - (next_position & (capacity-1));
+               continue;
+            }
+            position = next_position;
+            next_position += record_size(s);
+            size = s;
+            return data + (position & (capacity-1)) + sizeof(shm_ring_record);
+         }
+         if(header->closed.load(std::memory_order_acquire)) return nullptr;
+
+         int wait_ms = 100;
+         if(timeout_ms >= 0)
+         {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if(remaining <= 0) return nullptr;
+            if(remaining < wait_ms) wait_ms = remaining;
+         }
+         auto v = header->data_futex.load(std::memory_order_acquire);
+         header->consumers_waiting.fetch_add(1, std::memory_order_seq_cst);
+         if(header->write_position.load(std::memory_order_seq_cst) == next_position) futex_wait(header->data_futex, v, wait_ms);
+         header->consumers_waiting.fetch_sub(1, std::memory_order_relaxed);
+      }
+   }
+
+   bool shm_ring_consumer::release()
+   {
+      /// Release the message returned by the last call to next(), i.e. the producer may overwrite it.
+      ///
+      /// \returns false (lossy consumers only) if the message was overwritten while it was being used, in which
+      ///          case whatever was read from it must be discarded
+
+      if(lossy)
+      {
+         if(!overwritten(position)) return true;
+         my_slot().overruns.fetch_add(1, std::memory_order_relaxed);
+         return false;
+      }
+      my_slot().read_position.store(next_position, std::memory_order_seq_cst);
+      if(header->producer_waiting.load(std::memory_order_seq_cst))
+      {
+         header->space_futex.fetch_add(1, std::memory_order_release);
+         futex_wake(header->space_futex);
+      }
+      return true;
+   }
+
+   bool shm_ring_consumer::read(std::vector<uint8_t> &message, int timeout_ms)
+   {
+      /// \param[out] message copy of next message
+      /// \param[in] timeout_ms maximum time to wait for a message [ms] (<0: wait forever)
+      /// \returns false if there was no message before the timeout (or producer closed)
+
+      uint32_t size;
+      while(auto msg = next(size, timeout_ms))
+      {
+         message.assign(msg, msg + size);
+         if(release()) return true;
+      }
+      return false;
+   }
+
+   bool shm_ring_consumer::producer_closed() const
+   {
+      if(header->closed.load(std::memory_order_acquire)) return true;
+      // producer crashed & was restarted: a new ring replaced this one
+      struct stat st;
+      return stat(path.c_str(), &st) || (uint64_t)st.st_ino != inode;
+   }
+}
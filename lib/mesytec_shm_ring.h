@@ -0,0 +1,166 @@
+#ifndef MESYTEC_SHM_RING_H
+#define MESYTEC_SHM_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @struct shm_ring_consumer_slot
+      @brief state of one consumer of a shared memory ring
+    */
+   struct shm_ring_consumer_slot
+   {
+      std::atomic<uint32_t> in_use;        ///< 0=free, 1=reading, 2=being initialised
+      uint32_t lossy;                      ///< lossy (spy) consumers never hold back the producer
+      std::atomic<uint64_t> read_position;
+      std::atomic<uint64_t> overruns;      ///< number of times a lossy consumer was overtaken by the producer
+      int64_t pid;
+   };
+
+   /**
+      @struct shm_ring_record
+      @brief header in front of each message in a shared memory ring
+    */
+   struct shm_ring_record
+   {
+      static const uint32_t wrap_marker = 0xffffffff;
+      uint32_t size;
+      uint32_t reserved;
+   };
+
+   /**
+      @struct shm_ring_header
+      @brief layout of the beginning of a shared memory ring (see shm_ring_producer)
+
+      The header is followed by `capacity` bytes of data. Each message in the data area is preceded by
+      a shm_ring_record (8 bytes), and records are aligned to 8 bytes. A message is never split: if there
+      is not enough room before the end of the data area, a record with size=shm_ring_record::wrap_marker
+      tells consumers to continue from the beginning.
+
+      Positions (write_position, read_position) count bytes since the ring was created: the offset in the
+      data area is position % capacity.
+    */
+   struct shm_ring_header
+   {
+      static const int max_consumers = 16;
+
+      char magic[8];                                 ///< "MESYSHMR"
+      uint32_t version;
+      uint32_t header_size;
+      uint64_t capacity;                             ///< size of data area (power of 2)
+      std::atomic<uint32_t> closed;                  ///< set when producer exits
+      std::atomic<uint32_t> data_futex;              ///< incremented when data is published
+      std::atomic<uint32_t> consumers_waiting;       ///< number of consumers waiting on data_futex
+      std::atomic<uint32_t> space_futex;             ///< incremented when lossless consumers release data
+      std::atomic<uint32_t> producer_waiting;        ///< set while producer waits on space_futex
+      uint32_t unused;
+      std::atomic<uint64_t> write_position;          ///< end of last published message
+      std::atomic<uint64_t> reserve_end;             ///< end of region being written by producer (for lossy consumers)
+      std::atomic<uint64_t> messages_written;
+      std::atomic<uint64_t> messages_dropped;        ///< messages not written because ring was full
+      shm_ring_consumer_slot consumers[max_consumers];
+   };
+
+   /**
+      @class shm_ring_producer
+      @brief single-producer/multiple-consumer message ring in shared memory (/dev/shm), for local consumers
+
+      Consumers (shm_ring_consumer) on the same host read messages directly from shared memory instead of
+      receiving them through a TCP socket. Each consumer has its own cursor: lossless consumers hold back
+      the producer (when the ring is full, new messages are dropped, or the producer waits if `blocking`),
+      lossy consumers ('spies') never do, and skip messages which were overwritten before they read them.
+
+      Consumers sleep on a futex when there is no data; the producer only makes the wake-up system call
+      when a consumer is actually waiting.
+
+      ~~~~{.cpp}
+      mesytec::shm_ring_producer ring("mesytec_mfm", 64*1024*1024);
+      if(auto dest = ring.reserve(frame_size))
+      {
+         \// build message in dest...
+         ring.commit(frame_size);
+      }
+      ~~~~
+    */
+   class shm_ring_producer
+   {
+      std::string path;
+      shm_ring_header* header{nullptr};
+      uint8_t* data{nullptr};
+      size_t map_size{0};
+      uint64_t capacity{0};
+      bool blocking;
+      uint64_t reserved_position{0};
+      uint64_t full_count{0};
+
+      uint64_t lossless_read_position() const;
+      bool remove_dead_consumers();
+   public:
+      shm_ring_producer(const std::string& name, size_t capacity, bool blocking=false);
+      ~shm_ring_producer();
+      shm_ring_producer(const shm_ring_producer&)=delete;
+      shm_ring_producer& operator=(const shm_ring_producer&)=delete;
+
+      uint8_t* reserve(size_t size);
+      void commit(size_t size);
+      bool write(const void* message, size_t size);
+
+      uint64_t get_messages_written() const { return header->messages_written.load(std::memory_order_relaxed); }
+      uint64_t get_messages_dropped() const { return header->messages_dropped.load(std::memory_order_relaxed); }
+   };
+
+   /**
+      @class shm_ring_consumer
+      @brief read messages from a shared memory ring created by shm_ring_producer
+
+      ~~~~{.cpp}
+      mesytec::shm_ring_consumer ring("mesytec_mfm");
+      uint32_t size;
+      while(auto msg = ring.next(size, 100))
+      {
+         \// use msg...
+         if(!ring.release()) { \// (lossy consumers only) msg was overwritten while in use: discard }
+      }
+      ~~~~
+    */
+   class shm_ring_consumer
+   {
+      std::string path;
+      shm_ring_header* header{nullptr};
+      uint8_t* data{nullptr};
+      size_t map_size{0};
+      int slot{-1};
+      bool lossy;
+      uint64_t capacity{0};
+      uint64_t inode{0};
+      uint64_t position{0};     // read position of current message
+      uint64_t next_position{0};
+
+      shm_ring_consumer_slot& my_slot() { return header->consumers[slot]; }
+      bool overwritten(uint64_t begin) const;
+   public:
+      shm_ring_consumer(const std::string& name, bool lossy=false);
+      ~shm_ring_consumer();
+      shm_ring_consumer(const shm_ring_consumer&)=delete;
+      shm_ring_consumer& operator=(const shm_ring_consumer&)=delete;
+
+      const uint8_t* next(uint32_t& size, int timeout_ms);
+      bool release();
+      bool read(std::vector<uint8_t>& message, int timeout_ms);
+
+      /**
+         @return true if the producer has exited (consumer should be recreated to connect to a new ring)
+       */
+      bool producer_closed() const;
+      /**
+         @return number of times a lossy consumer lost messages because it was overtaken by the producer
+       */
+      uint64_t get_overruns() const { return header->consumers[slot].overruns.load(std::memory_order_relaxed); }
+   };
+}
+
+#endif // MESYTEC_SHM_RING_H
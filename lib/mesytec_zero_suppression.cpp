@@ -0,0 +1,172 @@
+#include "mesytec_zero_suppression.h"
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace mesytec
+{
+   zero_suppression::zero_suppression(const experimental_setup &_setup)
+      : setup{&_setup}
+   {
+      /// \param[in] _setup description of crate: tables are set up for each VMMR module it contains
+
+      setup->for_each_module([&](module& mod){
+         if(mod.is_vmmr_module()) channels[mod.id].resize(mod.get_number_of_buses()*128);
+      });
+   }
+
+   void zero_suppression::set_channel(uint8_t mod_id, uint8_t bus, uint8_t subaddress, float pedestal, float threshold)
+   {
+      /// \param[in] mod_id address of VMMR module
+      /// \param[in] bus bus number
+      /// \param[in] subaddress channel subaddress on bus
+      /// \param[in] pedestal pedestal of channel
+      /// \param[in] threshold ADC data <= pedestal + threshold are suppressed
+      ///
+      /// Throws std::invalid_argument if the module is not a VMMR or the bus/subaddress is out of range.
+
+      auto c = get_channel(mod_id, bus, subaddress);
+      if(!c || subaddress > 127)
+         throw std::invalid_argument("zero_suppression: no VMMR channel with module=" + std::to_string(mod_id)
+                                     + " bus=" + std::to_string(bus) + " subaddress=" + std::to_string(subaddress));
+      c->pedestal = pedestal;
+      c->threshold = threshold;
+      c->defined = true;
+   }
+
+   void zero_suppression::read_table(const std::string &table_file)
+   {
+      /// \param[in] table_file full path to file with a line for each channel:
+      ///
+      ///~~~
+      /// # mod-id, bus, subaddress, pedestal, threshold
+      /// 0x30,0,12,102.5,9.3
+      ///~~~
+      ///
+      /// Empty lines and lines beginning with '#' are ignored. Throws std::runtime_error if the file cannot
+      /// be read or a line cannot be decoded.
+
+      std::ifstream file(table_file);
+      if(!file.good())
+         throw std::runtime_error("zero_suppression: failed to open file " + table_file);
+      std::string line;
+      int line_number = 0;
+      while(std::getline(file, line))
+      {
+         ++line_number;
+         auto first = line.find_first_not_of(" \t\r");
+         if(first == std::string::npos || line[first] == '#') continue;
+         std::istringstream ss(line);
+         std::string field[5];
+         for(auto& f : field) std::getline(ss, f, ',');
+         try {
+            set_channel(std::stoi(field[0], nullptr, 0), std::stoi(field[1], nullptr, 0), std::stoi(field[2], nullptr, 0),
+                        std::stof(field[3]), std::stof(field[4]));
+         }
+         catch(std::exception& e) {
+            throw std::runtime_error("zero_suppression: problem decoding line " + std::to_string(line_number)
+                                     + " of " + table_file + " : " + e.what() + " [" + line + "]");
+         }
+      }
+   }
+
+   void zero_suppression::write_table(const std::string &table_file) const
+   {
+      /// \param[in] table_file file to write with the pedestal & threshold of each channel for which they are defined
+      ///
+      /// The file can be read with read_table(). Throws std::runtime_error if the file cannot be written.
+
+      std::ofstream file(table_file);
+      if(!file.good())
+         throw std::runtime_error("zero_suppression: failed to open file " + table_file);
+      file << "# mod-id, bus, subaddress, pedestal, threshold\n";
+      for(int mod_id = 0; mod_id < 256; ++mod_id)
+      {
+         auto& c = channels[mod_id];
+         for(size_t i = 0; i < c.size(); ++i)
+         {
+            if(!c[i].defined) continue;
+            file << "0x" << std::hex << mod_id << std::dec << "," << i/128 << "," << i%128 << ","
+                 << c[i].pedestal << "," << c[i].threshold << "\n";
+         }
+      }
+      if(!file.good())
+         throw std::runtime_error("zero_suppression: error writing file " + table_file);
+   }
+
+   void zero_suppression::finish_learning(double n_sigma)
+   {
+      /// \param[in] n_sigma threshold of each channel is set to n_sigma times the standard deviation of its pedestal
+      ///
+      /// Pedestals & thresholds are set for each channel which received at least 2 data during learning,
+      /// and learning is stopped.
+
+      for(auto& mod : channels)
+      {
+         for(auto& c : mod)
+         {
+            if(c.n < 2) continue;
+            c.pedestal = c.mean;
+            c.threshold = n_sigma*std::sqrt(c.m2/(c.n - 1));
+            c.defined = true;
+            c.n = 0;
+            c.mean = c.m2 = 0;
+         }
+      }
+      learning = false;
+   }
+
+   size_t zero_suppression::apply(event &ev)
+   {
+      /// \param[in,out] ev event from which to remove suppressed data
+      /// \returns number of data words removed
+
+      size_t removed = 0;
+      for(auto& mod_data : ev.modules)
+      {
+         auto id = mod_data.get_module_id();
+         auto& c = channels[id];
+         if(c.empty()) continue;
+         auto& mod = setup->get_module(id);
+
+         if(learning)
+         {
+            for(auto& d : mod_data.get_channel_data())
+            {
+               auto w = d.get_data_word();
+               if(!is_vmmr_adc_data(w)) continue;
+               size_t index = mod.get_bus_number(w)*128 + mod.get_channel_number(w);
+               if(index >= c.size()) continue;
+               auto& ch = c[index];
+               double x = w & data_flags::vmmr_adc_mask;
+               ++ch.n;
+               double delta = x - ch.mean;
+               ch.mean += delta/ch.n;
+               ch.m2 += delta*(x - ch.mean);
+            }
+            continue;
+         }
+
+         words_tested += mod_data.get_channel_data().size();
+         removed += mod_data.remove_data_if([&](channel_data& d){
+            auto w = d.get_data_word();
+            if(!is_vmmr_adc_data(w)) return false;
+            size_t index = mod.get_bus_number(w)*128 + mod.get_channel_number(w);
+            if(index >= c.size() || !c[index].defined) return false;
+            auto& ch = c[index];
+            float x = w & data_flags::vmmr_adc_mask;
+            if(x <= ch.pedestal + ch.threshold) return true;
+            if(subtract)
+            {
+               uint16_t v = x > ch.pedestal ? std::lround(x - ch.pedestal) : 0;
+               d.set_data(v, (w & ~data_flags::vmmr_adc_mask) | v);
+            }
+            return false;
+         }, VMMR);
+      }
+      words_suppressed += removed;
+      if(removed) ev.remove_empty_modules();
+      return removed;
+   }
+}
@@ -0,0 +1,88 @@
+#ifndef MESYTEC_ZERO_SUPPRESSION_H
+#define MESYTEC_ZERO_SUPPRESSION_H
+
+#include "mesytec_data.h"
+#include "mesytec_experimental_setup.h"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mesytec
+{
+   /**
+      @class zero_suppression
+      @brief pedestal subtraction and threshold suppression of VMMR ADC data
+
+      For each (VMMR module, bus, subaddress) a pedestal and a threshold can be defined: ADC data
+      which are not above pedestal + threshold are removed from the event (module headers are updated with
+      the new number of data words, see module_data::remove_data_if()), and modules which are left without
+      data are removed. Optionally the pedestal is subtracted from the ADC data which are kept.
+      TDC data, data from other modules and data from channels without pedestal are never suppressed.
+
+      Pedestals are learned from a pedestal run: after set_learning(true), apply() accumulates the mean and
+      standard deviation of the ADC data of each channel (Welford's running algorithm, no data is suppressed);
+      finish_learning() then sets pedestal = mean and threshold = n_sigma * standard deviation for each channel,
+      and the table can be written with write_table() for later runs:
+
+      ~~~~{.cpp}
+      mesytec::zero_suppression zs(setup);
+      zs.read_table("pedestals.dat");
+      zs.apply(event); \// before writing MFM frame
+      ~~~~
+
+      Data words may be either decoded or raw (as stored by the MVLC parser): they are decoded here.
+    */
+   class zero_suppression
+   {
+      struct channel
+      {
+         float pedestal{0};
+         float threshold{0};
+         bool defined{false};
+         // running statistics for learning
+         uint64_t n{0};
+         double mean{0};
+         double m2{0};
+      };
+
+      const experimental_setup* setup;
+      // for each VMMR module: channels indexed by bus*128+subaddress
+      std::array<std::vector<channel>, 256> channels;
+      bool subtract{false};
+      bool learning{false};
+      uint64_t words_tested{0};
+      uint64_t words_suppressed{0};
+
+      channel* get_channel(uint8_t mod_id, uint8_t bus, uint8_t subaddress)
+      {
+         auto& c = channels[mod_id];
+         size_t index = bus*128 + subaddress;
+         return index < c.size() ? &c[index] : nullptr;
+      }
+
+   public:
+      zero_suppression(const experimental_setup& setup);
+
+      void set_channel(uint8_t mod_id, uint8_t bus, uint8_t subaddress, float pedestal, float threshold);
+      void read_table(const std::string& table_file);
+      void write_table(const std::string& table_file) const;
+      /**
+         if true, the pedestal is subtracted from ADC data which are kept (negative values are set to 0)
+       */
+      void set_subtract_pedestals(bool s) { subtract = s; }
+      /**
+         if true, apply() only accumulates statistics for pedestals (see finish_learning())
+       */
+      void set_learning(bool l) { learning = l; }
+      bool is_learning() const { return learning; }
+      void finish_learning(double n_sigma);
+
+      size_t apply(event& ev);
+
+      uint64_t get_words_tested() const { return words_tested; }
+      uint64_t get_words_suppressed() const { return words_suppressed; }
+   };
+}
+
+#endif // MESYTEC_ZERO_SUPPRESSION_H
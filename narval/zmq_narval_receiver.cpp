@@ -1,12 +1,57 @@
 #include "zmq_narval_receiver.h"
+#include "../lib/mesytec_latency_histogram.h"
+#include <chrono>
 #include <iostream>
+#include <thread>
+
+// latencies [ns] of the recv->copy path in process_block
+mesytec::latency_histogram recv_latency;  // zmq recv call which returned a frame
+mesytec::latency_histogram copy_latency;  // copy of frame into output buffer
+mesytec::latency_histogram block_latency; // whole process_block call
+
+void print_latencies()
+{
+   std::cout << "[ZMQ] : process_block latencies:\n";
+   recv_latency.print("  recv");
+   if(shard_checker.get_frames_lost()) shard_checker.print();
+   copy_latency.print("  copy");
+   block_latency.print("  process_block");
+}
 
 /* Functions called on "Init" */
 void process_config (char *directory_path, unsigned int *error_code)
 {
    zmq_port = directory_path; // pass ZMQ port to subscribe to in 'algo_path'
    printf ("\n[ZMQ] : ***process_config*** called\n");
-   printf ("[ZMQ] : MESYTECSpy port = %s\n",zmq_port.c_str());
+   if(zmq_port.compare(0, 6, "shm://") == 0)
+   {
+      // read shared memory ring "shm://name" or "shm://name,lossy"
+      shm_name = zmq_port.substr(6);
+      auto comma = shm_name.find(',');
+      if(comma != std::string::npos)
+      {
+         shm_lossy = (shm_name.substr(comma+1) == "lossy");
+         shm_name.erase(comma);
+      }
+      printf ("[ZMQ] : MESYTECSpy shared memory ring = %s%s\n",shm_name.c_str(),shm_lossy?" (lossy)":"");
+   }
+   else
+   {
+      // optional subscription to events with given topic "tcp://host:port,physics"
+      auto comma = zmq_port.find(',');
+      if(comma != std::string::npos)
+      {
+         try {
+            subscription = mesytec::event_topic::subscription(zmq_port.substr(comma+1));
+         } catch (std::exception &e) {
+            std::cout << "[ZMQ] : ERROR: " << "process_config: " << e.what () << std::endl;
+            *error_code = 1;
+            return;
+         }
+         zmq_port.erase(comma);
+      }
+      printf ("[ZMQ] : MESYTECSpy port = %s\n",zmq_port.c_str());
+   }
    *error_code = 0;
 }
 
@@ -35,6 +80,22 @@ void process_start (struct my_struct *,
 {
    std::cout << "[ZMQ] : ***process_start*** called\n";
 
+   if(!shm_name.empty())
+   {
+      try {
+         shm_ring.reset(new mesytec::shm_ring_consumer(shm_name, shm_lossy));
+      } catch (std::exception &e) {
+         std::cout << "[ZMQ] : ERROR: " << "process_start: " << e.what () << std::endl;
+         *error_code = 1;
+         return;
+      }
+      shm_frame = nullptr;
+      std::cout << "[ZMQ] : reading shared memory ring " << shm_name << std::endl;
+      time(&current_time);
+      *error_code = 0;
+      return;
+   }
+
    // start zmq receiver here (probably)
    try {
       pub = new zmq::socket_t(context, ZMQ_SUB);
@@ -54,9 +115,9 @@ void process_start (struct my_struct *,
       std::cout << "[ZMQ] : ERROR" << "process_start: failed to bind ZeroMQ endpoint " << zmq_port << ": " << e.what () << std::endl;
    }
 #ifdef ZMQ_SETSOCKOPT_DEPRECATED
-   pub->set(zmq::sockopt::subscribe,"");
+   pub->set(zmq::sockopt::subscribe,subscription);
 #else
-   pub->setsockopt(ZMQ_SUBSCRIBE, "", 0);
+   pub->setsockopt(ZMQ_SUBSCRIBE, subscription.data(), subscription.size());
 #endif
    std::cout << "[ZMQ] : SUBSCRIBED to ZMQ PUBlisher " << zmq_port << std::endl;
 
@@ -67,6 +128,65 @@ void process_start (struct my_struct *,
 
 }
 
+bool receive_frame()
+{
+   // receive next MFM frame in event. returns false if there was none before the timeout.
+   // when the transmitter publishes topics, each frame is preceded by its topic in a separate part.
+#ifdef ZMQ_USE_RECV_WITH_REFERENCE
+   if(!pub->recv(event)) return false;
+   if(event.more() && !pub->recv(event)) return false;
+#else
+   if(!pub->recv(&event)) return false;
+   if(event.more() && !pub->recv(&event)) return false;
+#endif
+   return true;
+}
+
+void shm_process_block (void *output_buffer,
+                        unsigned int size_of_output_buffer,
+                        unsigned int *used_size_of_output_buffer)
+{
+   // copy frames from shared memory ring to output buffer until full (or no more frames).
+   // a frame which does not fit is kept in the ring (not released) for the next output buffer.
+
+   auto t_block = mesytec::latency_timestamp();
+   int timeout = 500; // milliseconds, wait for first frame only
+   while(1)
+   {
+      auto t_recv = mesytec::latency_timestamp();
+      if(!shm_frame)
+      {
+         if(!(shm_frame = shm_ring->next(shm_frame_size, timeout)))
+         {
+            if(shm_ring->producer_closed())
+            {
+               // transmitter stopped: connect to the new ring if it was restarted
+               std::this_thread::sleep_for(std::chrono::milliseconds(100));
+               try {
+                  shm_ring.reset(new mesytec::shm_ring_consumer(shm_name, shm_lossy));
+               } catch (std::exception&) {}
+            }
+            break;
+         }
+         recv_latency.record(mesytec::latency_timestamp() - t_recv);
+      }
+      timeout = 0;
+      if(*used_size_of_output_buffer+shm_frame_size > size_of_output_buffer) break;
+
+      auto t_copy = mesytec::latency_timestamp();
+      memcpy((unsigned char*)output_buffer + *used_size_of_output_buffer, shm_frame, shm_frame_size);
+      // (lossy) if the frame was overwritten while it was copied, forget it
+      if(shm_ring->release())
+      {
+         shard_checker.check((const uint8_t*)output_buffer + *used_size_of_output_buffer);
+         *used_size_of_output_buffer += shm_frame_size;
+      }
+      shm_frame = nullptr;
+      copy_latency.record(mesytec::latency_timestamp() - t_copy);
+   }
+   block_latency.record(mesytec::latency_timestamp() - t_block);
+}
+
 void process_block (struct my_struct *,
                     void *output_buffer,
                     unsigned int size_of_output_buffer,
@@ -76,15 +196,19 @@ void process_block (struct my_struct *,
    *used_size_of_output_buffer =   0;
    *error_code = 0;
 
+   if(shm_ring)
+   {
+      shm_process_block(output_buffer, size_of_output_buffer, used_size_of_output_buffer);
+      return;
+   }
+
+   auto t_block = mesytec::latency_timestamp();
+
    if(!send_last_event)
    {
       // get first event from ZMQ
       try{
-#ifdef ZMQ_USE_RECV_WITH_REFERENCE
-            if(!pub->recv(event))
-#else
-            if(!pub->recv(&event))
-#endif
+         if(!receive_frame())
          {
             //std::cout << "Got no event from ZMQ" << std::endl;
             return;
@@ -94,6 +218,7 @@ void process_block (struct my_struct *,
          std::cout << "timeout on ZeroMQ endpoint : " << e.what () << std::endl;
          return;
       }
+      recv_latency.record(mesytec::latency_timestamp() - t_block);
    }
 
    send_last_event=false;
@@ -108,26 +233,28 @@ void process_block (struct my_struct *,
       }
 
       // add event to output buffer
+      auto t_copy = mesytec::latency_timestamp();
       memcpy((unsigned char*)output_buffer + *used_size_of_output_buffer, event.data(), event.size());
+      shard_checker.check((const uint8_t*)event.data());
       *used_size_of_output_buffer += event.size();
+      auto t_recv = mesytec::latency_timestamp();
+      copy_latency.record(t_recv - t_copy);
 
       // get next event from ZMQ
       try{
-#ifdef ZMQ_USE_RECV_WITH_REFERENCE
-         if(!pub->recv(event))
-#else
-         if(!pub->recv(&event))
-#endif
+         if(!receive_frame())
          {
             //std::cout << "Got no event from ZMQ" << std::endl;
-            return;
+            break;
          }
       }
       catch(zmq::error_t &e) {
          std::cout << "timeout on ZeroMQ endpoint : " << e.what () << std::endl;
-         return;
+         break;
       }
+      recv_latency.record(mesytec::latency_timestamp() - t_recv);
    }
+   block_latency.record(mesytec::latency_timestamp() - t_block);
 }
 
 /* Functions called on "Stop" */
@@ -135,6 +262,15 @@ void process_stop (struct my_struct *,
                    unsigned int *error_code)
 {
    std::cout << "[ZMQ] : ***process_stop*** called\n";
+   print_latencies();
+   if(!shm_name.empty())
+   {
+      shm_frame = nullptr;
+      shm_ring.reset();
+      *error_code = 0;
+      std::cout << "[ZMQ] : disconnected from shared memory ring\n";
+      return;
+   }
    // delete zmq server here (probably)...
    pub->close();
    *error_code = 0;
@@ -167,6 +303,7 @@ void process_pause (struct my_struct *,
                     unsigned int *error_code)
 {
    std::cout << "[ZMQ] : ***process_pause*** called\n";
+   print_latencies();
    /* put your code here */
    *error_code = 0;
 }
@@ -2,7 +2,11 @@
 #define ZMQ_NARVAL_RECEIVER_H
 
 #include "zmq_compat.h"
+#include "../lib/mesytec_shm_ring.h"
+#include "../lib/mesytec_event_topic.h"
+#include "../lib/mesytec_sharding.h"
 #include <ctime>
+#include <memory>
 
 static int next_id = 0;
 struct my_struct
@@ -17,6 +21,14 @@ zmq::context_t context(1);	// for ZeroMQ communications
 zmq::socket_t *pub;
 zmq::message_t event;
 bool send_last_event=false;
+std::string subscription; // topic prefix when algo_path is "tcp://host:port,subscription"
+mesytec::shard_sequence_checker shard_checker; // frames lost from shards of a sharded transmitter
+// when algo_path is "shm://name[,lossy]", frames are read from a shared memory ring on the same host
+std::string shm_name;
+bool shm_lossy=false;
+std::unique_ptr<mesytec::shm_ring_consumer> shm_ring;
+const uint8_t* shm_frame{nullptr}; // frame which did not fit in last output buffer (not yet released)
+uint32_t shm_frame_size{0};
 
 /* you must have the following symbols */
 /* see John Cresswell document for details : */
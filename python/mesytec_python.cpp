@@ -0,0 +1,117 @@
+#include "mesytec_batch_parser.h"
+#include "mesytec_experimental_setup.h"
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+namespace py = pybind11;
+
+namespace
+{
+   template<typename T>
+   py::array_t<T> column(py::object owner, const T* data, size_t n)
+   {
+      // read-only NumPy view of array of owner (no copy): owner is kept alive as long as the view exists
+      py::array_t<T> a((py::ssize_t)n, data, owner);
+      a.attr("setflags")(py::arg("write") = false);
+      return a;
+   }
+
+   py::list module_list(const mesytec::experimental_setup& setup)
+   {
+      py::list modules;
+      setup.for_each_module([&](mesytec::module& mod){
+         py::dict d;
+         d["id"] = (int)mod.id;
+         d["name"] = mod.name;
+         d["firmware"] = (int)mod.firmware;
+         d["buses"] = mod.get_number_of_buses();
+         modules.append(d);
+      });
+      return modules;
+   }
+}
+
+PYBIND11_MODULE(mesytec, m)
+{
+   m.doc() = "Python bindings for the mesytec_data library: crate description and batch decoding of MFM frames into NumPy arrays";
+
+   py::enum_<mesytec::firmware_t>(m, "firmware")
+         .value("UNKNOWN", mesytec::UNKNOWN)
+         .value("MDPP_SCP", mesytec::MDPP_SCP)
+         .value("MDPP_QDC", mesytec::MDPP_QDC)
+         .value("MDPP_CSI", mesytec::MDPP_CSI)
+         .value("VMMR", mesytec::VMMR)
+         .value("TGV", mesytec::TGV)
+         .value("START_READOUT", mesytec::START_READOUT)
+         .value("END_READOUT", mesytec::END_READOUT)
+         .value("MVLC_SCALER", mesytec::MVLC_SCALER);
+
+   py::enum_<mesytec::module::datatype_t>(m, "datatype")
+         .value("unknown", mesytec::module::unknown)
+         .value("ADC", mesytec::module::ADC)
+         .value("TDC", mesytec::module::TDC)
+         .value("QDC_long", mesytec::module::QDC_long)
+         .value("QDC_short", mesytec::module::QDC_short)
+         .value("Trigger_time", mesytec::module::Trigger_time);
+
+   py::class_<mesytec::experimental_setup>(m, "experimental_setup")
+         .def(py::init<>())
+         .def("read_crate_map", &mesytec::experimental_setup::read_crate_map, py::arg("mapfile"))
+         .def("read_detector_correspondence", &mesytec::experimental_setup::read_detector_correspondence, py::arg("mapfile"))
+         .def("has_module", &mesytec::experimental_setup::has_module, py::arg("mod_id"))
+         .def("number_of_modules", &mesytec::experimental_setup::number_of_modules)
+         .def("modules", &module_list, "list of modules in crate (id, name, firmware, buses)")
+         .def("has_detector", &mesytec::experimental_setup::has_detector, py::arg("mod_id"), py::arg("bus"), py::arg("channel"))
+         .def("get_detector",
+              (std::string (mesytec::experimental_setup::*)(uint8_t, uint8_t, uint8_t) const)&mesytec::experimental_setup::get_detector,
+              py::arg("mod_id"), py::arg("bus"), py::arg("channel"))
+         .def("print", &mesytec::experimental_setup::print);
+
+   py::class_<mesytec::batch_parser>(m, "batch_parser",
+                                     "Decode MFM frames into arrays: see mesytec::batch_parser. The arrays are read-only\n"
+                                     "views of the parser's memory (no copy) which are overwritten by the next call to parse().")
+         .def(py::init<size_t, size_t>(), py::arg("max_events") = 65536, py::arg("max_hits") = 16*1024*1024)
+         .def("read_crate_map", [](mesytec::batch_parser& p, const std::string& f){ p.get_reader().read_crate_map(f); }, py::arg("mapfile"))
+         .def("read_detector_correspondence", [](mesytec::batch_parser& p, const std::string& f){ p.get_reader().read_detector_correspondence(f); },
+              py::arg("mapfile"))
+         .def_property_readonly("setup", &mesytec::batch_parser::get_setup, py::return_value_policy::reference_internal)
+         .def("parse", [](mesytec::batch_parser& p, py::buffer frames, size_t offset)
+         {
+            auto info = frames.request();
+            if(info.ndim != 1 || info.strides[0] != info.itemsize)
+               throw std::invalid_argument("batch_parser.parse: frames must be a contiguous 1-dimensional buffer");
+            size_t nbytes = info.size*info.itemsize;
+            if(offset > nbytes) throw std::invalid_argument("batch_parser.parse: offset beyond end of buffer");
+            py::gil_scoped_release release;
+            return p.parse((const uint8_t*)info.ptr + offset, nbytes - offset);
+         }, py::arg("frames"), py::arg("offset") = 0,
+         "decode MFM frames in buffer (bytes, bytearray, numpy.uint8 array...) starting at offset;\n"
+         "returns number of bytes used (call again with offset + bytes used to continue)")
+         .def_property_readonly("number_of_events", &mesytec::batch_parser::get_number_of_events)
+         .def_property_readonly("number_of_hits", &mesytec::batch_parser::get_number_of_hits)
+         .def_property_readonly("timestamp", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_timestamp(), p.get_number_of_events()); })
+         .def_property_readonly("event_counter", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_event_counter(), p.get_number_of_events()); })
+         .def_property_readonly("event_index", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_event_index(), p.get_number_of_hits()); })
+         .def_property_readonly("module", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_module(), p.get_number_of_hits()); })
+         .def_property_readonly("bus", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_bus(), p.get_number_of_hits()); })
+         .def_property_readonly("channel", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_channel(), p.get_number_of_hits()); })
+         .def_property_readonly("type", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_type(), p.get_number_of_hits()); })
+         .def_property_readonly("value", [](py::object self){
+            auto& p = self.cast<const mesytec::batch_parser&>();
+            return column(self, p.get_value(), p.get_number_of_hits()); });
+}